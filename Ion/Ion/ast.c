@@ -1,9 +1,18 @@
 
-Arena ast_arena;
+// Per thread so that files can be parsed in parallel. Nodes outlive the thread that
+// allocated them since arena blocks are never freed. The bytes allocated are counted in
+// stats, which unlike the arena are folded into the main thread's.
+THREAD_LOCAL Arena ast_arena;
+
+void* ast_arena_alloc(size_t size)
+{
+    stats.num_ast_bytes += ALIGN_UP(size, ARENA_ALIGNMENT);
+    return arena_alloc(&ast_arena, size);
+}
 
 void* ast_alloc(size_t size) {
     assert(size != 0);
-    void* ptr = arena_alloc(&ast_arena, size);
+    void* ptr = ast_arena_alloc(size);
     memset(ptr, 0, size);
     return ptr;
 }
@@ -14,7 +23,7 @@ void* ast_dup(const void* src, size_t size)
     {
         return NULL;
     }
-    void* ptr = arena_alloc(&ast_arena, size);
+    void* ptr = ast_arena_alloc(size);
     memcpy(ptr, src, size);
     return ptr;
 }
@@ -417,4 +426,220 @@ Stmt* stmt_expr(SrcPos pos, Expr* expr)
     return s;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Resolved types
+//
+
+// Resolving records a type on each expression and typespec it visits, and asserts
+// that a second visit agrees. Clearing them lets an AST that outlives a compile, as
+// in watch mode, be resolved again against a fresh set of syms.
+void clear_expr_types(Expr* expr);
+void clear_stmt_block_types(StmtList block);
+
+void clear_typespec_types(Typespec* typespec)
+{
+    if (!typespec)
+    {
+        return;
+    }
+    typespec->type = NULL;
+    switch (typespec->kind)
+    {
+        case TYPESPEC_FUNC:
+            for (size_t i = 0; i < typespec->func.num_args; i++)
+            {
+                clear_typespec_types(typespec->func.args[i]);
+            }
+            clear_typespec_types(typespec->func.ret);
+            break;
+        case TYPESPEC_ARRAY:
+            clear_typespec_types(typespec->base);
+            clear_expr_types(typespec->num_elems);
+            break;
+        case TYPESPEC_PTR:
+        case TYPESPEC_CONST:
+            clear_typespec_types(typespec->base);
+            break;
+        default:
+            break;
+    }
+}
+
+void clear_expr_types(Expr* expr)
+{
+    if (!expr)
+    {
+        return;
+    }
+    expr->type = NULL;
+    switch (expr->kind)
+    {
+        case EXPR_SIZEOF_EXPR:
+            clear_expr_types(expr->sizeof_expr);
+            break;
+        case EXPR_SIZEOF_TYPE:
+            clear_typespec_types(expr->sizeof_type);
+            break;
+        case EXPR_COMPOUND:
+            clear_typespec_types(expr->compound.type);
+            for (size_t i = 0; i < expr->compound.num_fields; i++)
+            {
+                CompoundField* field = &expr->compound.fields[i];
+                clear_expr_types(field->init);
+                if (field->kind == FIELD_INDEX)
+                {
+                    clear_expr_types(field->index);
+                }
+            }
+            break;
+        case EXPR_CAST:
+            clear_typespec_types(expr->cast.type);
+            clear_expr_types(expr->cast.expr);
+            break;
+        case EXPR_UNARY:
+            clear_expr_types(expr->unary.expr);
+            break;
+        case EXPR_BINARY:
+            clear_expr_types(expr->binary.left);
+            clear_expr_types(expr->binary.right);
+            break;
+        case EXPR_TERNARY:
+            clear_expr_types(expr->ternary.cond);
+            clear_expr_types(expr->ternary.if_true);
+            clear_expr_types(expr->ternary.if_false);
+            break;
+        case EXPR_CALL:
+            clear_expr_types(expr->call.expr);
+            for (size_t i = 0; i < expr->call.num_args; i++)
+            {
+                clear_expr_types(expr->call.args[i]);
+            }
+            break;
+        case EXPR_INDEX:
+            clear_expr_types(expr->index.expr);
+            clear_expr_types(expr->index.index);
+            break;
+        case EXPR_FIELD:
+            clear_expr_types(expr->field.expr);
+            break;
+        default:
+            break;
+    }
+}
+
+void clear_decl_types(Decl* decl);
+
+void clear_stmt_types(Stmt* stmt)
+{
+    if (!stmt)
+    {
+        return;
+    }
+    switch (stmt->kind)
+    {
+        case STMT_DECL:
+            clear_decl_types(stmt->decl);
+            break;
+        case STMT_RETURN:
+        case STMT_EXPR:
+            clear_expr_types(stmt->expr);
+            break;
+        case STMT_BLOCK:
+            clear_stmt_block_types(stmt->block);
+            break;
+        case STMT_IF:
+            clear_expr_types(stmt->if_stmt.cond);
+            clear_stmt_block_types(stmt->if_stmt.then_block);
+            for (size_t i = 0; i < stmt->if_stmt.num_elseifs; i++)
+            {
+                clear_expr_types(stmt->if_stmt.elseifs[i].cond);
+                clear_stmt_block_types(stmt->if_stmt.elseifs[i].block);
+            }
+            clear_stmt_block_types(stmt->if_stmt.else_block);
+            break;
+        case STMT_WHILE:
+        case STMT_DO_WHILE:
+            clear_expr_types(stmt->while_stmt.cond);
+            clear_stmt_block_types(stmt->while_stmt.block);
+            break;
+        case STMT_FOR:
+            clear_stmt_types(stmt->for_stmt.init);
+            clear_expr_types(stmt->for_stmt.cond);
+            clear_stmt_types(stmt->for_stmt.next);
+            clear_stmt_block_types(stmt->for_stmt.block);
+            break;
+        case STMT_SWITCH:
+            clear_expr_types(stmt->switch_stmt.expr);
+            for (size_t i = 0; i < stmt->switch_stmt.num_cases; i++)
+            {
+                SwitchCase* switch_case = &stmt->switch_stmt.cases[i];
+                for (size_t j = 0; j < switch_case->num_exprs; j++)
+                {
+                    clear_expr_types(switch_case->exprs[j]);
+                }
+                clear_stmt_block_types(switch_case->block);
+            }
+            break;
+        case STMT_ASSIGN:
+            clear_expr_types(stmt->assign.left);
+            clear_expr_types(stmt->assign.right);
+            break;
+        case STMT_INIT:
+            clear_typespec_types(stmt->init.type);
+            clear_expr_types(stmt->init.expr);
+            break;
+        default:
+            break;
+    }
+}
+
+void clear_stmt_block_types(StmtList block)
+{
+    for (size_t i = 0; i < block.num_stmts; i++)
+    {
+        clear_stmt_types(block.stmts[i]);
+    }
+}
+
+void clear_decl_types(Decl* decl)
+{
+    decl->sym = NULL;
+    switch (decl->kind)
+    {
+        case DECL_ENUM:
+            for (size_t i = 0; i < decl->enum_decl.num_items; i++)
+            {
+                clear_expr_types(decl->enum_decl.items[i].init);
+            }
+            break;
+        case DECL_STRUCT:
+        case DECL_UNION:
+            for (size_t i = 0; i < decl->aggregate.num_items; i++)
+            {
+                clear_typespec_types(decl->aggregate.items[i].type);
+            }
+            break;
+        case DECL_VAR:
+            clear_typespec_types(decl->var.type);
+            clear_expr_types(decl->var.expr);
+            break;
+        case DECL_CONST:
+            clear_expr_types(decl->const_decl.expr);
+            break;
+        case DECL_TYPEDEF:
+            clear_typespec_types(decl->typedef_decl.type);
+            break;
+        case DECL_FUNC:
+            for (size_t i = 0; i < decl->func.num_params; i++)
+            {
+                clear_typespec_types(decl->func.params[i].type);
+            }
+            clear_typespec_types(decl->func.ret_type);
+            clear_stmt_block_types(decl->func.block);
+            break;
+        default:
+            break;
+    }
+}
+
 #undef AST_DUP
\ No newline at end of file
@@ -90,6 +90,9 @@ typedef struct Decl {
     const char* name;
     struct Sym* sym;
 	NoteList notes;
+    // Hash of the declaration's source text, up to the body for a function. The body
+    // is hashed separately so that callers do not depend on it.
+    uint64_t hash;
     union {
         struct {
             EnumItem* items;
@@ -105,6 +108,7 @@ typedef struct Decl {
             Typespec* ret_type;
             bool has_varargs;
             StmtList block;
+            uint64_t body_hash;
         } func;
         struct {
             Typespec* type;
@@ -0,0 +1,151 @@
+typedef enum Phase {
+    PHASE_READ,
+    PHASE_LEX,
+    PHASE_PARSE,
+    PHASE_SYMS,
+    PHASE_FINALIZE,
+    PHASE_GEN,
+    PHASE_WRITE,
+    NUM_PHASES,
+} Phase;
+
+const char* phase_names[NUM_PHASES] = {
+    [PHASE_READ] = "map_file",
+    [PHASE_LEX] = "lex",
+    [PHASE_PARSE] = "parse_file",
+    [PHASE_SYMS] = "sym_global_decls",
+    [PHASE_FINALIZE] = "finalize_syms",
+    [PHASE_GEN] = "gen_all",
+    [PHASE_WRITE] = "write_file",
+};
+
+typedef struct PhaseResult {
+    bool measured;
+    double time;
+    size_t peak_rss;
+} PhaseResult;
+
+PhaseResult phase_results[NUM_PHASES];
+double phase_start_time;
+
+void phase_begin(Phase phase)
+{
+    TRACE_BEGIN(phase_names[phase], NULL);
+    phase_start_time = get_time();
+}
+
+void phase_end(Phase phase)
+{
+    TRACE_END();
+    phase_results[phase].measured = true;
+    phase_results[phase].time = get_time() - phase_start_time;
+    phase_results[phase].peak_rss = get_peak_rss();
+}
+
+void print_phase_row(const char* name, double time, size_t num_lines, size_t num_tokens, size_t peak_rss)
+{
+    double t = time > 0 ? time : 1e-9;
+    printf("%-18s %10.2f %14.0f %14.0f %10.1f\n", name, time * 1000.0, num_lines / t, num_tokens / t, peak_rss / (1024.0 * 1024.0));
+}
+
+void print_phases(size_t num_lines, size_t num_tokens)
+{
+    printf("%-18s %10s %14s %14s %10s\n", "phase", "ms", "lines/sec", "tokens/sec", "peak MB");
+    double total_time = 0;
+    for (int i = 0; i < NUM_PHASES; i++)
+    {
+        PhaseResult result = phase_results[i];
+        if (result.measured)
+        {
+            total_time += result.time;
+            print_phase_row(phase_names[i], result.time, num_lines, num_tokens, result.peak_rss);
+        }
+    }
+    print_phase_row("total", total_time, num_lines, num_tokens, get_peak_rss());
+}
+
+void print_stats(void)
+{
+    print_phases(stats.num_lines, stats.num_tokens);
+    printf("\n");
+    printf("%-24s %12zu\n", "lines", stats.num_lines);
+    printf("%-24s %12zu\n", "tokens lexed", stats.num_tokens);
+    printf("%-24s %12zu\n", "interns created", stats.num_intern_misses);
+    printf("%-24s %12zu\n", "intern hits", stats.num_intern_hits);
+    printf("%-24s %12zu\n", "ast_arena bytes", stats.num_ast_bytes);
+    printf("%-24s %12zu\n", "intern_arena bytes", stats.num_intern_bytes);
+    printf("%-24s %12zu\n", "map_get calls", stats.num_map_gets);
+    printf("%-24s %12zu\n", "map_put calls", stats.num_map_puts);
+    printf("%-24s %12zu\n", "map probes", stats.num_map_probes);
+    printf("%-24s %12zu\n", "types allocated", stats.num_types);
+    printf("%-24s %12zu\n", "gen_buf bytes", stats.num_gen_bytes);
+    if (cache_enabled)
+    {
+        printf("%-24s %12zu\n", "funcs reused from cache", stats.num_cache_hits);
+        printf("%-24s %12zu\n", "funcs regenerated", stats.num_cache_misses);
+    }
+}
+
+// Compiles the file one phase at a time and reports per-phase timings. The file is
+// tokenized into a token array up front so that lex and parse_file are timed
+// separately; ion_compile_file lexes on demand instead, which is cheaper overall for a
+// single file. Generated code is kept in memory rather than streamed so that gen_all
+// and write_file are timed separately too.
+bool ion_bench_file(const char* path)
+{
+    phase_begin(PHASE_READ);
+    MappedFile file;
+    bool mapped = map_file(path, &file);
+    phase_end(PHASE_READ);
+    if (!mapped)
+    {
+        return false;
+    }
+    const char* str = file.buf;
+
+    phase_begin(PHASE_LEX);
+    TokenArray tokens;
+    tokenize(&tokens, path, str);
+    phase_end(PHASE_LEX);
+    size_t num_tokens = tokens.num_tokens - 1;
+    size_t num_lines = token.pos.line;
+    stats.num_lines += num_lines;
+
+    init_builtins();
+
+    phase_begin(PHASE_PARSE);
+    init_token_array(&tokens);
+    DeclSet* declset = parse_file();
+    token_array_free(&tokens);
+    phase_end(PHASE_PARSE);
+
+    phase_begin(PHASE_SYMS);
+    sym_global_decls(declset);
+    phase_end(PHASE_SYMS);
+
+    phase_begin(PHASE_FINALIZE);
+    finalize_syms();
+    phase_end(PHASE_FINALIZE);
+
+    phase_begin(PHASE_GEN);
+    gen_all();
+    phase_end(PHASE_GEN);
+
+    const char* c_path = replace_ext(path, "c");
+    if (!c_path)
+    {
+        return false;
+    }
+    phase_begin(PHASE_WRITE);
+    bool written = write_file(c_path, gen_buf, buf_len(gen_buf));
+    phase_end(PHASE_WRITE);
+    unmap_file(&file);
+    if (!written)
+    {
+        return false;
+    }
+
+    printf("%zu lines, %zu tokens, %zu declarations\n", num_lines, num_tokens, declset->num_decls);
+    print_phases(num_lines, num_tokens);
+    return true;
+}
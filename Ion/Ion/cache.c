@@ -0,0 +1,368 @@
+// Compilation cache: the generated C for each function definition, kept in a file
+// next to the output between runs. A definition is reused when its body text is
+// unchanged and every global sym it depends on hashes the same as when it was
+// generated, so an edit only regenerates the functions whose dependencies changed.
+//
+// A sym's hash covers its declaration's text (a function's signature only) and the
+// hashes of the syms it refers to. Syms that refer to each other share one hash for
+// their whole cycle. Generated text is stored as if its function started at the
+// line it was generated at, and its #line directives are shifted when the function
+// has moved.
+
+#define CACHE_MAGIC "ioncache"
+#define CACHE_VERSION 1
+
+typedef struct CachedDep {
+    const char* name;
+    uint64_t hash;
+} CachedDep;
+
+typedef struct CachedFunc {
+    const char* name;
+    uint64_t hash;
+    uint64_t body_hash;
+    CachedDep* deps;
+    size_t num_deps;
+    int line;
+    int end_line;
+    const char* text;
+    size_t len;
+} CachedFunc;
+
+bool cache_enabled;
+// Set by watch mode, which keeps cached_funcs between compiles instead of loading and
+// saving a file.
+bool cache_in_memory;
+Map cached_funcs;
+char* cache_file_buf;
+
+///////////////////////////////////////////////////////////////////////////////
+// Dependency hashes
+//
+
+// Per-sym state for the hash walk, indexed by sym->hash_index - 1.
+typedef struct SymHashNode {
+    Sym* sym;
+    size_t lowlink;
+    bool on_stack;
+} SymHashNode;
+
+SymHashNode* sym_hash_nodes;
+Sym** sym_hash_stack;
+
+uint64_t sym_text_hash(Sym* sym)
+{
+    uint64_t hash = hash_bytes(sym->name, strlen(sym->name));
+    if (sym->eval_hash)
+    {
+        hash = hash_mix(hash, sym->eval_hash);
+    }
+    return sym->decl ? hash_mix(hash, sym->decl->hash) : hash;
+}
+
+// Tarjan's algorithm: strongly connected components are finished in dependency order,
+// so the hashes of everything a component refers to outside itself are already known.
+// Hashes within a component are summed so that the result does not depend on the
+// order its members were visited in.
+void sym_hash_visit(Sym* sym)
+{
+    buf_push(sym_hash_nodes, (SymHashNode) { sym, buf_len(sym_hash_nodes) + 1, true });
+    sym->hash_index = buf_len(sym_hash_nodes);
+    buf_push(sym_hash_stack, sym);
+    size_t lowlink = sym->hash_index;
+    for (size_t i = 0; i < buf_len(sym->deps); i++)
+    {
+        Sym* dep = sym->deps[i];
+        if (!dep->hash_index)
+        {
+            sym_hash_visit(dep);
+            lowlink = MIN(lowlink, sym_hash_nodes[dep->hash_index - 1].lowlink);
+        }
+        else if (sym_hash_nodes[dep->hash_index - 1].on_stack)
+        {
+            lowlink = MIN(lowlink, dep->hash_index);
+        }
+    }
+    sym_hash_nodes[sym->hash_index - 1].lowlink = lowlink;
+    if (lowlink != sym->hash_index)
+    {
+        return;
+    }
+    size_t start = buf_len(sym_hash_stack);
+    do
+    {
+        start--;
+    } while (sym_hash_stack[start] != sym);
+    // Everything on the stack from start up is in the component; any other dependency
+    // is in a component that has already been finished.
+    uint64_t hash = 0;
+    for (size_t i = start; i < buf_len(sym_hash_stack); i++)
+    {
+        Sym* member = sym_hash_stack[i];
+        hash += hash_mix(sym_text_hash(member), 1);
+        for (size_t j = 0; j < buf_len(member->deps); j++)
+        {
+            Sym* dep = member->deps[j];
+            if (!sym_hash_nodes[dep->hash_index - 1].on_stack)
+            {
+                hash += hash_mix(dep->hash, 2);
+            }
+        }
+    }
+    for (size_t i = start; i < buf_len(sym_hash_stack); i++)
+    {
+        Sym* member = sym_hash_stack[i];
+        sym_hash_nodes[member->hash_index - 1].on_stack = false;
+        member->hash = hash_mix(hash, sym_text_hash(member));
+    }
+    buf__hdr(sym_hash_stack)->len = start;
+}
+
+void cache_hash_syms(void)
+{
+    for (Sym** it = global_syms_buf; it != buf_end(global_syms_buf); it++)
+    {
+        if (!(*it)->hash_index)
+        {
+            sym_hash_visit(*it);
+        }
+    }
+    buf_free(sym_hash_nodes);
+    buf_free(sym_hash_stack);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Cache file
+//
+
+typedef struct CacheReader {
+    const char* ptr;
+    const char* end;
+    bool ok;
+} CacheReader;
+
+const char* cache_read_bytes(CacheReader* reader, size_t len)
+{
+    if (!reader->ok || (size_t)(reader->end - reader->ptr) < len)
+    {
+        reader->ok = false;
+        return NULL;
+    }
+    const char* bytes = reader->ptr;
+    reader->ptr += len;
+    return bytes;
+}
+
+uint64_t cache_read_u64(CacheReader* reader)
+{
+    uint64_t val = 0;
+    const char* bytes = cache_read_bytes(reader, sizeof(val));
+    if (bytes)
+    {
+        memcpy(&val, bytes, sizeof(val));
+    }
+    return val;
+}
+
+const char* cache_read_name(CacheReader* reader)
+{
+    size_t len = cache_read_u64(reader);
+    const char* name = cache_read_bytes(reader, len);
+    return name ? str_intern_range(name, name + len) : NULL;
+}
+
+void cache_write_u64(char** buf, uint64_t val)
+{
+    buf_append(*buf, (const char*)&val, sizeof(val));
+}
+
+void cache_write_bytes(char** buf, const char* bytes, size_t len)
+{
+    cache_write_u64(buf, len);
+    buf_append(*buf, bytes, len);
+}
+
+// A missing, stale or malformed cache file just means nothing is reused.
+void cache_load(const char* path)
+{
+    MappedFile file;
+    if (!map_file(path, &file))
+    {
+        return;
+    }
+    cache_file_buf = xmalloc(file.len);
+    memcpy(cache_file_buf, file.buf, file.len);
+    CacheReader reader = { cache_file_buf, cache_file_buf + file.len, true };
+    unmap_file(&file);
+    const char* magic = cache_read_bytes(&reader, sizeof(CACHE_MAGIC) - 1);
+    if (!magic || memcmp(magic, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1) != 0 || cache_read_u64(&reader) != CACHE_VERSION)
+    {
+        return;
+    }
+    size_t num_funcs = cache_read_u64(&reader);
+    for (size_t i = 0; i < num_funcs && reader.ok; i++)
+    {
+        CachedFunc* func = xcalloc(1, sizeof(CachedFunc));
+        func->name = cache_read_name(&reader);
+        func->hash = cache_read_u64(&reader);
+        func->body_hash = cache_read_u64(&reader);
+        func->num_deps = cache_read_u64(&reader);
+        if (!reader.ok || func->num_deps > (size_t)(reader.end - reader.ptr))
+        {
+            free(func);
+            break;
+        }
+        func->deps = xcalloc(func->num_deps + 1, sizeof(CachedDep));
+        for (size_t j = 0; j < func->num_deps; j++)
+        {
+            func->deps[j].name = cache_read_name(&reader);
+            func->deps[j].hash = cache_read_u64(&reader);
+        }
+        func->line = (int)cache_read_u64(&reader);
+        func->end_line = (int)cache_read_u64(&reader);
+        func->len = cache_read_u64(&reader);
+        func->text = cache_read_bytes(&reader, func->len);
+        if (!reader.ok)
+        {
+            free(func->deps);
+            free(func);
+            break;
+        }
+        map_put(&cached_funcs, (void*)func->name, func);
+    }
+}
+
+bool cache_save(const char* path)
+{
+    char* buf = NULL;
+    buf_append(buf, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1);
+    cache_write_u64(&buf, CACHE_VERSION);
+    size_t num_funcs = 0;
+    for (Sym** it = global_syms_buf; it != buf_end(global_syms_buf); it++)
+    {
+        num_funcs += (*it)->cached != NULL;
+    }
+    cache_write_u64(&buf, num_funcs);
+    for (Sym** it = global_syms_buf; it != buf_end(global_syms_buf); it++)
+    {
+        CachedFunc* func = (*it)->cached;
+        if (!func)
+        {
+            continue;
+        }
+        cache_write_bytes(&buf, func->name, strlen(func->name));
+        cache_write_u64(&buf, func->hash);
+        cache_write_u64(&buf, func->body_hash);
+        cache_write_u64(&buf, func->num_deps);
+        for (size_t i = 0; i < func->num_deps; i++)
+        {
+            cache_write_bytes(&buf, func->deps[i].name, strlen(func->deps[i].name));
+            cache_write_u64(&buf, func->deps[i].hash);
+        }
+        cache_write_u64(&buf, func->line);
+        cache_write_u64(&buf, func->end_line);
+        cache_write_bytes(&buf, func->text, func->len);
+    }
+    bool written = write_binary_file(path, buf, buf_len(buf));
+    buf_free(buf);
+    return written;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reuse
+//
+
+bool cached_func_valid(Sym* sym, CachedFunc* func)
+{
+    if (func->hash != sym->hash || func->body_hash != sym->decl->func.body_hash)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < func->num_deps; i++)
+    {
+        Sym* dep = map_get(&global_syms_map, (void*)func->deps[i].name);
+        if (!dep || dep->hash != func->deps[i].hash)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Called between resolving the global declarations and the function bodies: marks
+// the functions whose cached definitions are still valid, so that their bodies are
+// neither resolved nor generated again.
+void cache_reuse_funcs(void)
+{
+    cache_hash_syms();
+    for (Sym** it = global_syms_buf; it != buf_end(global_syms_buf); it++)
+    {
+        Sym* sym = *it;
+        if (sym->kind != SYM_FUNC || !sym->decl || is_decl_foreign(sym->decl))
+        {
+            continue;
+        }
+        CachedFunc* func = map_get(&cached_funcs, (void*)sym->name);
+        if (func && cached_func_valid(sym, func))
+        {
+            sym->cached = func;
+            stats.num_cache_hits++;
+        }
+        else
+        {
+            stats.num_cache_misses++;
+        }
+    }
+}
+
+// Records a freshly generated definition so that cache_save writes it out.
+void cache_put_func(Sym* sym, const char* text, size_t len, int end_line)
+{
+    CachedFunc* func = xcalloc(1, sizeof(CachedFunc));
+    func->name = sym->name;
+    func->hash = sym->hash;
+    func->body_hash = sym->decl->func.body_hash;
+    func->num_deps = buf_len(sym->body_deps);
+    func->deps = xcalloc(func->num_deps + 1, sizeof(CachedDep));
+    for (size_t i = 0; i < func->num_deps; i++)
+    {
+        func->deps[i] = (CachedDep) { sym->body_deps[i]->name, sym->body_deps[i]->hash };
+    }
+    func->line = sym->decl->pos.line;
+    func->end_line = end_line;
+    func->text = memdup(text, len);
+    func->len = len;
+    sym->cached = func;
+}
+
+// Called after each compile in watch mode: the definitions from that compile, reused
+// or regenerated, become the candidates for the next. Those that were replaced or
+// whose functions are gone are freed; none of them point into a loaded cache file.
+void cache_keep_funcs(void)
+{
+    Map kept = { 0 };
+    for (Sym** it = global_syms_buf; it != buf_end(global_syms_buf); it++)
+    {
+        if ((*it)->cached)
+        {
+            map_put(&kept, (void*)(*it)->name, (*it)->cached);
+        }
+    }
+    for (size_t i = 0; i < cached_funcs.cap; i++)
+    {
+        if (!cached_funcs.keys[i])
+        {
+            continue;
+        }
+        CachedFunc* func = cached_funcs.vals[i];
+        if (map_get(&kept, (void*)func->name) != func)
+        {
+            free(func->deps);
+            free((void*)func->text);
+            free(func);
+        }
+    }
+    free(cached_funcs.keys);
+    free(cached_funcs.vals);
+    cached_funcs = kept;
+}
@@ -1,10 +1,74 @@
 #define MAX(x,y) (x > y ? x : y)
+#define MIN(x,y) (x < y ? x : y)
 #define IS_POW2(x) (((x) != 0) && ((x) & ((x)-1)) == 0)
 #define ALIGN_DOWN(n, a) ((n) & ~((a) - 1))
 #define ALIGN_UP(n, a) ALIGN_DOWN((n) + (a) - 1, (a))
 #define ALIGN_DOWN_PTR(p, a) ((void*)ALIGN_DOWN((uintptr_t)(p), (a)))
 #define ALIGN_UP_PTR(p, a) ((void*)ALIGN_UP((uintptr_t)(p), (a)))
 
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#define NORETURN __declspec(noreturn)
+#else
+#define THREAD_LOCAL _Thread_local
+#define NORETURN __attribute__((noreturn))
+#endif
+
+int count_trailing_zeros(uint32_t x)
+{
+    assert(x != 0);
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return (int)index;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+typedef struct Stats {
+    size_t num_lines;
+    size_t num_tokens;
+    size_t num_intern_hits;
+    size_t num_intern_misses;
+    size_t num_intern_bytes;
+    size_t num_ast_bytes;
+    size_t num_map_gets;
+    size_t num_map_puts;
+    size_t num_map_probes;
+    size_t num_types;
+    size_t num_gen_bytes;
+    size_t num_cache_hits;
+    size_t num_cache_misses;
+} Stats;
+
+// Counters are per thread; worker threads fold theirs into the main thread's when done.
+THREAD_LOCAL Stats stats;
+
+void stats_add(Stats* dest, const Stats* src)
+{
+    // Stats holds nothing but size_t counters.
+    size_t* dest_counters = (size_t*)dest;
+    const size_t* src_counters = (const size_t*)src;
+    for (size_t i = 0; i < sizeof(Stats) / sizeof(size_t); i++)
+    {
+        dest_counters[i] += src_counters[i];
+    }
+}
+
+// Where fatal errors unwind to instead of exiting, for callers that outlive a failed
+// compile such as watch mode. Each thread has its own; see run_workers.
+THREAD_LOCAL jmp_buf* fatal_jmp;
+
+NORETURN void fatal_exit(void)
+{
+    if (fatal_jmp)
+    {
+        longjmp(*fatal_jmp, 1);
+    }
+    exit(1);
+}
+
 void fatal(const char* fmt, ...)
 {
     va_list args;
@@ -13,7 +77,7 @@ void fatal(const char* fmt, ...)
     vprintf(fmt, args);
     printf("\n");
     va_end(args);
-    exit(1);
+    fatal_exit();
 }
 
 void* xcalloc(size_t num_items, size_t item_size)
@@ -49,7 +113,7 @@ void* xmalloc(size_t num_bytes)
     return ptr;
 }
 
-void* memdup(void* src, size_t size) 
+void* memdup(const void* src, size_t size) 
 {
     void* dest = xmalloc(size);
     memcpy(dest, src, size);
@@ -92,9 +156,132 @@ char* read_file(const char* path)
     return buf;
 }
 
-bool write_file(const char* path, const char* buf, size_t len)
+// Memory-mapped, read-only view of a file that is guaranteed to be followed by a
+// NUL byte, so the lexer can scan it in place without copying it first.
+typedef struct MappedFile {
+    const char* buf;
+    size_t len;
+    size_t map_len;
+    bool is_copy;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+} MappedFile;
+
+bool map_file(const char* path, MappedFile* file)
+{
+    memset(file, 0, sizeof(*file));
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size))
+    {
+        CloseHandle(handle);
+        return false;
+    }
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    size_t len = (size_t)size.QuadPart;
+    if (len == 0 || len % info.dwPageSize == 0)
+    {
+        // No zero-filled tail page to act as the sentinel, so fall back to a copy.
+        CloseHandle(handle);
+        char* buf = read_file(path);
+        if (!buf)
+        {
+            return false;
+        }
+        file->buf = buf;
+        file->len = len;
+        file->is_copy = true;
+        return true;
+    }
+    HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(handle);
+    if (!mapping)
+    {
+        return false;
+    }
+    const char* buf = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!buf)
+    {
+        CloseHandle(mapping);
+        return false;
+    }
+    file->buf = buf;
+    file->len = len;
+    file->map_len = len;
+    file->mapping = mapping;
+    return true;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    size_t len = (size_t)st.st_size;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    // Reserve one byte more than the file rounded up to whole pages as zero-filled
+    // anonymous memory, then map the file over the front of it. Whatever follows
+    // the last byte of the file is either the zeroed tail of its final page or the
+    // untouched anonymous page after it.
+    size_t map_len = ALIGN_UP(len + 1, page_size);
+    char* buf = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+    if (len && mmap(buf, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(buf, map_len);
+        close(fd);
+        return false;
+    }
+    close(fd);
+    assert(buf[len] == 0);
+    file->buf = buf;
+    file->len = len;
+    file->map_len = map_len;
+    return true;
+#endif
+}
+
+void unmap_file(MappedFile* file)
+{
+    if (!file->buf)
+    {
+        return;
+    }
+    if (file->is_copy)
+    {
+        free((void*)file->buf);
+    }
+    else
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(file->buf);
+        CloseHandle(file->mapping);
+#else
+        munmap((void*)file->buf, file->map_len);
+#endif
+    }
+    memset(file, 0, sizeof(*file));
+}
+
+bool write_file_mode(const char* path, const char* mode, const char* buf, size_t len)
 {
-    FILE* file = fopen(path, "w");
+    FILE* file = fopen(path, mode);
     if (!file)
     {
         return false;
@@ -104,6 +291,17 @@ bool write_file(const char* path, const char* buf, size_t len)
     return n == 1;
 }
 
+bool write_file(const char* path, const char* buf, size_t len)
+{
+    return write_file_mode(path, "w", buf, len);
+}
+
+// Unlike write_file, newlines are written as is on Windows too.
+bool write_binary_file(const char* path, const char* buf, size_t len)
+{
+    return write_file_mode(path, "wb", buf, len);
+}
+
 const char* get_ext(const char* path)
 {
     const char* ext = NULL;
@@ -153,6 +351,7 @@ typedef struct BufHdr {
 #define buf_push(b, ...) (buf_fit((b), 1 + buf_len(b)), (b)[buf__hdr(b)->len++] = (__VA_ARGS__))
 #define buf_printf(b, ...) ((b) = buf__printf((b), __VA_ARGS__))
 #define buf_clear(b) ((b) ? buf__hdr(b)->len = 0 : 0)
+#define buf_append(b, str, n) ((b) = buf__append((b), (str), (n)))
 
 void *buf__grow(const void *buf, size_t new_len, size_t elem_size) {
     assert(buf_cap(buf) <= (SIZE_MAX - 1) / 2);
@@ -190,6 +389,15 @@ char *buf__printf(char *buf, const char *fmt, ...) {
     return buf;
 }
 
+// Appends n chars and keeps the buffer NUL-terminated like buf_printf does.
+char *buf__append(char *buf, const char *str, size_t n) {
+    buf_fit(buf, n + 1 + buf_len(buf));
+    memcpy(buf_end(buf), str, n);
+    buf__hdr(buf)->len += n;
+    *buf_end(buf) = 0;
+    return buf;
+}
+
 void buf_test(void) {
     int *buf = NULL;
     assert(buf_len(buf) == 0);
@@ -209,8 +417,303 @@ void buf_test(void) {
     assert(strcmp(str, "One: 1\n") == 0);
     buf_printf(str, "Hex: 0x%x\n", 0x12345678);
     assert(strcmp(str, "One: 1\nHex: 0x12345678\n") == 0);
+    buf_append(str, "Two", 3);
+    assert(strcmp(str, "One: 1\nHex: 0x12345678\nTwo") == 0);
+}
+
+bool is_dir(const char* path)
+{
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesA(path);
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
 }
 
+// Modification time and size, compared to tell whether a file has changed since it
+// was last read.
+typedef struct FileStamp {
+    uint64_t mtime;
+    uint64_t size;
+} FileStamp;
+
+bool get_file_stamp(const char* path, FileStamp* stamp)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data))
+    {
+        return false;
+    }
+    stamp->mtime = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    stamp->size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return false;
+    }
+#ifdef __APPLE__
+    stamp->mtime = (uint64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    stamp->mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    stamp->size = (uint64_t)st.st_size;
+#endif
+    return true;
+}
+
+int compare_strs(const void* a, const void* b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+// Returns a stretchy buffer of the paths of the files in dir with the given
+// extension, sorted so that the order does not depend on the file system.
+const char** dir_list_files(const char* dir, const char* ext)
+{
+    const char** paths = NULL;
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA(strf("%s\\*.%s", dir, ext), &data);
+    if (find != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                buf_push(paths, strf("%s\\%s", dir, data.cFileName));
+            }
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+    }
+#else
+    DIR* handle = opendir(dir);
+    if (handle)
+    {
+        for (struct dirent* entry = readdir(handle); entry; entry = readdir(handle))
+        {
+            const char* entry_ext = get_ext(entry->d_name);
+            if (entry_ext && strcmp(entry_ext, ext) == 0)
+            {
+                const char* path = strf("%s/%s", dir, entry->d_name);
+                if (!is_dir(path))
+                {
+                    buf_push(paths, path);
+                }
+            }
+        }
+        closedir(handle);
+    }
+#endif
+    qsort(paths, buf_len(paths), sizeof(*paths), compare_strs);
+    return paths;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Threads
+//
+
+typedef void (*ThreadFunc)(void* arg);
+
+typedef struct ThreadStart {
+    ThreadFunc func;
+    void* arg;
+} ThreadStart;
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef SRWLOCK Mutex;
+#define MUTEX_INIT SRWLOCK_INIT
+typedef CONDITION_VARIABLE CondVar;
+#define COND_VAR_INIT CONDITION_VARIABLE_INIT
+
+DWORD WINAPI thread_start(LPVOID param)
+{
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+    start.func(start.arg);
+    return 0;
+}
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+#define MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+typedef pthread_cond_t CondVar;
+#define COND_VAR_INIT PTHREAD_COND_INITIALIZER
+
+void* thread_start(void* param)
+{
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+    start.func(start.arg);
+    return NULL;
+}
+#endif
+
+Thread thread_create(ThreadFunc func, void* arg)
+{
+    ThreadStart* start = xmalloc(sizeof(ThreadStart));
+    *start = (ThreadStart) { func, arg };
+#ifdef _WIN32
+    Thread thread = CreateThread(NULL, 0, thread_start, start, 0, NULL);
+    if (!thread)
+    {
+        fatal("Failed to create thread");
+    }
+#else
+    Thread thread;
+    if (pthread_create(&thread, NULL, thread_start, start) != 0)
+    {
+        fatal("Failed to create thread");
+    }
+#endif
+    return thread;
+}
+
+void thread_join(Thread thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+void mutex_init(Mutex* mutex)
+{
+#ifdef _WIN32
+    InitializeSRWLock(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void mutex_lock(Mutex* mutex)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void mutex_unlock(Mutex* mutex)
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+// Releases mutex while waiting and reacquires it before returning. Wakeups can be
+// spurious, so callers wait in a loop on their condition.
+void cond_wait(CondVar* cond, Mutex* mutex)
+{
+#ifdef _WIN32
+    SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+#else
+    pthread_cond_wait(cond, mutex);
+#endif
+}
+
+void cond_broadcast(CondVar* cond)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+
+size_t get_num_cpus(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return MAX(info.dwNumberOfProcessors, 1);
+#else
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cpus > 0 ? (size_t)num_cpus : 1;
+#endif
+}
+
+// Thread count for the parallel phases, set with -j; 0 means one per CPU.
+size_t num_worker_threads;
+
+size_t get_num_workers(void)
+{
+    return num_worker_threads ? num_worker_threads : get_num_cpus();
+}
+
+typedef struct Worker {
+    Thread thread;
+    void (*func)(void);
+    Stats stats;
+    bool recover;
+    bool failed;
+} Worker;
+
+void worker_start(void* arg)
+{
+    Worker* worker = arg;
+    jmp_buf jmp;
+    if (worker->recover)
+    {
+        fatal_jmp = &jmp;
+        if (setjmp(jmp))
+        {
+            worker->failed = true;
+            worker->stats = stats;
+            return;
+        }
+    }
+    worker->func();
+    worker->stats = stats;
+}
+
+// Starts func on num_workers threads, which the caller can work alongside until it
+// calls join_workers.
+Worker* start_workers(void (*func)(void), size_t num_workers)
+{
+    Worker* workers = xcalloc(num_workers, sizeof(Worker));
+    for (size_t i = 0; i < num_workers; i++)
+    {
+        workers[i].func = func;
+        workers[i].recover = fatal_jmp != NULL;
+        workers[i].thread = thread_create(worker_start, &workers[i]);
+    }
+    return workers;
+}
+
+// Waits for all the workers, folding each thread's stats into the caller's. If the
+// caller recovers from fatal errors, a worker that hits one stops and the error is
+// passed on to the caller once all have finished.
+void join_workers(Worker* workers, size_t num_workers)
+{
+    bool failed = false;
+    for (size_t i = 0; i < num_workers; i++)
+    {
+        thread_join(workers[i].thread);
+        stats_add(&stats, &workers[i].stats);
+        failed |= workers[i].failed;
+    }
+    free(workers);
+    if (failed)
+    {
+        fatal_exit();
+    }
+}
+
+// Runs func on num_workers threads and waits for all of them.
+void run_workers(void (*func)(void), size_t num_workers)
+{
+    join_workers(start_workers(func, num_workers), num_workers);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 // Arena allocator
@@ -256,6 +759,54 @@ void arena_free(Arena* arena)
     buf_free(arena->blocks);
 }
 
+// Marks let an arena double as scratch space: everything allocated after
+// arena_mark is released by arena_reset, which must be called in LIFO order.
+typedef struct ArenaMark {
+    char* ptr;
+    char* end;
+    size_t num_blocks;
+} ArenaMark;
+
+THREAD_LOCAL Arena scratch_arena;
+
+ArenaMark arena_mark(Arena* arena)
+{
+    if (!arena->ptr)
+    {
+        // Ensure a block so that resetting to the start does not free and reallocate it each time.
+        arena_grow(arena, 0);
+    }
+    return (ArenaMark) { arena->ptr, arena->end, buf_len(arena->blocks) };
+}
+
+void arena_reset(Arena* arena, ArenaMark mark)
+{
+    assert(mark.num_blocks <= buf_len(arena->blocks));
+    for (size_t i = mark.num_blocks; i < buf_len(arena->blocks); i++)
+    {
+        free(arena->blocks[i]);
+    }
+    buf__hdr(arena->blocks)->len = mark.num_blocks;
+    arena->ptr = mark.ptr;
+    arena->end = mark.end;
+}
+
+void arena_test(void)
+{
+    Arena arena = { 0 };
+    ArenaMark mark = arena_mark(&arena);
+    char* ptr1 = arena_alloc(&arena, 16);
+    ArenaMark inner = arena_mark(&arena);
+    arena_alloc(&arena, 2 * ARENA_BLOCK_SIZE);
+    assert(buf_len(arena.blocks) == 2);
+    arena_reset(&arena, inner);
+    assert(buf_len(arena.blocks) == 1);
+    assert(arena_alloc(&arena, 16) == ptr1 + 16);
+    arena_reset(&arena, mark);
+    assert(arena_alloc(&arena, 16) == ptr1);
+    arena_free(&arena);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Hash map
 //
@@ -272,14 +823,33 @@ uint64_t hash_ptr(void *ptr)
     return hash_uint64((uintptr_t)ptr);
 }
 
+uint64_t hash_mix(uint64_t x, uint64_t y)
+{
+    x ^= y;
+    x *= 0xff51afd7ed558ccd;
+    x ^= x >> 32;
+    return x;
+}
+
+// Hashes eight bytes per step, loading the tail into a zero-padded word.
 uint64_t hash_bytes(const char* buf, size_t len)
 {
-    uint64_t x = 0xcbf29ce484222325;
-    for (size_t i = 0; i < len; i++)
+    uint64_t x = 0xcbf29ce484222325 ^ len;
+    const char* end = buf + len;
+    for (; end - buf >= 8; buf += 8)
+    {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        x = hash_mix(x, word);
+    }
+    if (buf != end)
     {
-        x ^= buf[i];
-        x *= 0x100000001b3;
-        x ^= x >> 32;
+        uint64_t word = 0;
+        for (int shift = 0; buf != end; buf++, shift += 8)
+        {
+            word |= (uint64_t)(unsigned char)*buf << shift;
+        }
+        x = hash_mix(x, word);
     }
     return x;
 }
@@ -300,8 +870,10 @@ void* map_get(Map* map, void* key)
     assert(IS_POW2(map->cap));
     size_t i = (size_t)hash_ptr(key);
     assert(map->len < map->cap);
+    stats.num_map_gets++;
     for (;;)
     {
+        stats.num_map_probes++;
         i &= map->cap - 1;
         if (map->keys[i] == key)
         {
@@ -349,8 +921,10 @@ void map_put(Map* map, void* key, void* val)
     assert(2 * map->len < map->cap);
     assert(IS_POW2(map->cap));
     size_t i = (size_t)hash_ptr(key);
+    stats.num_map_puts++;
     for (;;)
     {
+        stats.num_map_probes++;
         i &= map->cap - 1;
         if (!map->keys[i])
         {
@@ -387,35 +961,125 @@ void map_test(void)
 // String interning
 //
 
+// Open-addressed table whose slots keep the full hash and length inline, so probing
+// stays within the table and strings are only compared on a full hash match.
 typedef struct Intern {
+    uint64_t hash;
     size_t len;
-    struct Intern* next;
-    char str[];
+    const char* str;
 } Intern;
 
-Arena intern_arena;
-Map interns;
+typedef struct InternTable {
+    Intern* slots;
+    size_t len;
+    size_t cap;
+} InternTable;
+
+// Interns are sharded by the top bits of the hash, each shard with its own table and
+// lock, so threads interning different names rarely contend. New strings are copied
+// into the interning thread's own arena rather than a per-shard one, which keeps names
+// first seen together close together in memory; either way they never move once
+// handed out.
+#define INTERN_SHARD_BITS 6
+#define NUM_INTERN_SHARDS (1 << INTERN_SHARD_BITS)
+
+typedef struct InternShard {
+    InternTable table;
+    Mutex mutex;
+} InternShard;
+
+InternShard intern_shards[NUM_INTERN_SHARDS];
+THREAD_LOCAL Arena intern_arena;
+
+// Set while worker threads may intern concurrently; single-threaded phases skip the locks.
+bool intern_lock_enabled;
+bool intern_locks_initialized;
+
+void intern_lock_begin(void)
+{
+    if (!intern_locks_initialized)
+    {
+        for (int i = 0; i < NUM_INTERN_SHARDS; i++)
+        {
+            mutex_init(&intern_shards[i].mutex);
+        }
+        intern_locks_initialized = true;
+    }
+    intern_lock_enabled = true;
+}
+
+void intern_lock_end(void)
+{
+    intern_lock_enabled = false;
+}
+
+void intern_table_grow(InternTable* table, size_t new_cap)
+{
+    new_cap = MAX(new_cap, 64);
+    Intern* new_slots = xcalloc(new_cap, sizeof(Intern));
+    for (size_t i = 0; i < table->cap; i++)
+    {
+        Intern intern = table->slots[i];
+        if (intern.str)
+        {
+            size_t j = (size_t)intern.hash & (new_cap - 1);
+            while (new_slots[j].str)
+            {
+                j = (j + 1) & (new_cap - 1);
+            }
+            new_slots[j] = intern;
+        }
+    }
+    free(table->slots);
+    table->slots = new_slots;
+    table->cap = new_cap;
+}
+
+const char* intern_shard_get(InternShard* shard, const char* start, size_t len, uint64_t hash)
+{
+    InternTable* table = &shard->table;
+    if (2 * table->len >= table->cap)
+    {
+        intern_table_grow(table, 2 * table->cap);
+    }
+    size_t i = (size_t)hash & (table->cap - 1);
+    for (;;)
+    {
+        Intern* slot = table->slots + i;
+        if (!slot->str)
+        {
+            break;
+        }
+        if (slot->hash == hash && slot->len == len && memcmp(slot->str, start, len) == 0)
+        {
+            stats.num_intern_hits++;
+            return slot->str;
+        }
+        i = (i + 1) & (table->cap - 1);
+    }
+    stats.num_intern_misses++;
+    char* str = arena_alloc(&intern_arena, len + 1);
+    stats.num_intern_bytes += ALIGN_UP(len + 1, ARENA_ALIGNMENT);
+    memcpy(str, start, len);
+    str[len] = 0;
+    table->slots[i] = (Intern) { hash, len, str };
+    table->len++;
+    return str;
+}
 
 const char* str_intern_range(const char* start, const char* end)
 {
     size_t len = end - start;
     uint64_t hash = hash_bytes(start, len);
-    void* key = (void*)(uintptr_t)(hash ? hash : 1);
-    Intern* intern = map_get(&interns, key);
-    for(Intern* it = intern; it; it = it->next)
+    InternShard* shard = &intern_shards[hash >> (64 - INTERN_SHARD_BITS)];
+    if (!intern_lock_enabled)
     {
-        if (it->len == len && strncmp(it->str, start, len) == 0)
-        {
-            return it->str;
-        }
+        return intern_shard_get(shard, start, len, hash);
     }
-    Intern* new_intern = arena_alloc(&intern_arena, offsetof(Intern, str) + len + 1);
-    new_intern->len = len;
-    new_intern->next = intern;
-    memcpy(new_intern->str, start, len);
-    new_intern->str[len] = 0;
-    map_put(&interns, key, new_intern);
-    return new_intern->str;
+    mutex_lock(&shard->mutex);
+    const char* str = intern_shard_get(shard, start, len, hash);
+    mutex_unlock(&shard->mutex);
+    return str;
 }
 
 const char* str_intern(const char* str)
@@ -440,3 +1104,48 @@ typedef union Val {
     unsigned long long ull;
     uintptr_t p;
 } Val;
+
+///////////////////////////////////////////////////////////////////////////////
+// Timing and memory usage
+//
+
+double get_time(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    if (!freq.QuadPart)
+    {
+        QueryPerformanceFrequency(&freq);
+    }
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+size_t get_peak_rss(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
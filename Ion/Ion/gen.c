@@ -1,10 +1,56 @@
-char* gen_buf = NULL;
+// Generator state is per thread so that function definitions can be rendered on
+// worker threads, each into its own gen_buf.
+THREAD_LOCAL char* gen_buf = NULL;
+
+// When gen_file is set, gen_buf is flushed to it in GEN_FLUSH_SIZE chunks at line
+// boundaries, so the generated translation unit never has to fit in memory at once.
+// Only the main thread sets it.
+THREAD_LOCAL FILE* gen_file;
+bool gen_file_error;
+
+#define GEN_FLUSH_SIZE (64 * 1024)
 
 #define genf(...) buf_printf(gen_buf, __VA_ARGS__)
 #define genlnf(...) (genln(), genf(__VA_ARGS__))
 
-int gen_indent;
-SrcPos gen_pos;
+// Non-formatting emitters for the hot paths; genf costs one or two vsnprintf calls.
+#define genlit(str) buf_append(gen_buf, (str), sizeof(str) - 1)
+#define genlnlit(str) (genln(), genlit(str))
+
+THREAD_LOCAL int gen_indent;
+THREAD_LOCAL SrcPos gen_pos;
+
+void genstr(const char* str)
+{
+    buf_append(gen_buf, str, strlen(str));
+}
+
+void genint(unsigned long long val)
+{
+    char digits[20];
+    char* end = digits + sizeof(digits);
+    char* start = end;
+    do
+    {
+        *--start = '0' + val % 10;
+        val /= 10;
+    } while (val);
+    buf_append(gen_buf, start, end - start);
+}
+
+void gen_flush(void)
+{
+    size_t len = buf_len(gen_buf);
+    if (gen_file && len)
+    {
+        if (fwrite(gen_buf, len, 1, gen_file) != 1)
+        {
+            gen_file_error = true;
+        }
+        stats.num_gen_bytes += len;
+        buf_clear(gen_buf);
+    }
+}
 
 const char* gen_preamble = 
     "// Preamble\n"
@@ -32,7 +78,17 @@ const char* gen_preamble =
 
 void genln(void)
 {
-    genf("\n%.*s", gen_indent * 4, "                                                                       ");
+    if (gen_file && buf_len(gen_buf) >= GEN_FLUSH_SIZE)
+    {
+        gen_flush();
+    }
+    size_t indent = gen_indent * 4;
+    buf_fit(gen_buf, buf_len(gen_buf) + indent + 2);
+    char* ptr = buf_end(gen_buf);
+    *ptr++ = '\n';
+    memset(ptr, ' ', indent);
+    ptr[indent] = 0;
+    buf__hdr(gen_buf)->len += indent + 1;
     gen_pos.line++;
 }
 
@@ -77,7 +133,7 @@ void gen_str(const char* str, bool multiline)
         gen_indent++;
         genln();
     }
-    genf("\"");
+    genlit("\"");
     while (*str)
     {
         const char* start = str;
@@ -87,7 +143,7 @@ void gen_str(const char* str, bool multiline)
         }
         if (start != str) 
         {
-            genf("%.*s", str - start, start);
+            buf_append(gen_buf, start, str - start);
         }
         if (*str)
         {
@@ -96,8 +152,8 @@ void gen_str(const char* str, bool multiline)
                 genf("\\%c", char_to_escape[(unsigned char)*str]);
                 if (str[0] == '\n' && str[1])
                 {
-                    genf("\"");
-                    genlnf("\"");
+                    genlit("\"");
+                    genlnlit("\"");
                 }
             }
             else
@@ -108,7 +164,7 @@ void gen_str(const char* str, bool multiline)
             str++;
         }
     }
-    genf("\"");
+    genlit("\"");
     if (multiline)
     {
         gen_indent--;
@@ -119,19 +175,21 @@ void gen_sync_pos(SrcPos pos)
 {
     if (gen_pos.line != pos.line || gen_pos.name != pos.name)
     {
-        genlnf("#line %d", pos.line);
+        genlnlit("#line ");
+        genint(pos.line);
         if (gen_pos.name != pos.name) {
-            genf(" ");
+            genlit(" ");
             gen_str(pos.name, false);
         }
         gen_pos = pos;
     }
 }
 
-const char* cdecl_paren(const char* str, bool b)
-{
-    return b ? strf("(%s)", str) : str;
-}
+// C declarators are written straight into gen_buf. Prefixes such as "(*" and
+// "const " nest inside-out around the declared name while array and parameter
+// suffixes nest outside-in, so each type chain is walked twice: prefixes on the
+// way back up from the base type, suffixes on the way down. The wrapped flag is
+// set whenever something sits between this level and the base type name.
 
 const char* cdecl_name(Type* type)
 {
@@ -147,127 +205,202 @@ const char* cdecl_name(Type* type)
     }
 }
 
-char* type_to_cdecl(Type* type, const char* str)
+void gen_type_cdecl(Type* type, const char* name);
+
+void gen_type_cdecl_prefix(Type* type, bool wrapped)
 {
     switch (type->kind)
     {
         case TYPE_PTR:
-            return type_to_cdecl(type->base, cdecl_paren(strf("*%s", str), *str));
+            gen_type_cdecl_prefix(type->base, true);
+            genstr(wrapped ? "(*" : "*");
+            break;
         case TYPE_CONST:
-            return type_to_cdecl(type->base, strf("const %s", cdecl_paren(str, *str)));
+            gen_type_cdecl_prefix(type->base, true);
+            genstr(wrapped ? "const (" : "const ");
+            break;
         case TYPE_ARRAY:
-            if (type->num_elems == 0)
-            {
-                return type_to_cdecl(type->base, cdecl_paren(strf("%s[]", str), *str));
-            }
-            else
+            gen_type_cdecl_prefix(type->base, true);
+            genstr(wrapped ? "(" : "");
+            break;
+        case TYPE_FUNC:
+            gen_type_cdecl_prefix(type->func.ret, true);
+            genstr(wrapped ? "(*" : "*");
+            break;
+        default:
+            genstr(cdecl_name(type));
+            genstr(wrapped ? " " : "");
+            break;
+    }
+}
+
+void gen_type_cdecl_suffix(Type* type, bool wrapped)
+{
+    switch (type->kind)
+    {
+        case TYPE_PTR:
+        case TYPE_CONST:
+            genstr(wrapped ? ")" : "");
+            gen_type_cdecl_suffix(type->base, true);
+            break;
+        case TYPE_ARRAY:
+            genlit("[");
+            if (type->num_elems != 0)
             {
-                return type_to_cdecl(type->base, cdecl_paren(strf("%s[%llu]", str, type->num_elems), *str));
+                genint(type->num_elems);
             }
-        case TYPE_FUNC: {
-            char* result = NULL;
-            buf_printf(result, "%s(", cdecl_paren(strf("*%s", str), *str));
+            genlit("]");
+            genstr(wrapped ? ")" : "");
+            gen_type_cdecl_suffix(type->base, true);
+            break;
+        case TYPE_FUNC:
+            genstr(wrapped ? ")(" : "(");
             if (type->func.num_params == 0)
             {
-                buf_printf(result, "void");
+                genlit("void");
             }
             else
             {
                 for (size_t i = 0; i < type->func.num_params; i++)
                 {
-                    buf_printf(result, "%s%s", i == 0 ? "" : ", ", type_to_cdecl(type->func.params[i], ""));
+                    if (i != 0)
+                    {
+                        genlit(", ");
+                    }
+                    gen_type_cdecl(type->func.params[i], "");
                 }
             }
             if (type->func.has_varargs)
             {
-                buf_printf(result, ", ...");
+                genlit(", ...");
             }
-            buf_printf(result, ")");
-            return type_to_cdecl(type->func.ret, result);
-        } 
-        default: 
-            return strf("%s%s%s", cdecl_name(type), *str ? " " : "", str);
+            genlit(")");
+            gen_type_cdecl_suffix(type->func.ret, true);
+            break;
+        default:
+            break;
     }
 }
 
+void gen_type_cdecl(Type* type, const char* name)
+{
+    bool wrapped = *name != 0;
+    gen_type_cdecl_prefix(type, wrapped);
+    genstr(name);
+    gen_type_cdecl_suffix(type, wrapped);
+}
+
 void gen_expr(Expr* expr);
+void gen_typespec_cdecl(Typespec* typespec, const char* name);
 
-const char* gen_expr_str(Expr* expr)
+void gen_typespec_cdecl_prefix(Typespec* typespec, bool wrapped)
 {
-    char* temp = gen_buf;
-    gen_buf = NULL;
-    gen_expr(expr);
-    const char* result = gen_buf;
-    gen_buf = temp;
-    return result;
+    switch (typespec->kind)
+    {
+        case TYPESPEC_NAME:
+            genstr(typespec->name);
+            genstr(wrapped ? " " : "");
+            break;
+        case TYPESPEC_PTR:
+            gen_typespec_cdecl_prefix(typespec->base, true);
+            genstr(wrapped ? "(*" : "*");
+            break;
+        case TYPESPEC_CONST:
+            gen_typespec_cdecl_prefix(typespec->base, true);
+            genstr(wrapped ? "const (" : "const ");
+            break;
+        case TYPESPEC_ARRAY:
+            gen_typespec_cdecl_prefix(typespec->base, true);
+            genstr(wrapped ? "(" : "");
+            break;
+        case TYPESPEC_FUNC:
+            gen_typespec_cdecl_prefix(typespec->func.ret, true);
+            genstr(wrapped ? "(*" : "*");
+            break;
+        default:
+            assert(0);
+            break;
+    }
 }
 
-char* typespec_to_cdecl(Typespec* typespec, const char* str)
+void gen_typespec_cdecl_suffix(Typespec* typespec, bool wrapped)
 {
-	if (typespec->name && (typespec->name, "test_bool_a") == 0)
-	{
-		int i = 0;
-	}
     switch (typespec->kind)
     {
         case TYPESPEC_NAME:
-            return strf("%s%s%s", typespec->name, *str ? " " : "", str);
+            break;
         case TYPESPEC_PTR:
-            return typespec_to_cdecl(typespec->base, cdecl_paren(strf("*%s", str), *str));
         case TYPESPEC_CONST:
-            return typespec_to_cdecl(typespec->base, strf("const %s", cdecl_paren(str, *str)));
-        case TYPESPEC_ARRAY: 
-            if (typespec->num_elems == 0)
-            {
-                return typespec_to_cdecl(typespec->base, cdecl_paren(strf("%s[]", str), *str));
-            }
-            else
+            genstr(wrapped ? ")" : "");
+            gen_typespec_cdecl_suffix(typespec->base, true);
+            break;
+        case TYPESPEC_ARRAY:
+            genlit("[");
+            if (typespec->num_elems)
             {
-                return typespec_to_cdecl(typespec->base, cdecl_paren(strf("%s[%s]", str, gen_expr_str(typespec->num_elems)), *str));
+                gen_expr(typespec->num_elems);
             }
-        
-        case TYPESPEC_FUNC: {
-            char* result = NULL;
-            buf_printf(result, "%s(", cdecl_paren(strf("*%s", str), *str));
+            genlit("]");
+            genstr(wrapped ? ")" : "");
+            gen_typespec_cdecl_suffix(typespec->base, true);
+            break;
+        case TYPESPEC_FUNC:
+            genstr(wrapped ? ")(" : "(");
             if (typespec->func.num_args == 0)
             {
-                buf_printf(result, "void");
+                genlit("void");
             }
             else
             {
                 for (size_t i = 0; i < typespec->func.num_args; i++)
                 {
-                    buf_printf(result, "%s%s", i == 0 ? "" : ", ", typespec_to_cdecl(typespec->func.args[i], ""));
+                    if (i != 0)
+                    {
+                        genlit(", ");
+                    }
+                    gen_typespec_cdecl(typespec->func.args[i], "");
                 }
             }
             if (typespec->func.has_varargs)
             {
-                buf_printf(result, ", ...");
+                genlit(", ...");
             }
-            buf_printf(result, ")");
-            return typespec_to_cdecl(typespec->func.ret, result);
-        }
+            genlit(")");
+            gen_typespec_cdecl_suffix(typespec->func.ret, true);
+            break;
         default:
             assert(0);
-            return NULL;
+            break;
     }
 }
 
+void gen_typespec_cdecl(Typespec* typespec, const char* name)
+{
+    bool wrapped = *name != 0;
+    gen_typespec_cdecl_prefix(typespec, wrapped);
+    genstr(name);
+    gen_typespec_cdecl_suffix(typespec, wrapped);
+}
+
 void gen_func_decl(Decl* decl)
 {
     assert(decl->kind == DECL_FUNC);
     gen_sync_pos(decl->pos);
     if (decl->func.ret_type)
     {
-        genlnf("%s(", typespec_to_cdecl(decl->func.ret_type, decl->name));
+        genln();
+        gen_typespec_cdecl(decl->func.ret_type, decl->name);
+        genlit("(");
     }
     else
     {
-        genlnf("void %s(", decl->name);
+        genlnlit("void ");
+        genstr(decl->name);
+        genlit("(");
     }
     if (decl->func.num_params == 0)
     {
-        genf("void");
+        genlit("void");
     }
     else
     {
@@ -276,16 +409,16 @@ void gen_func_decl(Decl* decl)
             FuncParam param = decl->func.params[i];
             if (i != 0)
             {
-                genf(", ");
+                genlit(", ");
             }
-            genf("%s", typespec_to_cdecl(param.type, param.name));
+            gen_typespec_cdecl(param.type, param.name);
         }
     }
     if (decl->func.has_varargs)
     {
-        genf(", ...");
+        genlit(", ...");
     }
-    genf(")");
+    genlit(")");
 }
 
 void gen_forward_decls(void)
@@ -327,51 +460,59 @@ void gen_aggregate(Decl* decl)
         for (size_t j = 0; j < item.num_names; j++)
         {
             gen_sync_pos(item.pos);
-            genlnf("%s;", typespec_to_cdecl(item.type, item.names[j]));
+            genln();
+            gen_typespec_cdecl(item.type, item.names[j]);
+            genlit(";");
         }
     }
     gen_indent--;
-    genlnf("};");
+    genlnlit("};");
 }
 
 void gen_expr_compound(Expr* expr, bool is_init)
 {
     if (is_init)
     {
-        genf("{");
+        genlit("{");
     }
     else if (expr->compound.type)
     {
-        genf("(%s){", typespec_to_cdecl(expr->compound.type, ""));
+        genlit("(");
+        gen_typespec_cdecl(expr->compound.type, "");
+        genlit("){");
     }
     else
     {
-        genf("(%s){", type_to_cdecl(expr->type, ""));
+        genlit("(");
+        gen_type_cdecl(expr->type, "");
+        genlit("){");
     }
     for (size_t i = 0; i < expr->compound.num_fields; i++)
     {
         if (i != 0)
         {
-            genf(", ");
+            genlit(", ");
         }
         CompoundField field = expr->compound.fields[i];
         if (field.kind == FIELD_NAME)
         {
-            genf(".%s = ", field.name);
+            genlit(".");
+            genstr(field.name);
+            genlit(" = ");
         }
         else if (field.kind == FIELD_INDEX)
         {
-            genf("[");
+            genlit("[");
             gen_expr(field.index);
-            genf("] = ");
+            genlit("] = ");
         }
         gen_expr(field.init);
     }
     if (expr->compound.num_fields == 0)
     {
-        genf("0");
+        genlit("0");
     }
-    genf("}");
+    genlit("}");
 }
 
 void gen_expr(Expr* expr)
@@ -393,7 +534,8 @@ void gen_expr(Expr* expr)
                     gen_char((char)expr->int_lit.val);
                     break;
                 default:
-                    genf("%llu%s", expr->int_lit.val, suffix_name);
+                    genint(expr->int_lit.val);
+                    genstr(suffix_name);
                     break;
             }
         } break;
@@ -404,69 +546,84 @@ void gen_expr(Expr* expr)
             gen_str(expr->str_lit.val, expr->str_lit.mod == MOD_MULTILINE);
             break;
         case EXPR_NAME:
-            genf("%s", expr->name);
+            genstr(expr->name);
             break;
         case EXPR_CAST:
-            genf("(%s)(", type_to_cdecl(expr->cast.type->type, ""));
+            genlit("(");
+            gen_type_cdecl(expr->cast.type->type, "");
+            genlit(")(");
             gen_expr(expr->cast.expr);
-            genf(")");
+            genlit(")");
             break;
         case EXPR_CALL:
-            genf("(");
+            genlit("(");
             gen_expr(expr->call.expr);
-            genf(")");
-            genf("(");
+            genlit(")");
+            genlit("(");
             for (size_t i = 0; i < expr->call.num_args; i++)
             {
                 if (i != 0)
                 {
-                    genf(", ");
+                    genlit(", ");
                 }
                 gen_expr(expr->call.args[i]);
             }
-            genf(")");
+            genlit(")");
             break;
         case EXPR_INDEX:
             gen_expr(expr->index.expr);
-            genf("[");
+            genlit("[");
             gen_expr(expr->index.index);
-            genf("]");
+            genlit("]");
             break;
         case EXPR_FIELD:
             gen_expr(expr->field.expr);
-            genf("%s%s", expr->field.expr->type->kind == TYPE_PTR ? "->" : ".", expr->field.name);
+            if (expr->field.expr->type->kind == TYPE_PTR)
+            {
+                genlit("->");
+            }
+            else
+            {
+                genlit(".");
+            }
+            genstr(expr->field.name);
             break;
         case EXPR_COMPOUND:
             gen_expr_compound(expr, false);
             break;
         case EXPR_UNARY:
-            genf("%s(", token_kind_name(expr->unary.op));
+            genstr(token_kind_name(expr->unary.op));
+            genlit("(");
             gen_expr(expr->unary.expr);
-            genf(")");
+            genlit(")");
             break;
         case EXPR_BINARY:
-            genf("(");
+            genlit("(");
             gen_expr(expr->binary.left);
-            genf(") %s (", token_kind_name(expr->binary.op));
+            genlit(") ");
+            genstr(token_kind_name(expr->binary.op));
+            genlit(" (");
             gen_expr(expr->binary.right);
-            genf(")");
+            genlit(")");
             break;
         case EXPR_TERNARY:
-            genf("(");
+            genlit("(");
             gen_expr(expr->ternary.cond);
-            genf(" ? ");
+            genlit(" ? ");
             gen_expr(expr->ternary.if_true);
-            genf(" : ");
+            genlit(" : ");
             gen_expr(expr->ternary.if_false);
-            genf(")");
+            genlit(")");
             break;
         case EXPR_SIZEOF_EXPR:
-            genf("sizeof(");
+            genlit("sizeof(");
             gen_expr(expr->sizeof_expr);
-            genf(")");
+            genlit(")");
             break;
         case EXPR_SIZEOF_TYPE:
-            genf("sizeof(%s)", type_to_cdecl(expr->sizeof_type->type, ""));
+            genlit("sizeof(");
+            gen_type_cdecl(expr->sizeof_type->type, "");
+            genlit(")");
             break;
         default:
             assert(0);
@@ -477,14 +634,14 @@ void gen_stmt(Stmt* stmt);
 
 void gen_stmt_block(StmtList block)
 {
-    genf("{"); 
+    genlit("{"); 
     gen_indent++;
     for (size_t i = 0; i < block.num_stmts; i++)
     {
         gen_stmt(block.stmts[i]);
     }
     gen_indent--;
-    genlnf("}");
+    genlnlit("}");
 }
 
 void gen_init_expr(Expr* expr)
@@ -511,21 +668,22 @@ void gen_simple_stmt(Stmt* stmt)
             {
                 if (is_incomplete_array_typespec(stmt->init.type))
                 {
-                    genf("%s", type_to_cdecl(stmt->init.expr->type, stmt->init.name));
+                    gen_type_cdecl(stmt->init.expr->type, stmt->init.name);
                 }
                 else
                 {
-                    genf("%s", typespec_to_cdecl(stmt->init.type, stmt->init.name));
+                    gen_typespec_cdecl(stmt->init.type, stmt->init.name);
                 }
                 if (stmt->init.expr)
                 {
-                    genf(" = ");
+                    genlit(" = ");
                     gen_init_expr(stmt->init.expr);
                 }
             }
             else
             {
-                genf("%s = ", type_to_cdecl(unqualify_type(stmt->init.expr->type), stmt->init.name));
+                gen_type_cdecl(unqualify_type(stmt->init.expr->type), stmt->init.name);
+                genlit(" = ");
                 gen_init_expr(stmt->init.expr);
             }
             break;
@@ -533,12 +691,14 @@ void gen_simple_stmt(Stmt* stmt)
             gen_expr(stmt->assign.left);
             if (stmt->assign.right)
             {
-                genf(" %s ", token_kind_name(stmt->assign.op));
+                genlit(" ");
+                genstr(token_kind_name(stmt->assign.op));
+                genlit(" ");
                 gen_expr(stmt->assign.right);
             }
             else
             {
-                genf("%s", token_kind_name(stmt->assign.op));
+                genstr(token_kind_name(stmt->assign.op));
             }
             break;
         default:
@@ -552,124 +712,124 @@ void gen_stmt(Stmt* stmt)
     switch (stmt->kind)
     {
         case STMT_RETURN:
-            genlnf("return");
+            genlnlit("return");
             if (stmt->expr)
             {
-                genf(" ");
+                genlit(" ");
                 gen_expr(stmt->expr);
             }
-            genf(";");
+            genlit(";");
             break;
         case STMT_BREAK:
-            genlnf("break;");
+            genlnlit("break;");
             break;
         case STMT_CONTINUE:
-            genlnf("continue;");
+            genlnlit("continue;");
             break;
         case STMT_BLOCK:
             genln();
             gen_stmt_block(stmt->block);
             break;
         case STMT_IF:
-            genlnf("if (");
+            genlnlit("if (");
             gen_expr(stmt->if_stmt.cond);
-            genf(") ");
+            genlit(") ");
             gen_stmt_block(stmt->if_stmt.then_block);
             for (size_t i = 0; i < stmt->if_stmt.num_elseifs; i++)
             {
                 ElseIf elseif = stmt->if_stmt.elseifs[i];
-                genf(" else if (");
+                genlit(" else if (");
                 gen_expr(elseif.cond);
-                genf(") ");
+                genlit(") ");
                 gen_stmt_block(elseif.block);
             }
             if (stmt->if_stmt.else_block.stmts)
             {
-                genf(" else ");
+                genlit(" else ");
                 gen_stmt_block(stmt->if_stmt.else_block);
             }
             break;
         case STMT_WHILE:
-            genlnf("while (");
+            genlnlit("while (");
             gen_expr(stmt->while_stmt.cond);
-            genf(") ");
+            genlit(") ");
             gen_stmt_block(stmt->while_stmt.block);
             break;
         case STMT_DO_WHILE:
-            genlnf("for (");
+            genlnlit("for (");
             if (stmt->for_stmt.init)
             {
                 gen_simple_stmt(stmt->for_stmt.init);
             }
-            genf("; ");
+            genlit("; ");
             if (stmt->for_stmt.cond)
             {
                 gen_expr(stmt->for_stmt.cond);
             }
-            genf("; ");
+            genlit("; ");
             if (stmt->for_stmt.next)
             {
                 gen_simple_stmt(stmt->for_stmt.next);
             }
-            genf(") ");
+            genlit(") ");
             gen_stmt_block(stmt->for_stmt.block);
             break;
         case STMT_FOR:
-            genlnf("for (");
+            genlnlit("for (");
             if (stmt->for_stmt.init)
             {
                 gen_simple_stmt(stmt->for_stmt.init);
             }
-            genf(";");
+            genlit(";");
             if (stmt->for_stmt.cond)
             {
-                genf(" ");
+                genlit(" ");
                 gen_expr(stmt->for_stmt.cond);
             }
-            genf(";");
+            genlit(";");
             if (stmt->for_stmt.next)
             {
-                genf(" ");
+                genlit(" ");
                 gen_simple_stmt(stmt->for_stmt.next);
             }
-            genf(") ");
+            genlit(") ");
             gen_stmt_block(stmt->for_stmt.block);
             break;
         case STMT_SWITCH:
-            genlnf("switch (");
+            genlnlit("switch (");
             gen_expr(stmt->switch_stmt.expr);
-            genf(") {");
+            genlit(") {");
             for (size_t i = 0; i < stmt->switch_stmt.num_cases; i++)
             {
                 SwitchCase switch_case = stmt->switch_stmt.cases[i];
                 for (size_t j = 0; j < switch_case.num_exprs; j++)
                 {
-                    genlnf("case ");
+                    genlnlit("case ");
                     gen_expr(switch_case.exprs[j]);
-                    genf(":");
+                    genlit(":");
                 }
                 if (switch_case.is_default)
                 {
-                    genlnf("default:");
+                    genlnlit("default:");
                 }
-                genf(" ");
-                genf("{");
+                genlit(" ");
+                genlit("{");
                 gen_indent++;
                 StmtList block = switch_case.block;
                 for (size_t j = 0; j < block.num_stmts; j++)
                 {
                     gen_stmt(block.stmts[j]);
                 }
-                genlnf("break;");
+                genlnlit("break;");
                 gen_indent--;
-                genlnf("}");
+                genlnlit("}");
             }
-            genlnf("}");
+            genlnlit("}");
             break;
         default:
             genln();
             gen_simple_stmt(stmt);
-            genf(";");
+            genlit(";");
             break;
     }
 }
@@ -681,12 +841,165 @@ void gen_enum(Decl* decl)
     gen_indent++;
     for (size_t i = 0; i < decl->enum_decl.num_items; i++)
     {
-        genlnf("%s,", decl->enum_decl.items[i].name);
+        genln();
+        genstr(decl->enum_decl.items[i].name);
+        genlit(",");
     }
     gen_indent--;
     genlnf("} %s;", decl->name);
 }
 
+// The member a union's value is emitted through: the first of the largest, which
+// covers all of the union's data.
+TypeField* gen_union_field(Type* type)
+{
+    TypeField* field = &type->aggregate.fields[0];
+    for (size_t i = 1; i < type->aggregate.num_fields; i++)
+    {
+        if (type->aggregate.fields[i].type->size > field->type->size)
+        {
+            field = &type->aggregate.fields[i];
+        }
+    }
+    return field;
+}
+
+void gen_float(double val, bool is_float)
+{
+    if (isnan(val))
+    {
+        genlit("NAN");
+    }
+    else if (isinf(val))
+    {
+        genf("%sHUGE_VAL%s", val < 0 ? "-" : "", is_float ? "F" : "");
+    }
+    else
+    {
+        char digits[32];
+        snprintf(digits, sizeof(digits), is_float ? "%.9g" : "%.17g", val);
+        genstr(digits);
+        if (!strpbrk(digits, ".e"))
+        {
+            genlit(".0");
+        }
+        if (is_float)
+        {
+            genlit("f");
+        }
+    }
+}
+
+Sym* vm_func_sym(void* func);
+
+// Emits a value computed at compile time, with the memory layout of type, as an
+// initializer. Pointers in it are null; see vm_check_value.
+void gen_value(Type* type, const char* data)
+{
+    type = unqualify_type(type);
+    switch (type->kind)
+    {
+        case TYPE_FLOAT: {
+            float val;
+            memcpy(&val, data, sizeof(val));
+            gen_float(val, true);
+            break;
+        }
+        case TYPE_DOUBLE: {
+            double val;
+            memcpy(&val, data, sizeof(val));
+            gen_float(val, false);
+            break;
+        }
+        case TYPE_PTR:
+            genlit("0");
+            break;
+        case TYPE_FUNC: {
+            void* func;
+            memcpy(&func, data, sizeof(func));
+            if (func)
+            {
+                genstr(vm_func_sym(func)->name);
+            }
+            else
+            {
+                genlit("0");
+            }
+            break;
+        }
+        case TYPE_ARRAY:
+            genlit("{");
+            gen_indent++;
+            for (size_t i = 0; i < type->num_elems; i++)
+            {
+                // Long tables are wrapped, a row of elements to a line.
+                if (type->num_elems > 8 && i % 8 == 0)
+                {
+                    genln();
+                }
+                else if (i != 0)
+                {
+                    genlit(" ");
+                }
+                gen_value(type->base, data + i * type->base->size);
+                if (i + 1 != type->num_elems)
+                {
+                    genlit(",");
+                }
+            }
+            gen_indent--;
+            if (type->num_elems > 8)
+            {
+                genln();
+            }
+            genlit("}");
+            break;
+        case TYPE_STRUCT:
+            genlit("{");
+            for (size_t i = 0; i < type->aggregate.num_fields; i++)
+            {
+                TypeField field = type->aggregate.fields[i];
+                if (i != 0)
+                {
+                    genlit(", ");
+                }
+                gen_value(field.type, data + field.offset);
+            }
+            genlit("}");
+            break;
+        case TYPE_UNION: {
+            TypeField* field = gen_union_field(type);
+            genf("{.%s = ", field->name);
+            gen_value(field->type, data + field->offset);
+            genlit("}");
+            break;
+        }
+        default: {
+            assert(is_integer_type(type));
+            unsigned long long bits = 0;
+            memcpy(&bits, data, type->size);
+            if (is_signed_type(type))
+            {
+                int shift = 64 - 8 * (int)type->size;
+                long long val = (long long)(bits << shift) >> shift;
+                if (val == LLONG_MIN)
+                {
+                    genlit("(-9223372036854775807ll - 1)");
+                }
+                else
+                {
+                    genf("%lld%s", val, type->size == 8 ? "ll" : "");
+                }
+            }
+            else
+            {
+                genf("%llu%s", bits, type->size == 8 ? "ull" : "u");
+            }
+            break;
+        }
+    }
+}
+
 void gen_decl(Sym* sym)
 {
     Decl* decl = sym->decl;
@@ -694,40 +1007,59 @@ void gen_decl(Sym* sym)
     {
         return;
     }
+    TRACE_BEGIN("gen_decl", sym->name);
     gen_sync_pos(decl->pos);
     switch (decl->kind)
     {
         case DECL_CONST:
-            genlnf("#define %s (", sym->name);
-            gen_expr(decl->const_decl.expr);
-            genf(")");
+            genlnlit("#define ");
+            genstr(sym->name);
+            genlit(" (");
+            if (sym->init_val)
+            {
+                gen_value(sym->type, sym->init_val);
+            }
+            else
+            {
+                gen_expr(decl->const_decl.expr);
+            }
+            genlit(")");
             break;
         case DECL_VAR:
             if (decl->var.type && !is_incomplete_array_typespec(decl->var.type))
             {
-                genlnf("%s", typespec_to_cdecl(decl->var.type, sym->name));
+                genln();
+                gen_typespec_cdecl(decl->var.type, sym->name);
             }
             else
             {
-                genlnf("%s", type_to_cdecl(sym->type, sym->name));
+                genln();
+                gen_type_cdecl(sym->type, sym->name);
+            }
+            if (sym->init_val)
+            {
+                genlit(" = ");
+                gen_value(sym->type, sym->init_val);
             }
-            if (decl->var.expr)
+            else if (decl->var.expr)
             {
-                genf(" = ");
+                genlit(" = ");
                 gen_init_expr(decl->var.expr);
             }
-            genf(";");
+            genlit(";");
             break;
         case DECL_FUNC:
             gen_func_decl(decl);
-            genf(";");
+            genlit(";");
             break;
         case DECL_STRUCT:
         case DECL_UNION:
             gen_aggregate(decl);
             break;
         case DECL_TYPEDEF:
-            genlnf("typedef %s;", typespec_to_cdecl(decl->typedef_decl.type, sym->name));
+            genlnlit("typedef ");
+            gen_typespec_cdecl(decl->typedef_decl.type, sym->name);
+            genlit(";");
             break;
         case DECL_ENUM:
             gen_enum(decl);
@@ -737,6 +1069,7 @@ void gen_decl(Sym* sym)
             break;
     }
     genln();
+    TRACE_END();
 }
 
 void gen_sorted_decls(void)
@@ -747,6 +1080,135 @@ void gen_sorted_decls(void)
     }
 }
 
+void gen_func_def(Sym* sym)
+{
+    Decl* decl = sym->decl;
+    TRACE_BEGIN("gen_func_def", sym->name);
+    gen_func_decl(decl);
+    genlit(" ");
+    gen_stmt_block(decl->func.block);
+    genln();
+    TRACE_END();
+}
+
+// Each definition is generated on its own, starting already synced to its declaration.
+// The only state it would otherwise inherit from the definition before it is gen_pos,
+// and only through its leading #line directive, which the main thread emits as it
+// appends the definitions in order. So the output is the same for any number of
+// workers, and a definition can be reused from the cache wherever it ends up.
+// The main thread appends each batch as soon as it is done and frees it, and workers
+// stay at most GEN_BATCHES_AHEAD batches each ahead of it, so the output is still
+// flushed in GEN_FLUSH_SIZE chunks with a bounded amount of it in memory.
+enum {
+    GEN_FUNC_BATCH = 64,
+    GEN_BATCHES_AHEAD = 2,
+};
+
+typedef struct GenFuncDef {
+    size_t start;
+    size_t end;
+    int end_line;
+} GenFuncDef;
+
+typedef struct GenBatch {
+    size_t begin;
+    size_t end;
+    char* buf;
+    bool done;
+} GenBatch;
+
+Sym** gen_func_syms;
+GenFuncDef* gen_func_defs_buf;
+GenBatch* gen_batches;
+size_t next_gen_batch;
+// Batches from here on wait until the main thread has appended more of the earlier ones.
+size_t gen_batch_limit;
+Mutex gen_batch_mutex = MUTEX_INIT;
+CondVar gen_batch_cond = COND_VAR_INIT;
+
+void gen_func_batch(GenBatch* batch)
+{
+    gen_buf = NULL;
+    gen_indent = 0;
+    for (size_t j = batch->begin; j < batch->end; j++)
+    {
+        Sym* sym = gen_func_syms[j];
+        if (sym->cached)
+        {
+            continue;
+        }
+        GenFuncDef* def = &gen_func_defs_buf[j];
+        gen_pos = sym->decl->pos;
+        def->start = buf_len(gen_buf);
+        gen_func_def(sym);
+        def->end = buf_len(gen_buf);
+        def->end_line = gen_pos.line;
+    }
+    batch->buf = gen_buf;
+    gen_buf = NULL;
+}
+
+void gen_func_defs_worker(void)
+{
+    for (;;)
+    {
+        mutex_lock(&gen_batch_mutex);
+        while (next_gen_batch >= gen_batch_limit && next_gen_batch < buf_len(gen_batches))
+        {
+            cond_wait(&gen_batch_cond, &gen_batch_mutex);
+        }
+        size_t i = next_gen_batch++;
+        mutex_unlock(&gen_batch_mutex);
+        if (i >= buf_len(gen_batches))
+        {
+            break;
+        }
+        GenBatch* batch = &gen_batches[i];
+        gen_func_batch(batch);
+        mutex_lock(&gen_batch_mutex);
+        batch->done = true;
+        cond_broadcast(&gen_batch_cond);
+        mutex_unlock(&gen_batch_mutex);
+    }
+}
+
+// Appends a definition generated when its function started at another line, shifting
+// its #line directives to match. Those directives are the only generated lines that
+// start with #line after their indentation.
+void gen_shifted(const char* text, size_t len, int line_delta)
+{
+    const char* end = text + len;
+    const char* copied = text;
+    for (const char* ptr = text; line_delta && ptr != end; ptr++)
+    {
+        if (*ptr != '\n')
+        {
+            continue;
+        }
+        const char* line = ptr + 1;
+        while (line != end && *line == ' ')
+        {
+            line++;
+        }
+        if (end - line < 6 || memcmp(line, "#line ", 6) != 0)
+        {
+            continue;
+        }
+        const char* digits = line + 6;
+        const char* digits_end = digits;
+        unsigned long long line_num = 0;
+        while (digits_end != end && isdigit(*digits_end))
+        {
+            line_num = line_num * 10 + (*digits_end++ - '0');
+        }
+        buf_append(gen_buf, copied, digits - copied);
+        genint(line_num + line_delta);
+        copied = digits_end;
+        ptr = digits_end - 1;
+    }
+    buf_append(gen_buf, copied, end - copied);
+}
+
 void gen_func_defs(void)
 {
     for (Sym** it = global_syms_buf; it != buf_end(global_syms_buf); it++)
@@ -755,23 +1217,141 @@ void gen_func_defs(void)
         Decl* decl = sym->decl;
         if (decl && decl->kind == DECL_FUNC && !is_decl_foreign(decl))
         {
-            gen_func_decl(decl);
-            genf(" ");
-            gen_stmt_block(decl->func.block);
-            genln();
+            buf_push(gen_func_syms, sym);
+        }
+    }
+    size_t num_funcs = buf_len(gen_func_syms);
+    size_t num_workers = MIN(get_num_workers(), num_funcs / GEN_FUNC_BATCH);
+    if (num_workers <= 1 && !cache_enabled)
+    {
+        for (size_t i = 0; i < num_funcs; i++)
+        {
+            gen_func_def(gen_func_syms[i]);
+        }
+        buf_free(gen_func_syms);
+        return;
+    }
+
+    gen_func_defs_buf = xcalloc(num_funcs + 1, sizeof(GenFuncDef));
+    for (size_t i = 0; i < num_funcs; i += GEN_FUNC_BATCH)
+    {
+        buf_push(gen_batches, (GenBatch) { i, MIN(i + GEN_FUNC_BATCH, num_funcs) });
+    }
+    // Without workers, as when only the cache needs the definitions on their own, the
+    // main thread generates each batch just before appending it.
+    Worker* workers = NULL;
+    if (num_workers > 1)
+    {
+        next_gen_batch = 0;
+        gen_batch_limit = num_workers * GEN_BATCHES_AHEAD;
+        workers = start_workers(gen_func_defs_worker, num_workers);
+    }
+
+    for (GenBatch* batch = gen_batches; batch != buf_end(gen_batches); batch++)
+    {
+        if (workers)
+        {
+            mutex_lock(&gen_batch_mutex);
+            while (!batch->done)
+            {
+                cond_wait(&gen_batch_cond, &gen_batch_mutex);
+            }
+            mutex_unlock(&gen_batch_mutex);
+        }
+        else
+        {
+            char* buf = gen_buf;
+            FILE* file = gen_file;
+            SrcPos pos = gen_pos;
+            gen_file = NULL;
+            gen_func_batch(batch);
+            gen_buf = buf;
+            gen_file = file;
+            gen_pos = pos;
+        }
+        for (size_t i = batch->begin; i < batch->end; i++)
+        {
+            Sym* sym = gen_func_syms[i];
+            SrcPos pos = sym->decl->pos;
+            if (gen_file && buf_len(gen_buf) >= GEN_FLUSH_SIZE)
+            {
+                gen_flush();
+            }
+            gen_sync_pos(pos);
+            CachedFunc* cached = sym->cached;
+            if (cached)
+            {
+                int line_delta = pos.line - cached->line;
+                gen_shifted(cached->text, cached->len, line_delta);
+                gen_pos.line = cached->end_line + line_delta;
+            }
+            else
+            {
+                GenFuncDef def = gen_func_defs_buf[i];
+                buf_append(gen_buf, batch->buf + def.start, def.end - def.start);
+                gen_pos.line = def.end_line;
+                if (cache_enabled)
+                {
+                    cache_put_func(sym, batch->buf + def.start, def.end - def.start, def.end_line);
+                }
+            }
         }
+        buf_free(batch->buf);
+        if (workers)
+        {
+            mutex_lock(&gen_batch_mutex);
+            gen_batch_limit = batch - gen_batches + 1 + num_workers * GEN_BATCHES_AHEAD;
+            cond_broadcast(&gen_batch_cond);
+            mutex_unlock(&gen_batch_mutex);
+        }
+    }
+    if (workers)
+    {
+        join_workers(workers, num_workers);
     }
+    buf_free(gen_batches);
+    free(gen_func_defs_buf);
+    gen_func_defs_buf = NULL;
+    buf_free(gen_func_syms);
 }
 
 void gen_all(void)
 {
     gen_buf = NULL;
-    genf("%s", gen_preamble);
-    genf("// Forward declarations");
+    gen_pos = (SrcPos) { 0 };
+    genstr(gen_preamble);
+    genlit("// Forward declarations");
     gen_forward_decls();
     genln();
-    genlnf("// Sorted declarations");
+    genlnlit("// Sorted declarations");
     gen_sorted_decls();
-    genlnf("// Function definitions");
+    genlnlit("// Function definitions");
     gen_func_defs();
+    if (gen_file)
+    {
+        gen_flush();
+    }
+    else
+    {
+        stats.num_gen_bytes += buf_len(gen_buf);
+    }
+}
+
+bool gen_all_to_file(const char* path)
+{
+    gen_file = fopen(path, "w");
+    if (!gen_file)
+    {
+        return false;
+    }
+    gen_file_error = false;
+    gen_all();
+    bool ok = !gen_file_error;
+    if (fclose(gen_file) != 0)
+    {
+        ok = false;
+    }
+    gen_file = NULL;
+    buf_free(gen_buf);
+    return ok;
 }
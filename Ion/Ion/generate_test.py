@@ -1,3 +1,13 @@
+import sys
+
+# Synthetic corpus generator for compile-time benchmarking.
+#
+# Usage: python generate_test.py [num_decls] > bench.ion
+#        ion -bench bench.ion
+#
+# Each template instance contributes DECLS_PER_TEMPLATE top-level declarations,
+# so the number of instances is num_decls / DECLS_PER_TEMPLATE (at least 1).
+
 template = """
 func example_test(?)(): int {
     return fact_rec(?)(10) == fact_iter(?)(10);
@@ -8,19 +18,20 @@ union IntOrPtr(?) {
     p: int*;
 }
 
-// func f(?)() {
-//    u1 : IntOrPtr(?){ i = 42 };
-//    u2 : IntOrPtr(?){ p = (:int*)42 };
-//    u1.i = 0;
-//    u2.p = (:int*)0;
-// }
-
-var i(?): int
+var i(?): int;
 
 struct Vector(?) {
     x, y: int;
 }
 
+func add(?)(v: Vector(?), w: Vector(?)): Vector(?) {
+    return {v.x + w.x, v.y + w.y};
+}
+
+typedef Callback(?) = func(Vector(?)*, int): int;
+
+var buf(?): char[(?) + 1];
+
 func fact_iter(?)(n: int): int {
     r := 1;
     for (i := 2; i <= n; i++)
@@ -30,7 +41,7 @@ func fact_iter(?)(n: int): int {
     return r;
 }
 
-func fact_rec(?)(n : int): int {
+func fact_rec(?)(n: int): int {
     if (n == 0)
     {
         return 1;
@@ -41,16 +52,21 @@ func fact_rec(?)(n : int): int {
     }
 }
 
-const n(?) = 1 + sizeof(p(?))
+const n(?) = 1 + sizeof(p(?));
 
-var p(?): T(?)*
+var p(?): T(?)*;
 
 struct T(?) {
     a: int[n(?)];
 }
 """
 
-print("func main(argc: int, argv: char**): int { return 0; }")
+DECLS_PER_TEMPLATE = 12
+
+num_decls = int(sys.argv[1]) if len(sys.argv) > 1 else 32 * 1024 * DECLS_PER_TEMPLATE
+num_templates = max(1, num_decls // DECLS_PER_TEMPLATE)
 
-for i in range(32* 1024):
-    print(template.replace("(?)", str(i)))
\ No newline at end of file
+out = sys.stdout
+out.write("func main(argc: int, argv: char**): int { return 0; }\n")
+for i in range(num_templates):
+    out.write(template.replace("(?)", str(i)))
@@ -1,30 +1,233 @@
+// With -run, the program is run by the interpreter instead of being generated as C,
+// with run_args passed to its main.
+bool run_enabled;
+const char** run_args;
+size_t num_run_args;
+int run_exit_code;
+
+// With -cache, generated function definitions are kept in <c_path>.cache and reused
+// by the next compile when nothing they depend on has changed. Watch mode keeps them
+// in memory instead.
+bool ion_compile_decls(DeclSet* declset, const char* c_path)
+{
+    const char* cache_path = NULL;
+    if (cache_enabled && !cache_in_memory)
+    {
+        cache_path = strf("%s.cache", c_path);
+        cache_load(cache_path);
+        resolve_deps_enabled = true;
+    }
+
+    phase_begin(PHASE_SYMS);
+    sym_global_decls(declset);
+    phase_end(PHASE_SYMS);
+
+    phase_begin(PHASE_FINALIZE);
+    finalize_global_syms();
+    if (cache_enabled)
+    {
+        cache_reuse_funcs();
+    }
+    resolve_func_bodies();
+    phase_end(PHASE_FINALIZE);
+
+    if (run_enabled)
+    {
+        return vm_run_main(run_args, num_run_args, &run_exit_code);
+    }
+
+    phase_begin(PHASE_GEN);
+    bool written = gen_all_to_file(c_path);
+    phase_end(PHASE_GEN);
+    if (written && cache_path && !cache_save(cache_path))
+    {
+        printf("Failed to write cache file %s\n", cache_path);
+    }
+    return written;
+}
 
 bool ion_compile_file(const char* path)
 {
-    char* str = read_file(path);
-    if (!str)
+    phase_begin(PHASE_READ);
+    size_t num_lines = 0;
+    DeclSet* declset = ast_load_source(path, &num_lines);
+    MappedFile file = { 0 };
+    bool mapped = declset || (!is_ast_path(path) && map_file(path, &file));
+    phase_end(PHASE_READ);
+    if (!mapped)
     {
         return false;
     }
 
-    init_stream(path, str);
+    phase_begin(PHASE_PARSE);
+    if (!declset)
+    {
+        init_stream(path, file.buf);
+        declset = parse_file();
+        num_lines = token.pos.line;
+        ast_save_source(path, declset, num_lines);
+    }
     init_builtins();
-    DeclSet* declset = parse_file();
-    sym_global_decls(declset);
-    finalize_syms();
-    gen_all();
-    const char* c_code = gen_buf;
-    gen_buf = NULL;
+    stats.num_lines += num_lines;
+    phase_end(PHASE_PARSE);
+
     const char* c_path = replace_ext(path, "c");
     if (!c_path)
     {
         return false;
     }
-    if (!write_file(c_path, c_code, buf_len(c_code)))
+    bool written = ion_compile_decls(declset, c_path);
+    unmap_file(&file);
+    return written;
+}
+
+// Multiple files are read, lexed and parsed on a pool of worker threads, each with
+// its own lexer state and ast_arena. Their declarations are merged in input order,
+// so the generated code does not depend on scheduling, and the remaining phases run
+// on the main thread as for a single file.
+typedef struct ParseJob {
+    const char* path;
+    DeclSet* declset;
+    // If set, the file's AST is allocated from this arena rather than the thread's, so
+    // that watch mode can free it when the file is parsed again.
+    Arena* arena;
+    // The source while it is being parsed.
+    MappedFile file;
+    bool read_failed;
+} ParseJob;
+
+ParseJob* parse_jobs;
+size_t num_parse_jobs;
+size_t next_parse_job;
+Mutex parse_job_mutex = MUTEX_INIT;
+
+void parse_job(ParseJob* job)
+{
+    size_t num_lines = 0;
+    job->declset = ast_load_source(job->path, &num_lines);
+    if (job->declset)
+    {
+        stats.num_lines += num_lines;
+    }
+    else if (!is_ast_path(job->path) && map_file(job->path, &job->file))
+    {
+        init_stream(job->path, job->file.buf);
+        job->declset = parse_file();
+        stats.num_lines += token.pos.line;
+        unmap_file(&job->file);
+        ast_save_source(job->path, job->declset, token.pos.line);
+    }
+    else
+    {
+        job->read_failed = true;
+    }
+}
+
+void parse_job_end(ParseJob* job, Arena thread_arena)
+{
+    if (job->arena)
+    {
+        *job->arena = ast_arena;
+        ast_arena = thread_arena;
+    }
+}
+
+// A fatal error in a watch mode rebuild is caught here first, so that the job's arena
+// is handed back and the thread's buffers freed before the error is passed on to
+// run_workers.
+void parse_worker(void)
+{
+    jmp_buf* outer_jmp = fatal_jmp;
+    for (;;)
+    {
+        mutex_lock(&parse_job_mutex);
+        size_t i = next_parse_job++;
+        mutex_unlock(&parse_job_mutex);
+        if (i >= num_parse_jobs)
+        {
+            break;
+        }
+        ParseJob* job = &parse_jobs[i];
+        Arena thread_arena = ast_arena;
+        if (job->arena)
+        {
+            ast_arena = *job->arena;
+        }
+        jmp_buf jmp;
+        if (outer_jmp)
+        {
+            fatal_jmp = &jmp;
+            if (setjmp(jmp))
+            {
+                fatal_jmp = outer_jmp;
+                parse_job_end(job, thread_arena);
+                unmap_file(&job->file);
+                buf_free(parse_list_stack);
+                fatal_exit();
+            }
+        }
+        parse_job(job);
+        fatal_jmp = outer_jmp;
+        parse_job_end(job, thread_arena);
+    }
+    // The thread ends with the parse, and a long-running compiler starts new ones.
+    buf_free(parse_list_stack);
+}
+
+void run_parse_jobs(ParseJob* jobs, size_t num_jobs)
+{
+    parse_jobs = jobs;
+    num_parse_jobs = num_jobs;
+    next_parse_job = 0;
+
+    intern_lock_begin();
+    run_workers(parse_worker, MIN(get_num_workers(), num_jobs));
+    intern_lock_end();
+    parse_jobs = NULL;
+}
+
+DeclSet* parse_files(const char** paths, size_t num_paths)
+{
+    ParseJob* jobs = xcalloc(num_paths, sizeof(ParseJob));
+    for (size_t i = 0; i < num_paths; i++)
+    {
+        jobs[i].path = paths[i];
+    }
+    run_parse_jobs(jobs, num_paths);
+
+    Decl** decls = NULL;
+    bool read_failed = false;
+    for (size_t i = 0; i < num_paths; i++)
+    {
+        ParseJob job = jobs[i];
+        if (job.read_failed)
+        {
+            printf("Failed to read %s\n", job.path);
+            read_failed = true;
+            continue;
+        }
+        for (size_t j = 0; j < job.declset->num_decls; j++)
+        {
+            buf_push(decls, job.declset->decls[j]);
+        }
+    }
+    DeclSet* declset = read_failed ? NULL : decl_set(decls, buf_len(decls));
+    buf_free(decls);
+    free(jobs);
+    return declset;
+}
+
+bool ion_compile_files(const char** paths, size_t num_paths, const char* c_path)
+{
+    phase_begin(PHASE_PARSE);
+    DeclSet* declset = parse_files(paths, num_paths);
+    phase_end(PHASE_PARSE);
+    if (!declset)
     {
         return false;
     }
-    return true;
+    init_builtins();
+    return ion_compile_decls(declset, c_path);
 }
 
 const char* ion_compile_str(const char* str)
@@ -39,20 +242,172 @@ const char* ion_compile_str(const char* str)
     return result;
 }
 
+// The output is named after the directory when one is given, and otherwise after the
+// first file.
+const char* ion_output_path(const char** paths, size_t num_paths)
+{
+    if (num_paths == 1 && is_dir(paths[0]))
+    {
+        return strf("%s.c", paths[0]);
+    }
+    return replace_ext(paths[0], "c");
+}
+
+// Trailing separators are dropped from directory paths so that the output and the
+// files listed in them are named consistently.
+const char* trim_dir_path(const char* path)
+{
+    char* dir = strf("%s", path);
+    for (char* end = dir + strlen(dir) - 1; end > dir && (*end == '/' || *end == '\\'); end--)
+    {
+        *end = 0;
+    }
+    return dir;
+}
+
+int ion_watch(const char** paths, size_t num_paths, bool watch, const char* socket_path, bool show_stats);
+int ion_connect(const char* socket_path);
+
 int ion_main(int argc, char** args)
 {
-    if (argc < 2)
+    bool bench = false;
+    bool show_stats = false;
+    const char* trace_path = NULL;
+    bool watch = false;
+    const char* serve_path = NULL;
+    const char* connect_path = NULL;
+    const char** paths = NULL;
+    for (int i = 1; i < argc; i++)
     {
-        printf("Usage: %s <ion-source-file>\n", args[0]);
+        if (strcmp(args[i], "-bench") == 0)
+        {
+            bench = true;
+        }
+        else if (strcmp(args[i], "-stats") == 0)
+        {
+            show_stats = true;
+        }
+        else if (strcmp(args[i], "-trace") == 0 && i + 1 < argc)
+        {
+            trace_path = args[++i];
+        }
+        else if (strcmp(args[i], "-cache") == 0)
+        {
+            cache_enabled = true;
+        }
+        else if (strcmp(args[i], "-ast") == 0)
+        {
+            ast_files_enabled = true;
+        }
+        else if (strcmp(args[i], "-j") == 0 && i + 1 < argc)
+        {
+            num_worker_threads = strtoul(args[++i], NULL, 10);
+        }
+        else if (strcmp(args[i], "-watch") == 0)
+        {
+            watch = true;
+        }
+        else if (strcmp(args[i], "-serve") == 0 && i + 1 < argc)
+        {
+            serve_path = args[++i];
+        }
+        else if (strcmp(args[i], "-connect") == 0 && i + 1 < argc)
+        {
+            connect_path = args[++i];
+        }
+        else if (strcmp(args[i], "-run") == 0)
+        {
+            run_enabled = true;
+        }
+        else if (strcmp(args[i], "--") == 0)
+        {
+            run_args = (const char**)args + i + 1;
+            num_run_args = argc - i - 1;
+            break;
+        }
+        else
+        {
+            buf_push(paths, trim_dir_path(args[i]));
+        }
+    }
+    if (connect_path)
+    {
+        return ion_connect(connect_path);
+    }
+    if (buf_len(paths) == 0 || (bench && buf_len(paths) != 1) || (run_enabled && (bench || watch || serve_path)))
+    {
+        printf("Usage: %s [-bench] [-stats] [-trace <json-file>] [-j <threads>] [-cache] [-ast] <ion-source-file | directory>...\n", args[0]);
+        printf("       %s -run [-stats] [-j <threads>] [-ast] <ion-source-file | directory>... [-- <args>...]\n", args[0]);
+        printf("       %s [-watch] [-serve <socket>] [-stats] [-j <threads>] [-ast] <ion-source-file | directory>...\n", args[0]);
+        printf("       %s -connect <socket>\n", args[0]);
+        printf("Multiple files or a directory of .ion files are compiled into one C file named\n");
+        printf("after the first file or the directory. -bench takes a single file. -j sets the\n");
+        printf("number of threads used to parse files and resolve function bodies (default: one per CPU).\n");
+        printf("-cache reuses generated function definitions from <output>.cache when nothing they\n");
+        printf("depend on has changed.\n");
+        printf("-ast saves each parsed file as <file>.ionast and loads it from there while the file\n");
+        printf("is unchanged. A .ionast file can also be given in place of its source file.\n");
+        printf("-watch keeps the compiler running and rebuilds whenever an input changes. -serve also\n");
+        printf("rebuilds when a client connects to <socket>, and sends it the compiler's output;\n");
+        printf("-connect is such a client. Either keeps parsed files and generated functions in memory.\n");
+        printf("-run runs the program's main in the interpreter instead of generating C, passing it\n");
+        printf("the arguments after --, and exits with its result.\n");
         return 1;
     }
+    if (trace_path)
+    {
+        trace_init();
+    }
     init_keywords();
-    const char* path = args[1];
-    if (!ion_compile_file(path))
+    if (run_enabled)
+    {
+        cache_enabled = false;
+    }
+    if (watch || serve_path)
+    {
+        return ion_watch(paths, buf_len(paths), watch, serve_path, show_stats);
+    }
+    bool compiled;
+    if (bench)
+    {
+        compiled = ion_bench_file(paths[0]);
+    }
+    else if (buf_len(paths) == 1 && !is_dir(paths[0]))
+    {
+        compiled = ion_compile_file(paths[0]);
+    }
+    else if (buf_len(paths) == 1)
+    {
+        const char** dir_paths = dir_list_files(paths[0], "ion");
+        if (buf_len(dir_paths) == 0)
+        {
+            printf("No .ion files in %s\n", paths[0]);
+            return 1;
+        }
+        compiled = ion_compile_files(dir_paths, buf_len(dir_paths), ion_output_path(paths, 1));
+    }
+    else
+    {
+        const char* c_path = ion_output_path(paths, buf_len(paths));
+        compiled = c_path && ion_compile_files(paths, buf_len(paths), c_path);
+    }
+    if (!compiled)
     {
         printf("Compilation failed.\n");
         return 1;
     }
+    if (trace_path && !trace_write(trace_path))
+    {
+        printf("Failed to write trace file %s\n", trace_path);
+    }
+    if (show_stats)
+    {
+        print_stats();
+    }
+    if (run_enabled)
+    {
+        return run_exit_code;
+    }
     printf("Compilation succeeded.\n");
     return 0;
 }
\ No newline at end of file
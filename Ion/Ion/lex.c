@@ -18,14 +18,56 @@ const char* switch_keyword;
 const char* case_keyword;
 const char* default_keyword;
 
-const char* first_keyword;
-const char* last_keyword;
 const char** keywords;
 
 const char* foreign_name;
 
-#define KEYWORD(name) name##_keyword = str_intern(#name); buf_push(keywords, name##_keyword)
+// Keywords are found with a perfect hash on the first and last characters and the
+// length, so the lexer can classify an identifier before interning it. The hash was
+// chosen offline for the current keyword set; init_keywords asserts that it still has
+// no collisions.
+typedef struct Keyword {
+    const char* name;
+    size_t len;
+} Keyword;
+
+enum {
+    KEYWORD_TABLE_SIZE = 64
+};
+
+Keyword keyword_table[KEYWORD_TABLE_SIZE];
+
+size_t keyword_hash(const char* str, size_t len)
+{
+    return ((unsigned char)str[0] + 2 * (unsigned char)str[len - 1] + len) & (KEYWORD_TABLE_SIZE - 1);
+}
+
+void add_keyword(const char* name)
+{
+    size_t len = strlen(name);
+    Keyword* slot = &keyword_table[keyword_hash(name, len)];
+    assert(!slot->name);
+    *slot = (Keyword) { name, len };
+    buf_push(keywords, name);
+}
 
+const char* keyword_lookup(const char* str, size_t len)
+{
+    if (len == 0)
+    {
+        return NULL;
+    }
+    Keyword keyword = keyword_table[keyword_hash(str, len)];
+    if (keyword.len == len && memcmp(keyword.name, str, len) == 0)
+    {
+        return keyword.name;
+    }
+    return NULL;
+}
+
+#define KEYWORD(name) name##_keyword = str_intern(#name); add_keyword(name##_keyword)
+
+// Sets up the keyword table; must run before any threads start lexing.
 void init_keywords(void)
 {
 	static bool inited;
@@ -34,7 +76,6 @@ void init_keywords(void)
 		return;
 	}
 	KEYWORD(typedef);
-    char* arena_end = intern_arena.end;
 	KEYWORD(enum);
 	KEYWORD(struct);
 	KEYWORD(union);
@@ -53,9 +94,6 @@ void init_keywords(void)
 	KEYWORD(switch);
 	KEYWORD(case);
 	KEYWORD(default);
-	assert(intern_arena.end == arena_end);
-	first_keyword = typedef_keyword;
-	last_keyword = default_keyword;
 
     foreign_name = str_intern("foreign");
 
@@ -66,7 +104,7 @@ void init_keywords(void)
 
 bool is_keyword_name(const char* name)
 {
-	return first_keyword <= name && name <= last_keyword;
+	return keyword_lookup(name, strlen(name)) == name;
 }
 
 typedef enum TokenKind {
@@ -271,9 +309,10 @@ typedef struct Token
     };
 } Token;
 
-Token token;
-const char* stream;
-const char* line_start;
+// Lexer state is per thread so that files can be lexed and parsed in parallel.
+THREAD_LOCAL Token token;
+THREAD_LOCAL const char* stream;
+THREAD_LOCAL const char* line_start;
 
 void error(SrcPos pos, const char* fmt, ...)
 {
@@ -289,9 +328,9 @@ void error(SrcPos pos, const char* fmt, ...)
     va_end(args);
 }
 
-#define fatal_error(...) (error(__VA_ARGS__), exit(1))
+#define fatal_error(...) (error(__VA_ARGS__), fatal_exit())
 #define error_here(...) (error(token.pos, __VA_ARGS__))
-#define fatal_error_here(...) (error_here(__VA_ARGS__), exit(1))
+#define fatal_error_here(...) (error_here(__VA_ARGS__), fatal_exit())
 
 const char* token_info(void)
 {
@@ -324,6 +363,144 @@ uint8_t char_to_digit[256] = {
     ['f'] = 15,['F'] = 15,
 };
 
+enum {
+    CHAR_SPACE = 1 << 0,
+    CHAR_IDENT = 1 << 1,
+};
+
+static const uint8_t char_class[256] = {
+    [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE, ['\v'] = CHAR_SPACE,
+    ['\f'] = CHAR_SPACE, ['\r'] = CHAR_SPACE, ['0'] = CHAR_IDENT, ['1'] = CHAR_IDENT,
+    ['2'] = CHAR_IDENT, ['3'] = CHAR_IDENT, ['4'] = CHAR_IDENT, ['5'] = CHAR_IDENT,
+    ['6'] = CHAR_IDENT, ['7'] = CHAR_IDENT, ['8'] = CHAR_IDENT, ['9'] = CHAR_IDENT,
+    ['a'] = CHAR_IDENT, ['b'] = CHAR_IDENT, ['c'] = CHAR_IDENT, ['d'] = CHAR_IDENT,
+    ['e'] = CHAR_IDENT, ['f'] = CHAR_IDENT, ['g'] = CHAR_IDENT, ['h'] = CHAR_IDENT,
+    ['i'] = CHAR_IDENT, ['j'] = CHAR_IDENT, ['k'] = CHAR_IDENT, ['l'] = CHAR_IDENT,
+    ['m'] = CHAR_IDENT, ['n'] = CHAR_IDENT, ['o'] = CHAR_IDENT, ['p'] = CHAR_IDENT,
+    ['q'] = CHAR_IDENT, ['r'] = CHAR_IDENT, ['s'] = CHAR_IDENT, ['t'] = CHAR_IDENT,
+    ['u'] = CHAR_IDENT, ['v'] = CHAR_IDENT, ['w'] = CHAR_IDENT, ['x'] = CHAR_IDENT,
+    ['y'] = CHAR_IDENT, ['z'] = CHAR_IDENT, ['A'] = CHAR_IDENT, ['B'] = CHAR_IDENT,
+    ['C'] = CHAR_IDENT, ['D'] = CHAR_IDENT, ['E'] = CHAR_IDENT, ['F'] = CHAR_IDENT,
+    ['G'] = CHAR_IDENT, ['H'] = CHAR_IDENT, ['I'] = CHAR_IDENT, ['J'] = CHAR_IDENT,
+    ['K'] = CHAR_IDENT, ['L'] = CHAR_IDENT, ['M'] = CHAR_IDENT, ['N'] = CHAR_IDENT,
+    ['O'] = CHAR_IDENT, ['P'] = CHAR_IDENT, ['Q'] = CHAR_IDENT, ['R'] = CHAR_IDENT,
+    ['S'] = CHAR_IDENT, ['T'] = CHAR_IDENT, ['U'] = CHAR_IDENT, ['V'] = CHAR_IDENT,
+    ['W'] = CHAR_IDENT, ['X'] = CHAR_IDENT, ['Y'] = CHAR_IDENT, ['Z'] = CHAR_IDENT,
+    ['_'] = CHAR_IDENT,
+};
+
+// The SSE2 scanners classify aligned 16-byte blocks. An aligned block never crosses a
+// page boundary, so reading the rest of the block past the terminating NUL cannot fault.
+#if USE_SSE2
+uint32_t space_mask(__m128i chars)
+{
+    // isspace is ' ' plus the contiguous range '\t' through '\r'.
+    __m128i space = _mm_cmpeq_epi8(chars, _mm_set1_epi8(' '));
+    __m128i ctrl = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('\t' - 1)), _mm_cmplt_epi8(chars, _mm_set1_epi8('\r' + 1)));
+    return _mm_movemask_epi8(_mm_or_si128(space, ctrl));
+}
+
+uint32_t ident_mask(__m128i chars)
+{
+    // Bytes >= 0x80 compare as negative and so fall outside every range.
+    __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(chars, _mm_set1_epi8('9' + 1)));
+    __m128i under = _mm_cmpeq_epi8(chars, _mm_set1_epi8('_'));
+    return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), under));
+}
+#endif
+
+bool skip_space_char(void)
+{
+    if (!(char_class[(unsigned char)*stream] & CHAR_SPACE))
+    {
+        return false;
+    }
+    if (*stream++ == '\n')
+    {
+        line_start = stream;
+        token.pos.line++;
+    }
+    return true;
+}
+
+// Whitespace runs and identifiers are mostly short, so the first 16 bytes are always
+// scanned with the class table and only longer runs fall through to SSE2.
+void skip_space(void)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        if (!skip_space_char())
+        {
+            return;
+        }
+    }
+#if USE_SSE2
+    const char* block = ALIGN_DOWN_PTR(stream, 16);
+    uint32_t mask = 0xFFFF & (0xFFFF << (stream - block));
+    for (;;)
+    {
+        __m128i chars = _mm_load_si128((const __m128i*)block);
+        uint32_t stop = ~space_mask(chars) & mask;
+        uint32_t newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(chars, _mm_set1_epi8('\n'))) & mask;
+        if (stop)
+        {
+            newlines &= (stop & -stop) - 1;
+        }
+        for (; newlines; newlines &= newlines - 1)
+        {
+            line_start = block + count_trailing_zeros(newlines) + 1;
+            token.pos.line++;
+        }
+        if (stop)
+        {
+            stream = block + count_trailing_zeros(stop);
+            return;
+        }
+        block += 16;
+        mask = 0xFFFF;
+    }
+#else
+    while (skip_space_char())
+    {
+    }
+#endif
+}
+
+void skip_ident(void)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        if (!(char_class[(unsigned char)*stream] & CHAR_IDENT))
+        {
+            return;
+        }
+        stream++;
+    }
+#if USE_SSE2
+    const char* block = ALIGN_DOWN_PTR(stream, 16);
+    uint32_t mask = 0xFFFF & (0xFFFF << (stream - block));
+    for (;;)
+    {
+        __m128i chars = _mm_load_si128((const __m128i*)block);
+        uint32_t stop = ~ident_mask(chars) & mask;
+        if (stop)
+        {
+            stream = block + count_trailing_zeros(stop);
+            return;
+        }
+        block += 16;
+        mask = 0xFFFF;
+    }
+#else
+    while (char_class[(unsigned char)*stream] & CHAR_IDENT)
+    {
+        stream++;
+    }
+#endif
+}
+
 void scan_int(void)
 {
     int base = 10;
@@ -604,7 +781,7 @@ void scan_str(void)
 
 		
 
-void next_token(void)
+void scan_token(void)
 {
 repeat:
     token.start = stream;
@@ -613,14 +790,7 @@ repeat:
     switch (*stream)
     {
         case ' ': case '\n': case '\r': case '\t': case '\v': {
-			while (isspace(*stream))
-			{
-                if (*stream++ == '\n')
-                {
-                    line_start = stream;
-                    token.pos.line++;
-                }
-			}
+			skip_space();
 			goto repeat;
         } break;
 
@@ -670,10 +840,17 @@ repeat:
         case 'K': case 'L': case 'M': case 'N': case 'O': case 'P': case 'Q': case 'R': case 'S': case 'T':
         case 'U': case 'V': case 'W': case 'X': case 'Y': case 'Z':
         case '_': {
-            while (isalnum(*stream) || *stream == '_')
-                stream++;
-            token.name = str_intern_range(token.start, stream);
-			token.kind = is_keyword_name(token.name) ? TOKEN_KEYWORD : TOKEN_NAME;
+            skip_ident();
+            token.name = keyword_lookup(token.start, stream - token.start);
+            if (token.name)
+            {
+                token.kind = TOKEN_KEYWORD;
+            }
+            else
+            {
+                token.name = str_intern_range(token.start, stream);
+                token.kind = TOKEN_NAME;
+            }
         } break;
         case '<': {
             token.kind = TOKEN_LT;
@@ -756,14 +933,65 @@ repeat:
         } break;
     }
     token.end = stream;
+    stats.num_tokens++;
 }
 
 #undef CASE1
 #undef CASE2
 #undef CASE3
 
+// A whole file can be tokenized up front into parallel arrays, after which next_token
+// just loads the next entry into the global token. Only names and literals have an
+// entry in vals, which holds the raw bits of the token's value union. Token ends are
+// not kept since only the lexer itself needs them.
+typedef struct TokenArray {
+    const char* name;
+    const char* buf;
+    uint8_t* kinds;
+    uint8_t* flags;
+    uint32_t* starts;
+    uint32_t* lines;
+    uint32_t* val_indices;
+    size_t num_tokens;
+    size_t cap;
+    unsigned long long* vals;
+} TokenArray;
+
+THREAD_LOCAL TokenArray* token_array;
+THREAD_LOCAL size_t token_index;
+
+void load_token(void)
+{
+    TokenArray* array = token_array;
+    size_t i = token_index;
+    token.kind = array->kinds[i];
+    token.mod = array->flags[i] & 0xF;
+    token.suffix = array->flags[i] >> 4;
+    token.pos.line = array->lines[i];
+    token.start = array->buf + array->starts[i];
+    token.end = NULL;
+    token.int_val = array->vals[array->val_indices[i]];
+}
+
+void next_token(void)
+{
+    if (token_array)
+    {
+        if (token_index + 1 < token_array->num_tokens)
+        {
+            token_index++;
+        }
+        load_token();
+    }
+    else
+    {
+        scan_token();
+    }
+}
+
 void init_stream(const char* name, const char* buf)
 {
+    token_array = NULL;
     stream = buf;
     line_start = stream;
     token.pos.name = name ? name : "<stream>";
@@ -771,6 +999,75 @@ void init_stream(const char* name, const char* buf)
     next_token();
 }
 
+void token_array_grow(TokenArray* array, size_t new_cap)
+{
+    array->kinds = xrealloc(array->kinds, new_cap * sizeof(*array->kinds));
+    array->flags = xrealloc(array->flags, new_cap * sizeof(*array->flags));
+    array->starts = xrealloc(array->starts, new_cap * sizeof(*array->starts));
+    array->lines = xrealloc(array->lines, new_cap * sizeof(*array->lines));
+    array->val_indices = xrealloc(array->val_indices, new_cap * sizeof(*array->val_indices));
+    array->cap = new_cap;
+}
+
+void tokenize(TokenArray* array, const char* name, const char* buf)
+{
+    assert(NUM_TOKEN_KINDS <= UINT8_MAX && MOD_MULTILINE < 16 && SUFFIX_ULL < 16);
+    *array = (TokenArray) { .name = name ? name : "<stream>", .buf = buf };
+    // Sources average a little over three bytes per token.
+    token_array_grow(array, MAX(strlen(buf) / 3, 1024));
+    // Entry 0 is the value of tokens without one.
+    buf_push(array->vals, 0);
+    init_stream(name, buf);
+    for (;;)
+    {
+        assert(token.end - buf <= UINT32_MAX);
+        if (array->num_tokens == array->cap)
+        {
+            token_array_grow(array, 2 * array->cap);
+        }
+        size_t i = array->num_tokens++;
+        uint32_t val_index = 0;
+        if (token.kind == TOKEN_NAME || token.kind == TOKEN_KEYWORD || token.kind == TOKEN_INT ||
+            token.kind == TOKEN_FLOAT || token.kind == TOKEN_STR)
+        {
+            val_index = (uint32_t)buf_len(array->vals);
+            buf_push(array->vals, token.int_val);
+        }
+        array->kinds[i] = (uint8_t)token.kind;
+        array->flags[i] = (uint8_t)(token.mod | token.suffix << 4);
+        array->starts[i] = (uint32_t)(token.start - buf);
+        array->lines[i] = (uint32_t)token.pos.line;
+        array->val_indices[i] = val_index;
+        if (token.kind == TOKEN_EOF)
+        {
+            break;
+        }
+        next_token();
+    }
+}
+
+void init_token_array(TokenArray* array)
+{
+    token_array = array;
+    token_index = 0;
+    token.pos.name = array->name;
+    load_token();
+}
+
+void token_array_free(TokenArray* array)
+{
+    if (token_array == array)
+    {
+        token_array = NULL;
+    }
+    free(array->kinds);
+    free(array->flags);
+    free(array->starts);
+    free(array->lines);
+    free(array->val_indices);
+    buf_free(array->vals);
+}
+
 inline bool is_token(TokenKind kind)
 {
     return token.kind == kind;
@@ -1,4 +1,10 @@
 #define _CRT_SECURE_NO_WARNINGS
+#ifndef _WIN32
+// Declares the POSIX and BSD extensions used below (lstat, S_ISSOCK, MAP_ANONYMOUS,
+// clock_gettime, st_mtim) under a strict -std=c11 as well as gnu11.
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -11,17 +17,72 @@
 #include <stdarg.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <setjmp.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#endif
+
+// SSE2 scanning of long identifier and whitespace runs in the lexer. It reads whole
+// aligned blocks past the end of the source, which AddressSanitizer would report.
+#ifndef USE_SSE2
+#if (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)) && !defined(__SANITIZE_ADDRESS__)
+#define USE_SSE2 1
+#else
+#define USE_SSE2 0
+#endif
+#endif
+
+#if USE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Computed-goto dispatch in the bytecode interpreter, where the compiler supports it.
+#ifndef USE_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define USE_COMPUTED_GOTO 1
+#else
+#define USE_COMPUTED_GOTO 0
+#endif
+#endif
 
 #include "common.c"
+#include "trace.c"
 #include "lex.c"
 #include "type.c"
 #include "ast.h"
 #include "ast.c"
 #include "print.c"
 #include "parse.c"
+#include "serialize.c"
 #include "resolve.c"
+#include "cache.c"
 #include "gen.c"
+#include "vm.c"
+#include "bench.c"
 #include "ion.c"
+#include "watch.c"
 #include "test.c"
 
 int main(int ArgCount, char** Args)
@@ -4,6 +4,44 @@ Typespec* parse_type(void);
 Stmt* parse_stmt(void);
 Expr* parse_expr(void);
 
+// Lists are collected on one shared scratch stack rather than a heap buffer per list.
+// An item is fully parsed, nested lists included, before it is pushed, so the list
+// being built is always on top. The AST constructors copy the items into ast_arena
+// and the list is then popped.
+typedef struct ParseList {
+    size_t start;
+    size_t len;
+    size_t item_size;
+} ParseList;
+
+THREAD_LOCAL char* parse_list_stack;
+
+ParseList parse_list_begin(size_t item_size)
+{
+    return (ParseList) { buf_len(parse_list_stack), 0, item_size };
+}
+
+void parse_list_push(ParseList* list, const void* item)
+{
+    assert(buf_len(parse_list_stack) == list->start + list->len * list->item_size);
+    buf_append(parse_list_stack, (const char*)item, list->item_size);
+    list->len++;
+}
+
+void* parse_list_items(ParseList* list)
+{
+    return list->len ? parse_list_stack + list->start : NULL;
+}
+
+void parse_list_end(ParseList* list)
+{
+    assert(buf_len(parse_list_stack) == list->start + list->len * list->item_size);
+    if (list->len)
+    {
+        buf__hdr(parse_list_stack)->len = list->start;
+    }
+}
+
 Typespec* parse_type_func_param(void)
 {
     Typespec* type = parse_type();
@@ -21,12 +59,13 @@ Typespec* parse_type_func_param(void)
 Typespec* parse_type_func(void)
 {
    SrcPos pos = token.pos;
-	Typespec** args = NULL;
+	ParseList args = parse_list_begin(sizeof(Typespec*));
 	bool has_varargs = false;
 	expect_token(TOKEN_LPAREN);
 	if (!is_token(TOKEN_RPAREN))
 	{
-		buf_push(args, parse_type_func_param());
+		Typespec* arg = parse_type_func_param();
+		parse_list_push(&args, &arg);
 		while (match_token(TOKEN_COMMA))
 		{
 			if (match_token(TOKEN_ELLIPSIS))
@@ -43,7 +82,8 @@ Typespec* parse_type_func(void)
 				{
 					error_here("Ellipsis must be last parameter in function type");
 				}
-				buf_push(args, parse_type_func_param());
+				Typespec* arg = parse_type_func_param();
+				parse_list_push(&args, &arg);
 			}
 		}
 	}
@@ -53,7 +93,9 @@ Typespec* parse_type_func(void)
 	{
 		ret = parse_type();
 	}
-	return typespec_func(pos, args, buf_len(args), ret, has_varargs);
+	Typespec* type = typespec_func(pos, parse_list_items(&args), args.len, ret, has_varargs);
+	parse_list_end(&args);
+	return type;
 }
 
 Typespec* parse_type_base(void)
@@ -142,17 +184,20 @@ Expr* parse_expr_compound(Typespec* type)
 {
     SrcPos pos = token.pos;
 	expect_token(TOKEN_LBRACE);
-    CompoundField* fields = NULL;
+    ParseList fields = parse_list_begin(sizeof(CompoundField));
 	while (!is_token(TOKEN_RBRACE))
 	{
-		buf_push(fields, parse_expr_compound_field());
+		CompoundField field = parse_expr_compound_field();
+		parse_list_push(&fields, &field);
 		if (!match_token(TOKEN_COMMA))
 		{
             break;
 		}
 	}
 	expect_token(TOKEN_RBRACE);
-	return expr_compound(pos, type, fields, buf_len(fields));
+	Expr* expr = expr_compound(pos, type, parse_list_items(&fields), fields.len);
+	parse_list_end(&fields);
+	return expr;
 }
 
 Expr* parse_expr_unary(void);
@@ -253,17 +298,20 @@ Expr* parse_expr_base(void)
         SrcPos pos = token.pos;
 		if (match_token(TOKEN_LPAREN))
 		{
-			Expr** args = NULL;
+			ParseList args = parse_list_begin(sizeof(Expr*));
 			if (!is_token(TOKEN_RPAREN))
 			{
-				buf_push(args, parse_expr());
+				Expr* arg = parse_expr();
+				parse_list_push(&args, &arg);
 				while (match_token(TOKEN_COMMA))
 				{
-					buf_push(args, parse_expr());
+					arg = parse_expr();
+					parse_list_push(&args, &arg);
 				}
 			}
 			expect_token(TOKEN_RPAREN);
-			expr = expr_call(pos, expr, args, buf_len(args));
+			expr = expr_call(pos, expr, parse_list_items(&args), args.len);
+			parse_list_end(&args);
 		}
 		else if (match_token(TOKEN_LBRACKET))
 		{
@@ -415,13 +463,16 @@ StmtList parse_stmt_block(void)
 {
     SrcPos pos = token.pos;
 	expect_token(TOKEN_LBRACE);
-	Stmt** stmts = NULL;
+	ParseList stmts = parse_list_begin(sizeof(Stmt*));
 	while (!is_token_eof() && !is_token(TOKEN_RBRACE))
 	{
-		buf_push(stmts, parse_stmt());
+		Stmt* stmt = parse_stmt();
+		parse_list_push(&stmts, &stmt);
 	}
 	expect_token(TOKEN_RBRACE);
-	return stmt_list(pos, stmts, buf_len(stmts));
+	StmtList block = stmt_list(pos, parse_list_items(&stmts), stmts.len);
+	parse_list_end(&stmts);
+	return block;
 }
 
 Stmt* parse_stmt_if(SrcPos pos)
@@ -429,7 +480,7 @@ Stmt* parse_stmt_if(SrcPos pos)
 	Expr* cond = parse_paren_expr();
     StmtList then_block = parse_stmt_block();
     StmtList else_block = { 0 };
-	ElseIf* elseifs = NULL;
+	ParseList elseifs = parse_list_begin(sizeof(ElseIf));
 	while (match_keyword(else_keyword))
 	{
 		if (!match_keyword(if_keyword))
@@ -439,9 +490,12 @@ Stmt* parse_stmt_if(SrcPos pos)
 		}
 		Expr* elseif_cond = parse_paren_expr();
         StmtList elseif_block = parse_stmt_block();
-		buf_push(elseifs, (ElseIf) { elseif_cond, elseif_block });
+		ElseIf elseif = { elseif_cond, elseif_block };
+		parse_list_push(&elseifs, &elseif);
 	}
-	return stmt_if(pos, cond, then_block, elseifs, buf_len(elseifs), else_block);
+	Stmt* stmt = stmt_if(pos, cond, then_block, parse_list_items(&elseifs), elseifs.len, else_block);
+	parse_list_end(&elseifs);
+	return stmt;
 }
 
 Stmt* parse_stmt_while(SrcPos pos)
@@ -548,16 +602,18 @@ Stmt* parse_stmt_for(SrcPos pos)
 
 SwitchCase parse_stmt_switch_case(void)
 {
-	Expr** exprs = NULL;
+	ParseList exprs = parse_list_begin(sizeof(Expr*));
 	bool is_default = false;
 	while (is_keyword(case_keyword) || is_keyword(default_keyword))
 	{
 		if (match_keyword(case_keyword))
 		{
-			buf_push(exprs, parse_expr());
+			Expr* expr = parse_expr();
+			parse_list_push(&exprs, &expr);
             while (match_token(TOKEN_COMMA))
             {
-                buf_push(exprs, parse_expr());
+                expr = parse_expr();
+                parse_list_push(&exprs, &expr);
             }
 		}
 		else 
@@ -573,25 +629,33 @@ SwitchCase parse_stmt_switch_case(void)
 		expect_token(TOKEN_COLON);
 	}
     SrcPos pos = token.pos;
-	Stmt** stmts = NULL;
+	ParseList stmts = parse_list_begin(sizeof(Stmt*));
 	while (!is_token_eof() && !is_token(TOKEN_RBRACE) && !is_keyword(case_keyword) && !is_keyword(default_keyword))
 	{
-		buf_push(stmts, parse_stmt());
+		Stmt* stmt = parse_stmt();
+		parse_list_push(&stmts, &stmt);
 	}
-	return (SwitchCase) { exprs, buf_len(exprs), is_default, stmt_list(pos, stmts, buf_len(stmts)) };
+	StmtList block = stmt_list(pos, parse_list_items(&stmts), stmts.len);
+	parse_list_end(&stmts);
+	Expr** case_exprs = ast_dup(parse_list_items(&exprs), exprs.len * sizeof(Expr*));
+	parse_list_end(&exprs);
+	return (SwitchCase) { case_exprs, exprs.len, is_default, block };
 }
 
 Stmt* parse_stmt_switch(SrcPos pos)
 {
 	Expr* expr = parse_paren_expr();
-	SwitchCase* cases = NULL;
+	ParseList cases = parse_list_begin(sizeof(SwitchCase));
 	expect_token(TOKEN_LBRACE);
 	while (!is_token_eof() && !is_token(TOKEN_RBRACE))
 	{
-		buf_push(cases, parse_stmt_switch_case());
+		SwitchCase switch_case = parse_stmt_switch_case();
+		parse_list_push(&cases, &switch_case);
 	}
 	expect_token(TOKEN_RBRACE);
-	return stmt_switch(pos, expr, cases, buf_len(cases));
+	Stmt* stmt = stmt_switch(pos, expr, parse_list_items(&cases), cases.len);
+	parse_list_end(&cases);
+	return stmt;
 }
 
 Stmt* parse_stmt(void)
@@ -672,32 +736,39 @@ Decl* parse_decl_enum(SrcPos pos)
 {
 	const char* name = parse_name();
 	expect_token(TOKEN_LBRACE);
-	EnumItem* items = NULL;
+	ParseList items = parse_list_begin(sizeof(EnumItem));
 	while (!is_token(TOKEN_RBRACE))
 	{
-		buf_push(items, parse_decl_enum_item());
+		EnumItem item = parse_decl_enum_item();
+		parse_list_push(&items, &item);
 		if (!match_token(TOKEN_COMMA))
 		{
             break;
 		}		
 	}
 	expect_token(TOKEN_RBRACE);
-	return decl_enum(pos, name, items, buf_len(items));
+	Decl* decl = decl_enum(pos, name, parse_list_items(&items), items.len);
+	parse_list_end(&items);
+	return decl;
 }
 
 AggregateItem parse_decl_aggregate_item(void)
 {
     SrcPos pos = token.pos;
-	const char** names = NULL;
-	buf_push(names, parse_name());
+	ParseList names = parse_list_begin(sizeof(const char*));
+	const char* name = parse_name();
+	parse_list_push(&names, &name);
 	while (match_token(TOKEN_COMMA))
 	{
-		buf_push(names, parse_name());
+		name = parse_name();
+		parse_list_push(&names, &name);
 	}
 	expect_token(TOKEN_COLON);
 	Typespec* type = parse_type();
 	expect_token(TOKEN_SEMICOLON);
-	return (AggregateItem) { pos, names, buf_len(names), type };
+	const char** item_names = ast_dup(parse_list_items(&names), names.len * sizeof(const char*));
+	parse_list_end(&names);
+	return (AggregateItem) { pos, item_names, names.len, type };
 }
 
 Decl* parse_decl_aggregate(SrcPos pos, DeclKind kind)
@@ -705,13 +776,16 @@ Decl* parse_decl_aggregate(SrcPos pos, DeclKind kind)
 	assert(kind == DECL_STRUCT || kind == DECL_UNION);
 	const char* name = parse_name();
 	expect_token(TOKEN_LBRACE);
-	AggregateItem* items = NULL;
+	ParseList items = parse_list_begin(sizeof(AggregateItem));
 	while (!is_token_eof() && !is_token(TOKEN_RBRACE))
 	{
-		buf_push(items, parse_decl_aggregate_item());
+		AggregateItem item = parse_decl_aggregate_item();
+		parse_list_push(&items, &item);
 	}
 	expect_token(TOKEN_RBRACE);
-	return decl_aggregate(pos, kind, name, items, buf_len(items));
+	Decl* decl = decl_aggregate(pos, kind, name, parse_list_items(&items), items.len);
+	parse_list_end(&items);
+	return decl;
 }
 
 Decl* parse_decl_var(SrcPos pos)
@@ -770,13 +844,15 @@ FuncParam parse_decl_func_param(void)
 
 Decl* parse_decl_func(SrcPos pos)
 {
+    const char* start = token.start;
 	const char* name = parse_name();
 	expect_token(TOKEN_LPAREN);
-	FuncParam* params = NULL;
+	ParseList params = parse_list_begin(sizeof(FuncParam));
 	bool has_varargs = false;
 	if (!is_token(TOKEN_RPAREN))
 	{
-		buf_push(params, parse_decl_func_param());
+		FuncParam param = parse_decl_func_param();
+		parse_list_push(&params, &param);
 		while (match_token(TOKEN_COMMA))
 		{
 			if (match_token(TOKEN_ELLIPSIS))
@@ -793,7 +869,8 @@ Decl* parse_decl_func(SrcPos pos)
 				{
 					error_here("Ellipsis must be last parameter in function declaration");
 				}
-				buf_push(params, parse_decl_func_param());
+				FuncParam param = parse_decl_func_param();
+				parse_list_push(&params, &param);
 			}
 		}
 	}
@@ -803,18 +880,26 @@ Decl* parse_decl_func(SrcPos pos)
 	{
 		ret_type = parse_type();
 	}
+    const char* body_start = token.start;
 	StmtList block = parse_stmt_block();
-	return decl_func(pos, name, params, buf_len(params), ret_type, has_varargs, block);
+	Decl* decl = decl_func(pos, name, parse_list_items(&params), params.len, ret_type, has_varargs, block);
+	parse_list_end(&params);
+    decl->hash = hash_bytes(start, body_start - start);
+    decl->func.body_hash = hash_bytes(body_start, token.start - body_start);
+	return decl;
 }
 
 NoteList parse_note_list(void)
 {
-	Note* notes = NULL;
+	ParseList notes = parse_list_begin(sizeof(Note));
 	while (match_token(TOKEN_AT))
 	{
-		buf_push(notes, (Note){.pos = token.pos, .name = parse_name()});
+		Note note = { .pos = token.pos, .name = parse_name() };
+		parse_list_push(&notes, &note);
 	}
-	return note_list(notes, buf_len(notes));
+	NoteList list = note_list(parse_list_items(&notes), notes.len);
+	parse_list_end(&notes);
+	return list;
 }
 
 Decl* parse_decl_opt(void)
@@ -857,23 +942,30 @@ Decl* parse_decl_opt(void)
 Decl* parse_decl(void)
 {
     NoteList notes = parse_note_list();
+    const char* start = token.start;
     Decl* decl = parse_decl_opt();
     if (!decl)
     {
         fatal_error_here("Expected declaraion keyword, got %s", token_info());
     }
+    if (decl->kind != DECL_FUNC)
+    {
+        decl->hash = hash_bytes(start, token.start - start);
+    }
     decl->notes = notes;
     return decl;
 }
 
 DeclSet* parse_file(void)
 {
-    Decl** decls = NULL;
+    ParseList decls = parse_list_begin(sizeof(Decl*));
     while (!is_token(TOKEN_EOF))
     {
         Decl* decl = parse_decl();
         assert(decl);
-        buf_push(decls, decl);
+        parse_list_push(&decls, &decl);
     }
-    return decl_set(decls, buf_len(decls));
+    DeclSet* declset = decl_set(parse_list_items(&decls), decls.len);
+    parse_list_end(&decls);
+    return declset;
 }
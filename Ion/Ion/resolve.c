@@ -20,21 +20,66 @@ typedef struct Sym {
     Decl* decl;
     Type* type;
     Val val;
+    // Only filled in while the compilation cache is enabled: the global syms the
+    // declaration refers to, those its function body refers to, the hash of the
+    // declaration together with everything it depends on, the sym's place in the order
+    // the hashes were computed in, and the function's cached definition. A compile-time
+    // evaluated declaration also has eval_hash, which covers the bodies of the functions
+    // its initializer may call, since the declaration's own hash covers only signatures.
+    struct Sym** deps;
+    struct Sym** body_deps;
+    uint64_t eval_hash;
+    uint64_t hash;
+    size_t hash_index;
+    struct CachedFunc* cached;
+    // Set once the function's body is resolved, which can happen early when it is called
+    // at compile time.
+    bool body_resolved;
+    // The value of a const or global var whose initializer calls a function, computed
+    // at compile time by the interpreter and emitted in place of the initializer.
+    void* init_val;
 } Sym;
 
+// Local symbols live in hash buckets keyed on the interned name. Each bucket chain runs
+// from the innermost declaration outwards, and a separate push-order chain lets
+// sym_leave unlink everything declared since sym_enter, which is always at the head of
+// its bucket.
+typedef struct LocalSym {
+    Sym sym;
+    struct LocalSym* next;
+    struct LocalSym* prev;
+} LocalSym;
+
+typedef struct SymScope {
+    LocalSym* top;
+    ArenaMark mark;
+} SymScope;
+
 enum {
-    MAX_LOCAL_SYMS = 1024
+    LOCAL_SYM_BUCKETS = 1024
 };
 
 Sym** sorted_syms;
 Map global_syms_map;
 Sym** global_syms_buf;
-Sym local_syms[MAX_LOCAL_SYMS];
-Sym* local_syms_end = local_syms;
+// Global syms are only created on the main thread. Those after the builtins are freed
+// together by reset_global_syms.
+Arena sym_arena;
+ArenaMark builtin_syms_mark;
+size_t num_builtin_syms;
+THREAD_LOCAL LocalSym* local_sym_buckets[LOCAL_SYM_BUCKETS];
+THREAD_LOCAL LocalSym* local_syms_top;
+THREAD_LOCAL Arena local_sym_arena;
+
+// Global syms named while resolving, collected while the cache is enabled. Each
+// declaration or body takes the entries pushed since its resolve_deps_mark.
+bool resolve_deps_enabled;
+THREAD_LOCAL Sym** resolve_deps;
 
 Sym* sym_new(SymKind kind, const char* name, Decl* decl)
 {
-    Sym* sym = xcalloc(1, sizeof(Sym));
+    Sym* sym = arena_alloc(&sym_arena, sizeof(Sym));
+    memset(sym, 0, sizeof(Sym));
     sym->kind = kind;
     sym->name = name;
     sym->decl = decl;
@@ -74,14 +119,18 @@ Sym* sym_decl(Decl* decl)
     return sym;
 }
 
+size_t local_sym_bucket(const char* name)
+{
+    return (size_t)hash_ptr((void*)name) & (LOCAL_SYM_BUCKETS - 1);
+}
+
 Sym* sym_get_local(const char* name)
 {
-    for (Sym* it = local_syms_end; it != local_syms; it--)
+    for (LocalSym* it = local_sym_buckets[local_sym_bucket(name)]; it; it = it->next)
     {
-        Sym* sym = it - 1;
-        if (sym->name == name)
+        if (it->sym.name == name)
         {
-            return sym;
+            return &it->sym;
         }
     }
     return NULL;
@@ -99,27 +148,72 @@ bool sym_push_var(const char* name, Type* type)
     {
         return false;
     }
-    if (local_syms_end == local_syms + MAX_LOCAL_SYMS)
-    {
-        fatal("Too many local symbols");
-    }
-    *local_syms_end++ = (Sym) {
-        .name = name,
-        .kind = SYM_VAR,
-        .state = SYM_RESOLVED,
-        .type = type
+    size_t bucket = local_sym_bucket(name);
+    LocalSym* local = arena_alloc(&local_sym_arena, sizeof(LocalSym));
+    *local = (LocalSym) {
+        .sym = {
+            .name = name,
+            .kind = SYM_VAR,
+            .state = SYM_RESOLVED,
+            .type = type
+        },
+        .next = local_sym_buckets[bucket],
+        .prev = local_syms_top,
     };
+    local_sym_buckets[bucket] = local;
+    local_syms_top = local;
     return true;
 }
 
-Sym* sym_enter(void)
+SymScope sym_enter(void)
+{
+    return (SymScope) { local_syms_top, arena_mark(&local_sym_arena) };
+}
+
+void sym_leave(SymScope scope)
 {
-    return local_syms_end;
+    while (local_syms_top != scope.top)
+    {
+        LocalSym* local = local_syms_top;
+        size_t bucket = local_sym_bucket(local->sym.name);
+        assert(local_sym_buckets[bucket] == local);
+        local_sym_buckets[bucket] = local->next;
+        local_syms_top = local->prev;
+    }
+    arena_reset(&local_sym_arena, scope.mark);
+}
+
+size_t resolve_deps_mark(void)
+{
+    return buf_len(resolve_deps);
 }
 
-void sym_leave(Sym* sym)
+int compare_sym_ptrs(const void* a, const void* b)
 {
-    local_syms_end = sym;
+    uintptr_t x = (uintptr_t)*(Sym**)a;
+    uintptr_t y = (uintptr_t)*(Sym**)b;
+    return x < y ? -1 : x > y;
+}
+
+// Pops the syms pushed since mark into a new buffer, without duplicates.
+Sym** resolve_deps_pop(size_t mark)
+{
+    if (!resolve_deps_enabled)
+    {
+        return NULL;
+    }
+    size_t num_deps = buf_len(resolve_deps) - mark;
+    qsort(resolve_deps + mark, num_deps, sizeof(Sym*), compare_sym_ptrs);
+    Sym** deps = NULL;
+    for (size_t i = mark; i < buf_len(resolve_deps); i++)
+    {
+        if (i == mark || resolve_deps[i] != resolve_deps[i - 1])
+        {
+            buf_push(deps, resolve_deps[i]);
+        }
+    }
+    buf__hdr(resolve_deps)->len = mark;
+    return deps;
 }
 
 void sym_global_put(Sym* sym)
@@ -149,13 +243,14 @@ void sym_global_typedef(const char* name, Type* type)
     sym_global_put(sym);
 }
 
-void sym_global_const(const char* name, Type* type, Val val)
+Sym* sym_global_const(const char* name, Type* type, Val val)
 {
     Sym* sym = sym_new(SYM_CONST, str_intern(name), NULL);
     sym->state = SYM_RESOLVED;
     sym->type = type;
     sym->val = val;
     sym_global_put(sym);
+    return sym;
 }
 
 void sym_global_func(const char* name, Type* type)
@@ -184,7 +279,12 @@ Sym* sym_global_decl(Decl* decl)
             {
                 fatal_error(item.pos, "Explicit enum constant initializers are not currently supported");
             }
-            sym_global_const(item.name, sym->type, (Val) { .i = i });
+            Sym* item_sym = sym_global_const(item.name, sym->type, (Val) { .i = i });
+            if (resolve_deps_enabled)
+            {
+                // The constant's value is its position in the enum.
+                buf_push(item_sym->deps, sym);
+            }
         }
     }
     return sym;
@@ -584,15 +684,17 @@ Type* resolve_typespec(Typespec* typespec)
             result = type_array(resolve_typespec(typespec->base), size);
         } break;
         case TYPESPEC_FUNC: {
-            Type** args = NULL;
-            for (size_t i = 0; i < typespec->func.num_args; i++)
+            ArenaMark mark = arena_mark(&scratch_arena);
+            size_t num_args = typespec->func.num_args;
+            Type** args = arena_alloc(&scratch_arena, num_args * sizeof(*args));
+            for (size_t i = 0; i < num_args; i++)
             {
                 Type* arg = resolve_typespec(typespec->func.args[i]);
                 if (arg == type_void)
                 {
                     fatal_error(typespec->pos, "Function parameter type cannot be void");
                 }
-                buf_push(args, arg);
+                args[i] = arg;
             }
             Type* ret = type_void;
             if (typespec->func.ret)
@@ -603,7 +705,8 @@ Type* resolve_typespec(Typespec* typespec)
             {
                 fatal_error(typespec->pos, "Function return type cannot be array");
             }
-            result = type_func(args, buf_len(args), ret, false);
+            result = type_func(args, num_args, ret, false);
+            arena_reset(&scratch_arena, mark);
         } break;
         default:
             assert(0);
@@ -628,8 +731,16 @@ void complete_type(Type* type)
 
     Decl* decl = type->sym->decl;
     type->kind = TYPE_COMPLETING;
+    size_t deps_mark = resolve_deps_mark();
     assert(decl->kind == DECL_STRUCT || decl->kind == DECL_UNION);
-    TypeField* fields = NULL;
+    size_t num_fields = 0;
+    for (size_t i = 0; i < decl->aggregate.num_items; i++)
+    {
+        num_fields += decl->aggregate.items[i].num_names;
+    }
+    ArenaMark mark = arena_mark(&scratch_arena);
+    TypeField* fields = arena_alloc(&scratch_arena, num_fields * sizeof(*fields));
+    size_t field_index = 0;
     for (size_t i = 0; i < decl->aggregate.num_items; i++)
     {
         AggregateItem item = decl->aggregate.items[i];
@@ -637,26 +748,28 @@ void complete_type(Type* type)
         complete_type(item_type);
         for (size_t j = 0; j < item.num_names; j++)
         {
-            buf_push(fields, (TypeField) { item.names[j], item_type });
+            fields[field_index++] = (TypeField) { item.names[j], item_type };
         }
     }
-    if (buf_len(fields) == 0)
+    if (num_fields == 0)
     {
         fatal_error(decl->pos, "No fields");
     }
-    if (has_duplicate_fields(fields, buf_len(fields)))
+    if (has_duplicate_fields(fields, num_fields))
     {
         fatal_error(decl->pos, "Duplicate fields");
     }
     if (decl->kind == DECL_STRUCT)
     {
-        type_complete_struct(type, fields, buf_len(fields));
+        type_complete_struct(type, fields, num_fields);
     }
     else
     {
         assert(decl->kind == DECL_UNION);
-        type_complete_union(type, fields, buf_len(fields));
+        type_complete_union(type, fields, num_fields);
     }
+    arena_reset(&scratch_arena, mark);
+    type->sym->deps = resolve_deps_pop(deps_mark);
     buf_push(sorted_syms, type->sym);
 }
 
@@ -701,10 +814,14 @@ Type* resolve_decl_var(Decl* decl)
     return type;
 }
 
+bool expr_has_call(Expr* expr);
+
+// A const whose expression calls a function gets its value from resolve_eval_sym.
 Type* resolve_decl_const(Decl* decl, Val* val)
 {
     assert(decl->kind == DECL_CONST);
-    Operand result = resolve_const_expr(decl->const_decl.expr);
+    Expr* expr = decl->const_decl.expr;
+    Operand result = expr_has_call(expr) ? resolve_expr_rvalue(expr) : resolve_const_expr(expr);
     if (!is_arithmetic_type(result.type))
     {
         fatal_error(decl->pos, "Const declarations must have arithmetic type");
@@ -716,8 +833,10 @@ Type* resolve_decl_const(Decl* decl, Val* val)
 Type* resolve_decl_func(Decl* decl)
 {
     assert(decl->kind == DECL_FUNC);
-    Type** params = NULL;
-    for (size_t i = 0; i < decl->func.num_params; i++)
+    ArenaMark mark = arena_mark(&scratch_arena);
+    size_t num_params = decl->func.num_params;
+    Type** params = arena_alloc(&scratch_arena, num_params * sizeof(*params));
+    for (size_t i = 0; i < num_params; i++)
     {
         Type* param = resolve_typespec(decl->func.params[i].type);
         complete_type(param);
@@ -725,7 +844,7 @@ Type* resolve_decl_func(Decl* decl)
         {
             fatal_error(decl->pos, "Function parameter type cannot be void");
         }
-        buf_push(params, param);
+        params[i] = param;
     }
     Type* ret_type = type_void;
     if (decl->func.ret_type)
@@ -737,7 +856,9 @@ Type* resolve_decl_func(Decl* decl)
     {
         fatal_error(decl->pos, "Function return type cannot be array");
     }
-    return type_func(params, buf_len(params), ret_type, decl->func.has_varargs);
+    Type* type = type_func(params, num_params, ret_type, decl->func.has_varargs);
+    arena_reset(&scratch_arena, mark);
+    return type;
 }
 
 bool resolve_stmt(Stmt* stmt, Type* ret_type);
@@ -753,7 +874,7 @@ void resolve_cond_expr(Expr* expr)
 
 bool resolve_stmt_block(StmtList block, Type* ret_type)
 {
-    Sym* scope = sym_enter();
+    SymScope scope = sym_enter();
     bool returns = false;
     for (size_t i = 0; i < block.num_stmts; i++)
     {
@@ -909,7 +1030,7 @@ bool resolve_stmt(Stmt* stmt, Type* ret_type)
             resolve_stmt_block(stmt->while_stmt.block, ret_type);
             return false;
         case STMT_FOR: {
-            Sym* scope = sym_enter();
+            SymScope scope = sym_enter();
             resolve_stmt(stmt->for_stmt.init, ret_type);
             resolve_cond_expr(stmt->for_stmt.cond);
             resolve_stmt_block(stmt->for_stmt.block, ret_type);
@@ -932,8 +1053,8 @@ bool resolve_stmt(Stmt* stmt, Type* ret_type)
                     {
                         fatal_error(case_expr->pos, "Invalid type in switch case expression");
                     }
-                    returns = resolve_stmt_block(switch_case.block, ret_type) && returns;
                 }
+                returns = resolve_stmt_block(switch_case.block, ret_type) && returns;
                 if (switch_case.is_default)
                 {
                     if (has_default)
@@ -965,7 +1086,10 @@ void resolve_func_body(Sym* sym)
     Decl* decl = sym->decl;
     assert(decl->kind == DECL_FUNC);
     assert(sym->state == SYM_RESOLVED);
-    Sym* scope = sym_enter();
+    TRACE_BEGIN("resolve_func_body", sym->name);
+    sym->body_resolved = true;
+    size_t deps_mark = resolve_deps_mark();
+    SymScope scope = sym_enter();
     for (size_t i = 0; i < decl->func.num_params; i++)
     {
         FuncParam param = decl->func.params[i];
@@ -980,10 +1104,89 @@ void resolve_func_body(Sym* sym)
     assert(!is_array_type(ret_type));
     bool returns = resolve_stmt_block(decl->func.block, ret_type);
     sym_leave(scope);
+    sym->body_deps = resolve_deps_pop(deps_mark);
     if (ret_type != type_void && !returns)
     {
         fatal_error(decl->pos, "Not all control paths return values");
     }
+    TRACE_END();
+}
+
+void vm_eval(Sym* sym, Expr* expr, void* data);
+
+// Everything reachable from a compile-time evaluated declaration, including what the
+// bodies of the functions it may have called refer to, is added to its dependencies,
+// and the text of those bodies to its eval_hash, so that the cache sees a change to any
+// of them. The body hashes are summed so that the result does not depend on the order
+// they were visited in.
+void resolve_eval_deps(Sym* eval_sym, Sym* sym, Map* visited)
+{
+    if (map_get(visited, sym))
+    {
+        return;
+    }
+    map_put(visited, sym, sym);
+    buf_push(resolve_deps, sym);
+    if (sym->kind == SYM_FUNC && sym->decl)
+    {
+        eval_sym->eval_hash += hash_mix(hash_bytes(sym->name, strlen(sym->name)), sym->decl->func.body_hash);
+    }
+    for (size_t i = 0; i < buf_len(sym->deps); i++)
+    {
+        resolve_eval_deps(eval_sym, sym->deps[i], visited);
+    }
+    for (size_t i = 0; i < buf_len(sym->body_deps); i++)
+    {
+        resolve_eval_deps(eval_sym, sym->body_deps[i], visited);
+    }
+}
+
+void resolve_eval_sym(Sym* sym, size_t deps_mark)
+{
+    Expr* expr = sym->kind == SYM_CONST ? sym->decl->const_decl.expr : sym->decl->var.expr;
+    TRACE_BEGIN("resolve_eval_sym", sym->name);
+    sym->init_val = xcalloc(1, type_sizeof(sym->type));
+    vm_eval(sym, expr, sym->init_val);
+    if (sym->kind == SYM_CONST && is_integer_type(sym->type))
+    {
+        // The value is read at the width of the const's type and cast, so that it has
+        // the same representation in Val as a folded const.
+        size_t size = type_sizeof(sym->type);
+        bool is_signed = is_signed_type(sym->type);
+        Type* raw_type;
+        switch (size)
+        {
+            case 1:
+                raw_type = is_signed ? type_schar : type_uchar;
+                break;
+            case 2:
+                raw_type = is_signed ? type_short : type_ushort;
+                break;
+            case 4:
+                raw_type = is_signed ? type_int : type_uint;
+                break;
+            default:
+                raw_type = is_signed ? type_llong : type_ullong;
+                break;
+        }
+        Val val = { 0 };
+        memcpy(&val, sym->init_val, size);
+        Operand operand = operand_const(raw_type, val);
+        cast_operand(&operand, sym->type);
+        sym->val = operand.val;
+    }
+    if (resolve_deps_enabled)
+    {
+        Map visited = { 0 };
+        size_t num_deps = buf_len(resolve_deps);
+        for (size_t i = deps_mark; i < num_deps; i++)
+        {
+            resolve_eval_deps(sym, resolve_deps[i], &visited);
+        }
+        free(visited.keys);
+        free(visited.vals);
+    }
+    TRACE_END();
 }
 
 void resolve_sym(Sym* sym)
@@ -998,7 +1201,21 @@ void resolve_sym(Sym* sym)
         return;
     }
     assert(sym->state == SYM_UNRESOLVED);
+    TRACE_BEGIN("resolve_sym", sym->name);
     sym->state = SYM_RESOLVING;
+    // A global is resolved in the middle of a function body when the body was resolved
+    // early for compile-time evaluation, and its declaration must not see the body's
+    // locals.
+    LocalSym* locals_top = local_syms_top;
+    LocalSym** locals = NULL;
+    if (locals_top)
+    {
+        locals = xmalloc(sizeof(local_sym_buckets));
+        memcpy(locals, local_sym_buckets, sizeof(local_sym_buckets));
+        memset(local_sym_buckets, 0, sizeof(local_sym_buckets));
+        local_syms_top = NULL;
+    }
+    size_t deps_mark = resolve_deps_mark();
     switch (sym->kind)
     {
         case SYM_TYPE:
@@ -1017,31 +1234,50 @@ void resolve_sym(Sym* sym)
             assert(0);
             break;
     }
+    if ((sym->kind == SYM_CONST || sym->kind == SYM_VAR) && expr_has_call(sym->kind == SYM_CONST ? sym->decl->const_decl.expr : sym->decl->var.expr))
+    {
+        resolve_eval_sym(sym, deps_mark);
+    }
+    if (locals)
+    {
+        memcpy(local_sym_buckets, locals, sizeof(local_sym_buckets));
+        local_syms_top = locals_top;
+        free(locals);
+    }
+    sym->deps = resolve_deps_pop(deps_mark);
     sym->state = SYM_RESOLVED;
     buf_push(sorted_syms, sym);
+    TRACE_END();
 }
 
 void finalize_sym(Sym* sym)
 {
+    TRACE_BEGIN("finalize_sym", sym->name);
     resolve_sym(sym);
     if (sym->kind == SYM_TYPE)
     {
         complete_type(sym->type);
     }
-    else if (sym->kind == SYM_FUNC)
-    {
-        resolve_func_body(sym);
-    }
+    TRACE_END();
 }
 
 Sym* resolve_name(const char* name)
 {
-    Sym* sym = sym_get(name);
+    Sym* sym = sym_get_local(name);
+    if (sym)
+    {
+        return sym;
+    }
+    sym = map_get(&global_syms_map, (void*)name);
     if (!sym)
     {
         return NULL;
     }
     resolve_sym(sym);
+    if (resolve_deps_enabled)
+    {
+        buf_push(resolve_deps, sym);
+    }
     return sym;
 }
 
@@ -1987,6 +2223,43 @@ Operand resolve_expected_expr(Expr* expr, Type* expected_type)
     return result;
 }
 
+// Calls are evaluated at compile time in const and global var initializers.
+bool expr_has_call(Expr* expr)
+{
+    if (!expr)
+    {
+        return false;
+    }
+    switch (expr->kind)
+    {
+        case EXPR_CALL:
+            return true;
+        case EXPR_CAST:
+            return expr_has_call(expr->cast.expr);
+        case EXPR_INDEX:
+            return expr_has_call(expr->index.expr) || expr_has_call(expr->index.index);
+        case EXPR_FIELD:
+            return expr_has_call(expr->field.expr);
+        case EXPR_COMPOUND:
+            for (size_t i = 0; i < expr->compound.num_fields; i++)
+            {
+                if (expr_has_call(expr->compound.fields[i].init))
+                {
+                    return true;
+                }
+            }
+            return false;
+        case EXPR_UNARY:
+            return expr_has_call(expr->unary.expr);
+        case EXPR_BINARY:
+            return expr_has_call(expr->binary.left) || expr_has_call(expr->binary.right);
+        case EXPR_TERNARY:
+            return expr_has_call(expr->ternary.cond) || expr_has_call(expr->ternary.if_true) || expr_has_call(expr->ternary.if_false);
+        default:
+            return false;
+    }
+}
+
 Operand resolve_const_expr(Expr* expr)
 {
     Operand result = resolve_expr(expr);
@@ -2026,6 +2299,41 @@ void init_builtins(void)
     sym_global_const("true", type_bool, (Val) { .b = true });
     sym_global_const("false", type_bool, (Val) { .b = false });
     sym_global_const("NULL", type_ptr(type_void), (Val) { .p = 0 });
+    num_builtin_syms = buf_len(global_syms_buf);
+    builtin_syms_mark = arena_mark(&sym_arena);
+}
+
+// Watch mode compiles repeatedly in one process. The builtin syms are kept, while the
+// syms of the last compile are freed along with the types their declarations created,
+// so that the next compile can declare them again.
+void vm_reset(void);
+
+void reset_global_syms(void)
+{
+    prune_type_caches();
+    vm_reset();
+    for (size_t i = num_builtin_syms; i < buf_len(global_syms_buf); i++)
+    {
+        buf_free(global_syms_buf[i]->deps);
+        buf_free(global_syms_buf[i]->body_deps);
+        free(global_syms_buf[i]->init_val);
+    }
+    arena_reset(&sym_arena, builtin_syms_mark);
+    buf__hdr(global_syms_buf)->len = num_builtin_syms;
+    free(global_syms_map.keys);
+    free(global_syms_map.vals);
+    global_syms_map = (Map) { 0 };
+    for (size_t i = 0; i < num_builtin_syms; i++)
+    {
+        Sym* sym = global_syms_buf[i];
+        sym->hash_index = 0;
+        map_put(&global_syms_map, (void*)sym->name, sym);
+    }
+    buf_clear(sorted_syms);
+    // A compile that failed part way through a body leaves its locals behind.
+    memset(local_sym_buckets, 0, sizeof(local_sym_buckets));
+    local_syms_top = NULL;
+    buf_clear(resolve_deps);
 }
 
 void sym_global_decls(DeclSet* declset)
@@ -2036,7 +2344,73 @@ void sym_global_decls(DeclSet* declset)
     }
 }
 
-void finalize_syms(void)
+// Function bodies are handed out to workers in batches from a shared cursor.
+enum {
+    FUNC_BODY_BATCH = 64
+};
+
+Sym** func_body_syms;
+size_t next_func_body;
+Mutex func_body_mutex = MUTEX_INIT;
+
+void resolve_func_bodies_worker(void)
+{
+    for (;;)
+    {
+        mutex_lock(&func_body_mutex);
+        size_t begin = next_func_body;
+        next_func_body = MIN(begin + FUNC_BODY_BATCH, buf_len(func_body_syms));
+        size_t end = next_func_body;
+        mutex_unlock(&func_body_mutex);
+        if (begin == end)
+        {
+            break;
+        }
+        for (size_t i = begin; i < end; i++)
+        {
+            resolve_func_body(func_body_syms[i]);
+        }
+    }
+}
+
+// Bodies whose generated code is reused from the cache are skipped.
+void resolve_func_bodies(void)
+{
+    // A compile that failed part way through leaves the last list behind.
+    buf_clear(func_body_syms);
+    for (Sym** it = global_syms_buf; it != buf_end(global_syms_buf); it++)
+    {
+        Sym* sym = *it;
+        if (sym->decl && sym->kind == SYM_FUNC && !sym->cached && !sym->body_resolved)
+        {
+            buf_push(func_body_syms, sym);
+        }
+    }
+    size_t num_workers = MIN(get_num_workers(), buf_len(func_body_syms) / FUNC_BODY_BATCH);
+    if (num_workers <= 1)
+    {
+        for (Sym** it = func_body_syms; it != buf_end(func_body_syms); it++)
+        {
+            resolve_func_body(*it);
+        }
+    }
+    else
+    {
+        next_func_body = 0;
+        intern_lock_begin();
+        type_cache_lock_enabled = true;
+        run_workers(resolve_func_bodies_worker, num_workers);
+        type_cache_lock_enabled = false;
+        intern_lock_end();
+    }
+    buf_free(func_body_syms);
+}
+
+// Global declarations are resolved and aggregates completed first, in declaration
+// order, so sorted_syms does not depend on how bodies are scheduled. After that a
+// function body only reads global state and pushes onto its own thread's local syms,
+// so the bodies can be resolved in parallel.
+void finalize_global_syms(void)
 {
     for (Sym** it = global_syms_buf; it != buf_end(global_syms_buf); it++)
     {
@@ -2047,3 +2421,9 @@ void finalize_syms(void)
         }
     }
 }
+
+void finalize_syms(void)
+{
+    finalize_global_syms();
+    resolve_func_bodies();
+}
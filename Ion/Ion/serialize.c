@@ -0,0 +1,685 @@
+// Parsed files saved as a single relocatable blob, so that a file that has not changed
+// is loaded instead of being lexed and parsed again. The blob holds the nodes exactly
+// as they are laid out in memory, with each pointer replaced by the offset of what it
+// points to from the start of the blob, or by an index into the blob's string table
+// for names. A table of those pointer slots is all that loading needs: it reads the
+// blob into the AST arena and fixes up the slots in place, interning each string once,
+// without knowing anything about the node types. The blob never refers outside itself,
+// so it can equally be mapped into memory.
+//
+// Loading checks offsets against the blob's sections and the whole blob against a
+// checksum, but trusts the node kinds and counts inside, so a blob that is corrupt on
+// disk is rejected while one crafted to pass both checks is not.
+//
+// Resolved types and syms are not saved. They belong to one compile's set of global
+// declarations, and resolving the loaded declarations again against the current ones
+// is what lets a saved file be compiled with others that have changed since.
+//
+//   AstBlobHeader
+//   nodes            pointer slots hold blob offsets, string slots string indices
+//   strings          NUL-terminated, in index order
+//   relocations      uint64_t slot offset << 1 | 1 for a string slot
+
+#define AST_BLOB_MAGIC "ion_ast"
+#define AST_BLOB_VERSION 2
+
+typedef struct AstBlobHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t ptr_size;
+    // Hash of the sizes of the node types, so that a blob saved by a compiler whose
+    // nodes are laid out differently is not loaded.
+    uint64_t layout;
+    uint64_t size;
+    uint64_t declset;
+    uint64_t strs;
+    uint64_t num_strs;
+    uint64_t relocs;
+    uint64_t num_relocs;
+    uint64_t num_lines;
+    // The source file's stamp when it was parsed.
+    FileStamp source;
+    // See ast_blob_checksum.
+    uint64_t checksum;
+} AstBlobHeader;
+
+uint64_t ast_blob_layout(void)
+{
+    uint64_t sizes[] = {
+        sizeof(void*), sizeof(SrcPos), sizeof(Note), sizeof(StmtList), sizeof(Typespec),
+        sizeof(FuncParam), sizeof(AggregateItem), sizeof(EnumItem), sizeof(Decl), sizeof(DeclSet),
+        sizeof(CompoundField), sizeof(Expr), sizeof(ElseIf), sizeof(SwitchCase), sizeof(Stmt),
+    };
+    return hash_bytes((const char*)sizes, sizeof(sizes));
+}
+
+// Covers the header, with the checksum itself taken as 0, and everything after it.
+// The header has no padding.
+uint64_t ast_blob_checksum(AstBlobHeader header, const char* blob)
+{
+    header.checksum = 0;
+    uint64_t header_hash = hash_bytes((const char*)&header, sizeof(header));
+    return hash_mix(header_hash, hash_bytes(blob + sizeof(header), header.size - sizeof(header)));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writing
+//
+
+typedef struct AstWriter {
+    char* buf;
+    uint64_t* relocs;
+    // Maps each string pointer to its index + 1.
+    Map str_indices;
+    const char** strs;
+} AstWriter;
+
+// Appends a copy of a node or array and returns its offset. Its pointer and string
+// slots still hold the original pointers until they are written.
+size_t ast_write_copy(AstWriter* w, const void* src, size_t size)
+{
+    size_t offset = ALIGN_UP(buf_len(w->buf), sizeof(uint64_t));
+    buf_fit(w->buf, offset + size);
+    memset(w->buf + buf_len(w->buf), 0, offset - buf_len(w->buf));
+    memcpy(w->buf + offset, src, size);
+    buf__hdr(w->buf)->len = offset + size;
+    return offset;
+}
+
+void* ast_write_get(AstWriter* w, size_t slot)
+{
+    void* ptr;
+    memcpy(&ptr, w->buf + slot, sizeof(ptr));
+    return ptr;
+}
+
+void ast_write_set(AstWriter* w, size_t slot, uintptr_t val)
+{
+    memcpy(w->buf + slot, &val, sizeof(val));
+}
+
+// Offsets are taken before the target is written since writing it can move the buffer.
+void ast_write_ptr(AstWriter* w, size_t slot, size_t target)
+{
+    ast_write_set(w, slot, target);
+    if (target)
+    {
+        buf_push(w->relocs, (uint64_t)slot << 1);
+    }
+}
+
+void ast_write_str(AstWriter* w, size_t slot)
+{
+    const char* str = ast_write_get(w, slot);
+    if (!str)
+    {
+        return;
+    }
+    size_t index = (size_t)map_get(&w->str_indices, (void*)str);
+    if (!index)
+    {
+        buf_push(w->strs, str);
+        index = buf_len(w->strs);
+        map_put(&w->str_indices, (void*)str, (void*)index);
+    }
+    ast_write_set(w, slot, index - 1);
+    buf_push(w->relocs, (uint64_t)slot << 1 | 1);
+}
+
+void ast_write_pos(AstWriter* w, size_t slot)
+{
+    ast_write_str(w, slot + offsetof(SrcPos, name));
+}
+
+size_t ast_write_expr(AstWriter* w, Expr* expr);
+size_t ast_write_stmt(AstWriter* w, Stmt* stmt);
+size_t ast_write_decl(AstWriter* w, Decl* decl);
+size_t ast_write_typespec(AstWriter* w, Typespec* typespec);
+
+typedef size_t (*AstWriteFunc)(AstWriter* w, void* node);
+
+// Writes an array of node pointers.
+size_t ast_write_ptrs(AstWriter* w, void** ptrs, size_t num_ptrs, AstWriteFunc write)
+{
+    if (!ptrs || !num_ptrs)
+    {
+        return 0;
+    }
+    size_t array = ast_write_copy(w, ptrs, num_ptrs * sizeof(void*));
+    for (size_t i = 0; i < num_ptrs; i++)
+    {
+        ast_write_ptr(w, array + i * sizeof(void*), write(w, ptrs[i]));
+    }
+    return array;
+}
+
+#define AST_WRITE_PTRS(w, ptrs, num_ptrs, write) ast_write_ptrs(w, (void**)(ptrs), num_ptrs, (AstWriteFunc)(write))
+
+void ast_write_stmt_list(AstWriter* w, size_t slot, StmtList block)
+{
+    ast_write_pos(w, slot + offsetof(StmtList, pos));
+    ast_write_ptr(w, slot + offsetof(StmtList, stmts), AST_WRITE_PTRS(w, block.stmts, block.num_stmts, ast_write_stmt));
+}
+
+size_t ast_write_typespec(AstWriter* w, Typespec* typespec)
+{
+    if (!typespec)
+    {
+        return 0;
+    }
+    size_t node = ast_write_copy(w, typespec, sizeof(Typespec));
+    ast_write_pos(w, node + offsetof(Typespec, pos));
+    ast_write_set(w, node + offsetof(Typespec, type), 0);
+    switch (typespec->kind)
+    {
+        case TYPESPEC_NAME:
+            ast_write_str(w, node + offsetof(Typespec, name));
+            break;
+        case TYPESPEC_FUNC:
+            ast_write_ptr(w, node + offsetof(Typespec, func.args), AST_WRITE_PTRS(w, typespec->func.args, typespec->func.num_args, ast_write_typespec));
+            ast_write_ptr(w, node + offsetof(Typespec, func.ret), ast_write_typespec(w, typespec->func.ret));
+            break;
+        case TYPESPEC_ARRAY:
+            ast_write_ptr(w, node + offsetof(Typespec, base), ast_write_typespec(w, typespec->base));
+            ast_write_ptr(w, node + offsetof(Typespec, num_elems), ast_write_expr(w, typespec->num_elems));
+            break;
+        case TYPESPEC_PTR:
+        case TYPESPEC_CONST:
+            ast_write_ptr(w, node + offsetof(Typespec, base), ast_write_typespec(w, typespec->base));
+            break;
+        default:
+            assert(0);
+            break;
+    }
+    return node;
+}
+
+size_t ast_write_compound_fields(AstWriter* w, CompoundField* fields, size_t num_fields)
+{
+    if (!num_fields)
+    {
+        return 0;
+    }
+    size_t array = ast_write_copy(w, fields, num_fields * sizeof(CompoundField));
+    for (size_t i = 0; i < num_fields; i++)
+    {
+        size_t field = array + i * sizeof(CompoundField);
+        ast_write_pos(w, field + offsetof(CompoundField, pos));
+        ast_write_ptr(w, field + offsetof(CompoundField, init), ast_write_expr(w, fields[i].init));
+        if (fields[i].kind == FIELD_NAME)
+        {
+            ast_write_str(w, field + offsetof(CompoundField, name));
+        }
+        else if (fields[i].kind == FIELD_INDEX)
+        {
+            ast_write_ptr(w, field + offsetof(CompoundField, index), ast_write_expr(w, fields[i].index));
+        }
+    }
+    return array;
+}
+
+size_t ast_write_expr(AstWriter* w, Expr* expr)
+{
+    if (!expr)
+    {
+        return 0;
+    }
+    size_t node = ast_write_copy(w, expr, sizeof(Expr));
+    ast_write_pos(w, node + offsetof(Expr, pos));
+    ast_write_set(w, node + offsetof(Expr, type), 0);
+    switch (expr->kind)
+    {
+        case EXPR_INT:
+        case EXPR_FLOAT:
+            break;
+        case EXPR_STR:
+            ast_write_str(w, node + offsetof(Expr, str_lit.val));
+            break;
+        case EXPR_NAME:
+            ast_write_str(w, node + offsetof(Expr, name));
+            break;
+        case EXPR_SIZEOF_EXPR:
+            ast_write_ptr(w, node + offsetof(Expr, sizeof_expr), ast_write_expr(w, expr->sizeof_expr));
+            break;
+        case EXPR_SIZEOF_TYPE:
+            ast_write_ptr(w, node + offsetof(Expr, sizeof_type), ast_write_typespec(w, expr->sizeof_type));
+            break;
+        case EXPR_COMPOUND:
+            ast_write_ptr(w, node + offsetof(Expr, compound.type), ast_write_typespec(w, expr->compound.type));
+            ast_write_ptr(w, node + offsetof(Expr, compound.fields), ast_write_compound_fields(w, expr->compound.fields, expr->compound.num_fields));
+            break;
+        case EXPR_CAST:
+            ast_write_ptr(w, node + offsetof(Expr, cast.type), ast_write_typespec(w, expr->cast.type));
+            ast_write_ptr(w, node + offsetof(Expr, cast.expr), ast_write_expr(w, expr->cast.expr));
+            break;
+        case EXPR_UNARY:
+            ast_write_ptr(w, node + offsetof(Expr, unary.expr), ast_write_expr(w, expr->unary.expr));
+            break;
+        case EXPR_BINARY:
+            ast_write_ptr(w, node + offsetof(Expr, binary.left), ast_write_expr(w, expr->binary.left));
+            ast_write_ptr(w, node + offsetof(Expr, binary.right), ast_write_expr(w, expr->binary.right));
+            break;
+        case EXPR_TERNARY:
+            ast_write_ptr(w, node + offsetof(Expr, ternary.cond), ast_write_expr(w, expr->ternary.cond));
+            ast_write_ptr(w, node + offsetof(Expr, ternary.if_true), ast_write_expr(w, expr->ternary.if_true));
+            ast_write_ptr(w, node + offsetof(Expr, ternary.if_false), ast_write_expr(w, expr->ternary.if_false));
+            break;
+        case EXPR_CALL:
+            ast_write_ptr(w, node + offsetof(Expr, call.expr), ast_write_expr(w, expr->call.expr));
+            ast_write_ptr(w, node + offsetof(Expr, call.args), AST_WRITE_PTRS(w, expr->call.args, expr->call.num_args, ast_write_expr));
+            break;
+        case EXPR_INDEX:
+            ast_write_ptr(w, node + offsetof(Expr, index.expr), ast_write_expr(w, expr->index.expr));
+            ast_write_ptr(w, node + offsetof(Expr, index.index), ast_write_expr(w, expr->index.index));
+            break;
+        case EXPR_FIELD:
+            ast_write_ptr(w, node + offsetof(Expr, field.expr), ast_write_expr(w, expr->field.expr));
+            ast_write_str(w, node + offsetof(Expr, field.name));
+            break;
+        default:
+            assert(0);
+            break;
+    }
+    return node;
+}
+
+size_t ast_write_elseifs(AstWriter* w, ElseIf* elseifs, size_t num_elseifs)
+{
+    if (!num_elseifs)
+    {
+        return 0;
+    }
+    size_t array = ast_write_copy(w, elseifs, num_elseifs * sizeof(ElseIf));
+    for (size_t i = 0; i < num_elseifs; i++)
+    {
+        size_t elseif = array + i * sizeof(ElseIf);
+        ast_write_ptr(w, elseif + offsetof(ElseIf, cond), ast_write_expr(w, elseifs[i].cond));
+        ast_write_stmt_list(w, elseif + offsetof(ElseIf, block), elseifs[i].block);
+    }
+    return array;
+}
+
+size_t ast_write_switch_cases(AstWriter* w, SwitchCase* cases, size_t num_cases)
+{
+    if (!num_cases)
+    {
+        return 0;
+    }
+    size_t array = ast_write_copy(w, cases, num_cases * sizeof(SwitchCase));
+    for (size_t i = 0; i < num_cases; i++)
+    {
+        size_t switch_case = array + i * sizeof(SwitchCase);
+        ast_write_ptr(w, switch_case + offsetof(SwitchCase, exprs), AST_WRITE_PTRS(w, cases[i].exprs, cases[i].num_exprs, ast_write_expr));
+        ast_write_stmt_list(w, switch_case + offsetof(SwitchCase, block), cases[i].block);
+    }
+    return array;
+}
+
+size_t ast_write_stmt(AstWriter* w, Stmt* stmt)
+{
+    if (!stmt)
+    {
+        return 0;
+    }
+    size_t node = ast_write_copy(w, stmt, sizeof(Stmt));
+    ast_write_pos(w, node + offsetof(Stmt, pos));
+    switch (stmt->kind)
+    {
+        case STMT_DECL:
+            ast_write_ptr(w, node + offsetof(Stmt, decl), ast_write_decl(w, stmt->decl));
+            break;
+        case STMT_RETURN:
+        case STMT_EXPR:
+            ast_write_ptr(w, node + offsetof(Stmt, expr), ast_write_expr(w, stmt->expr));
+            break;
+        case STMT_BREAK:
+        case STMT_CONTINUE:
+            break;
+        case STMT_BLOCK:
+            ast_write_stmt_list(w, node + offsetof(Stmt, block), stmt->block);
+            break;
+        case STMT_IF:
+            ast_write_ptr(w, node + offsetof(Stmt, if_stmt.cond), ast_write_expr(w, stmt->if_stmt.cond));
+            ast_write_stmt_list(w, node + offsetof(Stmt, if_stmt.then_block), stmt->if_stmt.then_block);
+            ast_write_ptr(w, node + offsetof(Stmt, if_stmt.elseifs), ast_write_elseifs(w, stmt->if_stmt.elseifs, stmt->if_stmt.num_elseifs));
+            ast_write_stmt_list(w, node + offsetof(Stmt, if_stmt.else_block), stmt->if_stmt.else_block);
+            break;
+        case STMT_WHILE:
+        case STMT_DO_WHILE:
+            ast_write_ptr(w, node + offsetof(Stmt, while_stmt.cond), ast_write_expr(w, stmt->while_stmt.cond));
+            ast_write_stmt_list(w, node + offsetof(Stmt, while_stmt.block), stmt->while_stmt.block);
+            break;
+        case STMT_FOR:
+            ast_write_ptr(w, node + offsetof(Stmt, for_stmt.init), ast_write_stmt(w, stmt->for_stmt.init));
+            ast_write_ptr(w, node + offsetof(Stmt, for_stmt.cond), ast_write_expr(w, stmt->for_stmt.cond));
+            ast_write_ptr(w, node + offsetof(Stmt, for_stmt.next), ast_write_stmt(w, stmt->for_stmt.next));
+            ast_write_stmt_list(w, node + offsetof(Stmt, for_stmt.block), stmt->for_stmt.block);
+            break;
+        case STMT_SWITCH:
+            ast_write_ptr(w, node + offsetof(Stmt, switch_stmt.expr), ast_write_expr(w, stmt->switch_stmt.expr));
+            ast_write_ptr(w, node + offsetof(Stmt, switch_stmt.cases), ast_write_switch_cases(w, stmt->switch_stmt.cases, stmt->switch_stmt.num_cases));
+            break;
+        case STMT_ASSIGN:
+            ast_write_ptr(w, node + offsetof(Stmt, assign.left), ast_write_expr(w, stmt->assign.left));
+            ast_write_ptr(w, node + offsetof(Stmt, assign.right), ast_write_expr(w, stmt->assign.right));
+            break;
+        case STMT_INIT:
+            ast_write_str(w, node + offsetof(Stmt, init.name));
+            ast_write_ptr(w, node + offsetof(Stmt, init.type), ast_write_typespec(w, stmt->init.type));
+            ast_write_ptr(w, node + offsetof(Stmt, init.expr), ast_write_expr(w, stmt->init.expr));
+            break;
+        default:
+            assert(0);
+            break;
+    }
+    return node;
+}
+
+size_t ast_write_notes(AstWriter* w, Note* notes, size_t num_notes)
+{
+    if (!num_notes)
+    {
+        return 0;
+    }
+    size_t array = ast_write_copy(w, notes, num_notes * sizeof(Note));
+    for (size_t i = 0; i < num_notes; i++)
+    {
+        size_t note = array + i * sizeof(Note);
+        ast_write_pos(w, note + offsetof(Note, pos));
+        ast_write_str(w, note + offsetof(Note, name));
+    }
+    return array;
+}
+
+size_t ast_write_enum_items(AstWriter* w, EnumItem* items, size_t num_items)
+{
+    if (!num_items)
+    {
+        return 0;
+    }
+    size_t array = ast_write_copy(w, items, num_items * sizeof(EnumItem));
+    for (size_t i = 0; i < num_items; i++)
+    {
+        size_t item = array + i * sizeof(EnumItem);
+        ast_write_pos(w, item + offsetof(EnumItem, pos));
+        ast_write_str(w, item + offsetof(EnumItem, name));
+        ast_write_ptr(w, item + offsetof(EnumItem, init), ast_write_expr(w, items[i].init));
+    }
+    return array;
+}
+
+size_t ast_write_aggregate_items(AstWriter* w, AggregateItem* items, size_t num_items)
+{
+    if (!num_items)
+    {
+        return 0;
+    }
+    size_t array = ast_write_copy(w, items, num_items * sizeof(AggregateItem));
+    for (size_t i = 0; i < num_items; i++)
+    {
+        size_t item = array + i * sizeof(AggregateItem);
+        ast_write_pos(w, item + offsetof(AggregateItem, pos));
+        size_t names = ast_write_copy(w, items[i].names, items[i].num_names * sizeof(const char*));
+        for (size_t j = 0; j < items[i].num_names; j++)
+        {
+            ast_write_str(w, names + j * sizeof(const char*));
+        }
+        ast_write_ptr(w, item + offsetof(AggregateItem, names), names);
+        ast_write_ptr(w, item + offsetof(AggregateItem, type), ast_write_typespec(w, items[i].type));
+    }
+    return array;
+}
+
+size_t ast_write_func_params(AstWriter* w, FuncParam* params, size_t num_params)
+{
+    if (!num_params)
+    {
+        return 0;
+    }
+    size_t array = ast_write_copy(w, params, num_params * sizeof(FuncParam));
+    for (size_t i = 0; i < num_params; i++)
+    {
+        size_t param = array + i * sizeof(FuncParam);
+        ast_write_pos(w, param + offsetof(FuncParam, pos));
+        ast_write_str(w, param + offsetof(FuncParam, name));
+        ast_write_ptr(w, param + offsetof(FuncParam, type), ast_write_typespec(w, params[i].type));
+    }
+    return array;
+}
+
+size_t ast_write_decl(AstWriter* w, Decl* decl)
+{
+    if (!decl)
+    {
+        return 0;
+    }
+    size_t node = ast_write_copy(w, decl, sizeof(Decl));
+    ast_write_pos(w, node + offsetof(Decl, pos));
+    ast_write_str(w, node + offsetof(Decl, name));
+    ast_write_set(w, node + offsetof(Decl, sym), 0);
+    ast_write_ptr(w, node + offsetof(Decl, notes.notes), ast_write_notes(w, decl->notes.notes, decl->notes.num_notes));
+    switch (decl->kind)
+    {
+        case DECL_ENUM:
+            ast_write_ptr(w, node + offsetof(Decl, enum_decl.items), ast_write_enum_items(w, decl->enum_decl.items, decl->enum_decl.num_items));
+            break;
+        case DECL_STRUCT:
+        case DECL_UNION:
+            ast_write_ptr(w, node + offsetof(Decl, aggregate.items), ast_write_aggregate_items(w, decl->aggregate.items, decl->aggregate.num_items));
+            break;
+        case DECL_VAR:
+            ast_write_ptr(w, node + offsetof(Decl, var.type), ast_write_typespec(w, decl->var.type));
+            ast_write_ptr(w, node + offsetof(Decl, var.expr), ast_write_expr(w, decl->var.expr));
+            break;
+        case DECL_CONST:
+            ast_write_ptr(w, node + offsetof(Decl, const_decl.expr), ast_write_expr(w, decl->const_decl.expr));
+            break;
+        case DECL_TYPEDEF:
+            ast_write_ptr(w, node + offsetof(Decl, typedef_decl.type), ast_write_typespec(w, decl->typedef_decl.type));
+            break;
+        case DECL_FUNC:
+            ast_write_ptr(w, node + offsetof(Decl, func.params), ast_write_func_params(w, decl->func.params, decl->func.num_params));
+            ast_write_ptr(w, node + offsetof(Decl, func.ret_type), ast_write_typespec(w, decl->func.ret_type));
+            ast_write_stmt_list(w, node + offsetof(Decl, func.block), decl->func.block);
+            break;
+        default:
+            assert(0);
+            break;
+    }
+    return node;
+}
+
+// Returns the blob as a stretchy buffer.
+char* ast_write(DeclSet* declset, size_t num_lines, FileStamp source)
+{
+    AstWriter w = { 0 };
+    AstBlobHeader header = { AST_BLOB_MAGIC, AST_BLOB_VERSION, sizeof(void*), ast_blob_layout() };
+    header.num_lines = num_lines;
+    header.source = source;
+    ast_write_copy(&w, &header, sizeof(header));
+
+    size_t node = ast_write_copy(&w, declset, sizeof(DeclSet));
+    ast_write_ptr(&w, node + offsetof(DeclSet, decls), AST_WRITE_PTRS(&w, declset->decls, declset->num_decls, ast_write_decl));
+
+    header.declset = node;
+    header.strs = buf_len(w.buf);
+    header.num_strs = buf_len(w.strs);
+    for (size_t i = 0; i < buf_len(w.strs); i++)
+    {
+        buf_append(w.buf, w.strs[i], strlen(w.strs[i]) + 1);
+    }
+    header.num_relocs = buf_len(w.relocs);
+    header.relocs = ast_write_copy(&w, w.relocs, buf_len(w.relocs) * sizeof(uint64_t));
+    header.size = buf_len(w.buf);
+    header.checksum = ast_blob_checksum(header, w.buf);
+    memcpy(w.buf, &header, sizeof(header));
+
+    buf_free(w.relocs);
+    buf_free(w.strs);
+    free(w.str_indices.keys);
+    free(w.str_indices.vals);
+    return w.buf;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Loading
+//
+
+bool ast_blob_header_valid(const AstBlobHeader* header, size_t size)
+{
+    return size >= sizeof(AstBlobHeader)
+        && memcmp(header->magic, AST_BLOB_MAGIC, sizeof(header->magic)) == 0
+        && header->version == AST_BLOB_VERSION
+        && header->ptr_size == sizeof(void*)
+        && header->layout == ast_blob_layout()
+        && header->size == size
+        && header->strs <= header->relocs
+        && header->relocs <= size
+        && header->num_relocs == (size - header->relocs) / sizeof(uint64_t)
+        && header->declset >= sizeof(AstBlobHeader)
+        && header->declset + sizeof(DeclSet) <= header->strs;
+}
+
+// Fixes up a blob in place, which must be 8-byte aligned and outlive its nodes.
+// Returns NULL if the header is invalid, the checksum does not match, an offset
+// points outside its section, or the blob was saved by a different compiler.
+DeclSet* ast_read(char* blob, size_t size)
+{
+    AstBlobHeader header;
+    if (size < sizeof(header))
+    {
+        return NULL;
+    }
+    memcpy(&header, blob, sizeof(header));
+    if (!ast_blob_header_valid(&header, size)
+        || ast_blob_checksum(header, blob) != header.checksum)
+    {
+        return NULL;
+    }
+    const char** strs = xmalloc(MAX(header.num_strs, 1) * sizeof(const char*));
+    const char* str = blob + header.strs;
+    const char* strs_end = blob + header.relocs;
+    bool valid = true;
+    for (size_t i = 0; i < header.num_strs && valid; i++)
+    {
+        const char* end = memchr(str, 0, strs_end - str);
+        if (!end)
+        {
+            valid = false;
+            break;
+        }
+        strs[i] = str_intern_range(str, end);
+        str = end + 1;
+    }
+    const uint64_t* relocs = (const uint64_t*)(blob + header.relocs);
+    for (size_t i = 0; i < header.num_relocs && valid; i++)
+    {
+        uint64_t slot = relocs[i] >> 1;
+        if (slot % sizeof(void*) != 0 || slot < sizeof(AstBlobHeader) || slot + sizeof(void*) > header.strs)
+        {
+            valid = false;
+            break;
+        }
+        uintptr_t val;
+        memcpy(&val, blob + slot, sizeof(val));
+        void* ptr;
+        if (relocs[i] & 1)
+        {
+            valid = val < header.num_strs;
+            ptr = valid ? (void*)strs[val] : NULL;
+        }
+        else
+        {
+            valid = val % sizeof(void*) == 0 && val >= sizeof(AstBlobHeader) && val < header.strs;
+            ptr = blob + val;
+        }
+        memcpy(blob + slot, &ptr, sizeof(ptr));
+    }
+    free(strs);
+    return valid ? (DeclSet*)(blob + header.declset) : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Files
+//
+
+// With -ast, each parsed file is saved as <path>ast, for example foo.ionast, and loaded
+// from there by later compiles while the file is unchanged. A .ionast file given as an
+// input is loaded whether or not its source is around.
+bool ast_files_enabled;
+
+bool is_ast_path(const char* path)
+{
+    const char* ext = get_ext(path);
+    return ext && strcmp(ext, "ionast") == 0;
+}
+
+// Reads a saved file into the AST arena. With a source stamp, a blob saved from a
+// different version of the source is not loaded. Nothing is allocated for a blob whose
+// header gives a size other than the file's, so a corrupt size cannot exhaust memory.
+DeclSet* ast_load_file(const char* path, const FileStamp* source, size_t* num_lines)
+{
+    FileStamp stamp;
+    if (!get_file_stamp(path, &stamp))
+    {
+        return NULL;
+    }
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        return NULL;
+    }
+    AstBlobHeader header;
+    DeclSet* declset = NULL;
+    if (fread(&header, sizeof(header), 1, file) == 1 && header.size >= sizeof(header) && header.size == stamp.size
+        && (size_t)header.size == header.size
+        && (!source || (header.source.mtime == source->mtime && header.source.size == source->size)))
+    {
+        ArenaMark mark = arena_mark(&ast_arena);
+        char* blob = ast_arena_alloc(header.size);
+        memcpy(blob, &header, sizeof(header));
+        size_t rest = header.size - sizeof(header);
+        if (rest == 0 || fread(blob + sizeof(header), rest, 1, file) == 1)
+        {
+            declset = ast_read(blob, header.size);
+        }
+        if (declset)
+        {
+            *num_lines = header.num_lines;
+        }
+        else
+        {
+            arena_reset(&ast_arena, mark);
+        }
+    }
+    fclose(file);
+    return declset;
+}
+
+// Loads the saved parse of a source file if it is still current.
+DeclSet* ast_load_source(const char* path, size_t* num_lines)
+{
+    if (is_ast_path(path))
+    {
+        return ast_load_file(path, NULL, num_lines);
+    }
+    FileStamp stamp;
+    if (!ast_files_enabled || !get_file_stamp(path, &stamp))
+    {
+        return NULL;
+    }
+    return ast_load_file(strf("%sast", path), &stamp, num_lines);
+}
+
+// Failing to save only means the file is parsed again next time.
+void ast_save_source(const char* path, DeclSet* declset, size_t num_lines)
+{
+    FileStamp stamp;
+    if (!ast_files_enabled || is_ast_path(path) || !get_file_stamp(path, &stamp))
+    {
+        return;
+    }
+    char* blob = ast_write(declset, num_lines, stamp);
+    write_binary_file(strf("%sast", path), blob, buf_len(blob));
+    buf_free(blob);
+}
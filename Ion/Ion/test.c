@@ -10,11 +10,62 @@ void intern_test(void) {
     assert(str_intern(a) != str_intern(c));
     char d[] = "hell";
     assert(str_intern(a) != str_intern(d));
+    const char* first = str_intern("intern_test_0");
+    for (int i = 1; i < 10000; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "intern_test_%d", i);
+        const char* str = str_intern(name);
+        assert(strcmp(str, name) == 0);
+        assert(str_intern(name) == str);
+    }
+    assert(str_intern("intern_test_0") == first);
+}
+
+#define INTERN_THREADS_TEST_NAMES 10000
+
+void intern_threads_test_worker(void* arg) {
+    const char** strs = arg;
+    for (int i = 0; i < INTERN_THREADS_TEST_NAMES; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "intern_threads_test_%d", i);
+        strs[i] = str_intern(name);
+    }
+}
+
+void intern_threads_test(void) {
+    enum { NUM_THREADS = 4 };
+    const char** strs = xcalloc(NUM_THREADS * INTERN_THREADS_TEST_NAMES, sizeof(const char*));
+    Thread threads[NUM_THREADS];
+    intern_lock_begin();
+    for (int i = 0; i < NUM_THREADS; i++)
+    {
+        threads[i] = thread_create(intern_threads_test_worker, strs + i * INTERN_THREADS_TEST_NAMES);
+    }
+    for (int i = 0; i < NUM_THREADS; i++)
+    {
+        thread_join(threads[i]);
+    }
+    intern_lock_end();
+    for (int i = 0; i < INTERN_THREADS_TEST_NAMES; i++)
+    {
+        for (int j = 1; j < NUM_THREADS; j++)
+        {
+            assert(strs[j * INTERN_THREADS_TEST_NAMES + i] == strs[i]);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "intern_threads_test_%d", i);
+        assert(str_intern(name) == strs[i]);
+    }
+    free(strs);
 }
 
 void common_test(void) {
     buf_test();
+    arena_test();
     intern_test();
+    intern_threads_test();
     map_test();
 
     char *str1 = strf("%d %d", 1, 2);
@@ -27,12 +78,15 @@ void common_test(void) {
 
 void keyword_test(void) {
     init_keywords();
-    assert(is_keyword_name(first_keyword));
-    assert(is_keyword_name(last_keyword));
     for (const char **it = keywords; it != buf_end(keywords); it++) {
         assert(is_keyword_name(*it));
+        assert(keyword_lookup(*it, strlen(*it)) == *it);
     }
     assert(!is_keyword_name(str_intern("foo")));
+    // Same first character, last character and length as "func".
+    assert(!is_keyword_name(str_intern("fooc")));
+    assert(!keyword_lookup("enumx", 4 + 1));
+    assert(keyword_lookup("enumx", 4) == enum_keyword);
 }
 
 #define assert_token(x) assert(match_token(x))
@@ -104,6 +158,32 @@ void lex_test(void) {
     assert_token(TOKEN_ADD);
     assert_token_int(994);
     assert_token_eof();
+
+    // Long identifier and whitespace runs
+    init_stream(NULL, "a_rather_long_identifier_name_0123456789 \n\t                        \n  \r\n  x\n");
+    assert_token_name("a_rather_long_identifier_name_0123456789");
+    assert(token.pos.line == 4);
+    assert(token.start - line_start == 2);
+    assert_token_name("x");
+    assert_token_eof();
+    assert(token.pos.line == 5);
+
+    // Token array mode
+    TokenArray tokens;
+    tokenize(&tokens, NULL, "x := 0x1f\n\"str\" 1.5d");
+    init_token_array(&tokens);
+    assert_token_name("x");
+    assert_token(TOKEN_COLON_ASSIGN);
+    assert(token.mod == MOD_HEX);
+    assert_token_int(0x1f);
+    assert(token.pos.line == 2);
+    assert_token_str("str");
+    assert(token.suffix == SUFFIX_D);
+    assert_token_float(1.5);
+    assert_token_eof();
+    next_token();
+    assert_token_eof();
+    token_array_free(&tokens);
 }
 
 #undef assert_token
@@ -143,18 +223,18 @@ void parse_test(void) {
     }
 }
 
-void gen_cdecl_test(void) {	
+void gen_cdecl_test(void) {
 #if 0
-    char *cdecl1 = type_to_cdecl(type_int, "x");
-    char *cdecl2 = type_to_cdecl(type_ptr(type_int), "x");
-    char *cdecl3 = type_to_cdecl(type_array(type_int, 10), "x");
-    char *cdecl4 = type_to_cdecl(type_func((Type*[]){type_int}, 1, type_int), "x");
-    char *cdecl5 = type_to_cdecl(type_array(type_func((Type*[]){type_int}, 1, type_int), 10), "x");
-    char *cdecl6 = type_to_cdecl(type_func((Type*[]){type_ptr(type_int)}, 1, type_int), "x");
+    gen_type_cdecl(type_int, "x");
+    gen_type_cdecl(type_ptr(type_int), "x");
+    gen_type_cdecl(type_array(type_int, 10), "x");
+    gen_type_cdecl(type_func((Type*[]){type_int}, 1, type_int), "x");
+    gen_type_cdecl(type_array(type_func((Type*[]){type_int}, 1, type_int), 10), "x");
+    gen_type_cdecl(type_func((Type*[]){type_ptr(type_int)}, 1, type_int), "x");
     Type *type1 = type_func((Type*[]){type_array(type_int, 10)}, 1, type_int);
-    char *cdecl7 = type_to_cdecl(type1, "x");
-    char *cdecl8 = type_to_cdecl(type_func(NULL, 0, type1), "x");
-    char *cdecl9 = type_to_cdecl(type_func(NULL, 0, type_array(type_func(NULL, 0, type_int), 10)), "x");
+    gen_type_cdecl(type1, "x");
+    gen_type_cdecl(type_func(NULL, 0, type1), "x");
+    gen_type_cdecl(type_func(NULL, 0, type_array(type_func(NULL, 0, type_int), 10)), "x");
 #endif
 }
 
@@ -252,11 +332,228 @@ void resolve_test(void) {
     }
 }
 
+// Watch mode compiles the same declarations again in one process, which must give the
+// same output as the first time.
+void recompile_test(void) {
+    init_keywords();
+    init_builtins();
+    init_stream(NULL,
+        "struct V { x, y: int; }\n"
+        "func add(a: V, b: V): V { return {a.x + b.x, a.y + b.y}; }\n"
+        "var p: V*;\n"
+        "var s: int[4];\n"
+        "enum E { E0, E1 }\n"
+        "func sum(e: E): int { v := add({1, 2}, *p); return s[e] + v.x + sizeof(:V); }\n");
+    DeclSet *declset = parse_file();
+    char *outputs[2];
+    for (int i = 0; i < 2; i++) {
+        reset_global_syms();
+        for (size_t j = 0; j < declset->num_decls; j++) {
+            clear_decl_types(declset->decls[j]);
+        }
+        sym_global_decls(declset);
+        finalize_syms();
+        gen_all();
+        outputs[i] = gen_buf;
+        gen_buf = NULL;
+    }
+    assert(buf_len(outputs[0]) == buf_len(outputs[1]));
+    assert(memcmp(outputs[0], outputs[1], buf_len(outputs[0])) == 0);
+    buf_free(outputs[0]);
+    buf_free(outputs[1]);
+}
+
+// Declarations loaded from a saved blob compile to the same output as those parsed.
+void ast_blob_test(void) {
+    init_keywords();
+    init_builtins();
+    init_stream("blob.ion",
+        "struct V { x, y: int; }\n"
+        "union U { i: int; f: float; }\n"
+        "typedef F = func(int, char*): int;\n"
+        "const N = 4;\n"
+        "enum E { E0, E1 }\n"
+        "@foreign func printf(fmt: char const*, ...): int { return 0; }\n"
+        "var table: int[N] = {[1] = 2, 3};\n"
+        "func f(v: V*, e: E): int {\n"
+        "    s := \"text\";\n"
+        "    u: U = {i = 1};\n"
+        "    w := V{x = 1, y = (:int)2.5};\n"
+        "    for (i := 0; i < N; i++) { if (i == 1) { continue; } else if (i > 2) { break; } else { w.x += table[i]; } }\n"
+        "    while (w.x) { w.x--; w.y = -w.y; }\n"
+        "    switch (e) { case E0, E1: return v.x; default: return e ? sizeof(:V) : sizeof(w); }\n"
+        "    return printf(s) + u.i;\n"
+        "}\n");
+    DeclSet *declset = parse_file();
+    char *blob = ast_write(declset, token.pos.line, (FileStamp){0});
+    char *corrupt = memdup(blob, buf_len(blob));
+    corrupt[buf_len(blob) / 2] ^= 1;
+    assert(!ast_read(corrupt, buf_len(blob)));
+    free(corrupt);
+    char *outputs[2];
+    for (int i = 0; i < 2; i++) {
+        if (i == 1) {
+            declset = ast_read(blob, buf_len(blob));
+            assert(declset);
+        }
+        reset_global_syms();
+        sym_global_decls(declset);
+        finalize_syms();
+        gen_all();
+        outputs[i] = gen_buf;
+        gen_buf = NULL;
+    }
+    assert(buf_len(outputs[0]) == buf_len(outputs[1]));
+    assert(memcmp(outputs[0], outputs[1], buf_len(outputs[0])) == 0);
+    assert(!ast_read(blob, buf_len(blob) - 1));
+    buf_free(outputs[0]);
+    buf_free(outputs[1]);
+    buf_free(blob);
+}
+
+void vm_test(void) {
+    init_keywords();
+    init_builtins();
+    init_stream("vm.ion",
+        "struct V { x, y: int; }\n"
+        "enum E { E0, E1, E2 }\n"
+        "const HALF = 0.5;\n"
+        "var squares: int[5] = {[2] = 4, 9, 16};\n"
+        "var origin = V{1, 2};\n"
+        "typedef Op = func(int, int): int;\n"
+        "func add(a: int, b: int): int { return a + b; }\n"
+        "func mul(a: int, b: int): int { return a * b; }\n"
+        "func apply(op: Op, a: int, b: int): int { return op(a, b); }\n"
+        "func fact(n: int): int { return n <= 1 ? 1 : n * fact(n - 1); }\n"
+        "func swap(v: V): V { return {v.y, v.x}; }\n"
+        "func sum(n: int): llong {\n"
+        "    s: llong = 0;\n"
+        "    for (i := 0; i < n; i++) { if (i % 3 == 0) { continue; } s += i; }\n"
+        "    do { s++; } while (0);\n"
+        "    return s;\n"
+        "}\n"
+        "func name_len(e: E): int {\n"
+        "    switch (e) { case E0: return 2; case E1, E2: return 4; default: return -1; }\n"
+        "    return 0;\n"
+        "}\n"
+        "func bits(x: uint): int { n := 0; while (x) { n += x & 1; x >>= 1; } return n; }\n"
+        "func set(p: int*, value: int) { *p = value; }\n"
+        "func fields(): int {\n"
+        "    v := swap(origin);\n"
+        "    p := &v;\n"
+        "    n := 0;\n"
+        "    set(&n, p.x * 10 + v.y);\n"
+        "    a: int[4] = {1, 2, 3, 4};\n"
+        "    q := a + 1;\n"
+        "    return n + q[2] + squares[3] + (:int)(&a[3] - &a[0]) + V{y = 7}.y;\n"
+        "}\n"
+        "func floats(x: float): float { return x * HALF + 3 / 2.0d; }\n"
+        "func wrap(c: uchar): int { c += 200; return c; }\n");
+    DeclSet *declset = parse_file();
+    reset_global_syms();
+    sym_global_decls(declset);
+    finalize_syms();
+    VmValue args[3] = {0};
+    args[0].p = vm_func(map_get(&global_syms_map, (void *)str_intern("mul")));
+    args[1].i = 6;
+    args[2].i = 7;
+    assert(vm_call(vm_func(map_get(&global_syms_map, (void *)str_intern("apply"))), args, 3).i == 42);
+    args[0].i = 10;
+    assert(vm_call(vm_func(map_get(&global_syms_map, (void *)str_intern("fact"))), args, 1).i == 3628800);
+    assert(vm_call(vm_func(map_get(&global_syms_map, (void *)str_intern("sum"))), args, 1).i == 28);
+    args[0].i = 2;
+    assert(vm_call(vm_func(map_get(&global_syms_map, (void *)str_intern("name_len"))), args, 1).i == 4);
+    args[0].u = 0xF0F0;
+    assert(vm_call(vm_func(map_get(&global_syms_map, (void *)str_intern("bits"))), args, 1).i == 8);
+    assert(vm_call(vm_func(map_get(&global_syms_map, (void *)str_intern("fields"))), NULL, 0).i == 21 + 4 + 9 + 3 + 7);
+    args[0].f = 3.0f;
+    assert(vm_call(vm_func(map_get(&global_syms_map, (void *)str_intern("floats"))), args, 1).f == 3.0f);
+    args[0].u = 100;
+    assert(vm_call(vm_func(map_get(&global_syms_map, (void *)str_intern("wrap"))), args, 1).i == 44);
+}
+
+void eval_test(void) {
+    init_keywords();
+    init_builtins();
+    init_stream("eval.ion",
+        "@foreign func abs(x: int): int { return 0; }\n"
+        "func square(x: int): int { return x * x; }\n"
+        "func fill(n: int): Table { t: Table; for (i := 0; i < n; i++) { t.vals[i] = square(i) - 1; } return t; }\n"
+        "struct Table { vals: int[4]; }\n"
+        "const N = square(abs(-2));\n"
+        "const HALF = (:float)square(3) / 2;\n"
+        "var table = fill(N);\n"
+        "var sizes: int[N] = {[N - 1] = square(N)};\n"
+        "var f: func(int): int = square;\n");
+    DeclSet *declset = parse_file();
+    reset_global_syms();
+    sym_global_decls(declset);
+    finalize_syms();
+    Sym *n = map_get(&global_syms_map, (void *)str_intern("N"));
+    assert(n->val.i == 4);
+    Sym *table = map_get(&global_syms_map, (void *)str_intern("table"));
+    assert(((int *)table->init_val)[0] == -1 && ((int *)table->init_val)[3] == 8);
+    gen_all();
+    assert(strstr(gen_buf, "#define N (4)"));
+    assert(strstr(gen_buf, "#define HALF (4.5f)"));
+    assert(strstr(gen_buf, "Table table = {{-1, 0, 3, 8}};"));
+    assert(strstr(gen_buf, "int (sizes[N]) = {0, 0, 0, 16};"));
+    assert(strstr(gen_buf, "int (*f)(int) = square;"));
+    buf_free(gen_buf);
+    gen_buf = NULL;
+}
+
+// With the cache, a change to the body of a function called at compile time
+// regenerates the functions that use the value, and only those.
+void eval_cache_test(void) {
+    init_keywords();
+    init_builtins();
+    const char *sources[2] = {
+        "func square(x: int): int { return x * x; }\n"
+        "const N = square(2);\n"
+        "var sizes: int[N];\n"
+        "func user(): int { p := &sizes; return sizeof(*p); }\n"
+        "func other(): int { return 1; }\n",
+        "func square(x: int): int { return x * x * x; }\n"
+        "const N = square(2);\n"
+        "var sizes: int[N];\n"
+        "func user(): int { p := &sizes; return sizeof(*p); }\n"
+        "func other(): int { return 1; }\n",
+    };
+    cache_enabled = true;
+    cache_in_memory = true;
+    resolve_deps_enabled = true;
+    for (int i = 0; i < 2; i++) {
+        init_stream(NULL, sources[i]);
+        DeclSet *declset = parse_file();
+        reset_global_syms();
+        sym_global_decls(declset);
+        finalize_global_syms();
+        stats = (Stats){0};
+        cache_reuse_funcs();
+        resolve_func_bodies();
+        gen_all();
+        assert(strstr(gen_buf, i == 0 ? "int ((*p)[4])" : "int ((*p)[8])"));
+        buf_free(gen_buf);
+        gen_buf = NULL;
+        cache_keep_funcs();
+    }
+    assert(stats.num_cache_hits == 1 && stats.num_cache_misses == 2);
+    cache_enabled = false;
+    cache_in_memory = false;
+    resolve_deps_enabled = false;
+}
+
 void main_test(void) {
     // common_test();
     // lex_test();
     // print_test();
     // parse_test();
     resolve_test();
+    // recompile_test();
+    // ast_blob_test();
+    // vm_test();
+    // eval_test();
+    // eval_cache_test();
     // ion_test();
 }
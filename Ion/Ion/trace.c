@@ -0,0 +1,102 @@
+// Chrome trace event output, viewable in chrome://tracing or Perfetto.
+
+typedef struct TraceEvent {
+    const char* name;
+    const char* arg;
+    double start;
+    double end;
+    int tid;
+} TraceEvent;
+
+// Events from all threads go into one buffer under trace_mutex; each thread keeps its
+// own stack of open events and is numbered the first time it traces.
+bool trace_enabled;
+TraceEvent* trace_events;
+THREAD_LOCAL size_t* trace_stack;
+THREAD_LOCAL int trace_tid;
+int trace_num_threads;
+Mutex trace_mutex = MUTEX_INIT;
+double trace_start_time;
+
+void trace_init(void)
+{
+    trace_enabled = true;
+    trace_start_time = get_time();
+}
+
+void trace_begin(const char* name, const char* arg)
+{
+    mutex_lock(&trace_mutex);
+    if (!trace_tid)
+    {
+        trace_tid = ++trace_num_threads;
+    }
+    buf_push(trace_stack, buf_len(trace_events));
+    buf_push(trace_events, (TraceEvent) { name, arg, get_time(), 0, trace_tid });
+    mutex_unlock(&trace_mutex);
+}
+
+void trace_end(void)
+{
+    assert(buf_len(trace_stack) != 0);
+    size_t index = trace_stack[--buf__hdr(trace_stack)->len];
+    double end = get_time();
+    mutex_lock(&trace_mutex);
+    trace_events[index].end = end;
+    mutex_unlock(&trace_mutex);
+}
+
+#define TRACE_BEGIN(name, arg) (trace_enabled ? trace_begin((name), (arg)) : (void)0)
+#define TRACE_END() (trace_enabled ? trace_end() : (void)0)
+
+void trace_write_str(FILE* file, const char* str)
+{
+    fputc('"', file);
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+        {
+            fputc('\\', file);
+            fputc(*str, file);
+        }
+        else if ((unsigned char)*str < 0x20)
+        {
+            fprintf(file, "\\u%04x", *str);
+        }
+        else
+        {
+            fputc(*str, file);
+        }
+    }
+    fputc('"', file);
+}
+
+bool trace_write(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+    {
+        return false;
+    }
+    fprintf(file, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < buf_len(trace_events); i++)
+    {
+        TraceEvent event = trace_events[i];
+        double ts = (event.start - trace_start_time) * 1e6;
+        double dur = (event.end - event.start) * 1e6;
+        fprintf(file, "{\"name\":");
+        trace_write_str(file, event.name);
+        fprintf(file, ",\"cat\":\"ion\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", event.tid, ts, dur);
+        if (event.arg)
+        {
+            fprintf(file, ",\"args\":{\"name\":");
+            trace_write_str(file, event.arg);
+            fprintf(file, "}");
+        }
+        fprintf(file, "}%s\n", i + 1 < buf_len(trace_events) ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
@@ -44,6 +44,9 @@ struct Type
     Sym* sym;
     Type* base;
     bool nonmodifiable;
+    // Set if the type involves a declared struct, union or enum, which ties it to the
+    // syms of one compile; see prune_type_caches.
+    bool declared;
     union
     {
         size_t num_elems;
@@ -62,10 +65,23 @@ struct Type
 
 void complete_type(Type* type);
 
-Type* type_alloc(TypeKind kind)
+// Declared types and whatever the type caches hold for them come from here, so that
+// watch mode can free a compile's worth at once. Outside of the main thread it is only
+// used with the type cache lock held.
+Arena declared_type_arena;
+
+void* declared_type_alloc(bool declared, size_t size)
+{
+    return declared ? arena_alloc(&declared_type_arena, size) : xmalloc(size);
+}
+
+Type* type_alloc(TypeKind kind, bool declared)
 {
-    Type* t = xcalloc(1, sizeof(Type));
+    Type* t = declared_type_alloc(declared, sizeof(Type));
+    memset(t, 0, sizeof(Type));
     t->kind = kind;
+    t->declared = declared;
+    stats.num_types++;
     return t;
 }
 
@@ -164,7 +180,7 @@ const char* type_names[NUM_TYPE_KINDS] = {
     [TYPE_DOUBLE] = "double",
 };
 
-bool type_ranks[NUM_TYPE_KINDS] = {
+int type_ranks[NUM_TYPE_KINDS] = {
     [TYPE_BOOL] = 1,
     [TYPE_CHAR] = 2,
     [TYPE_SCHAR] = 2,
@@ -227,19 +243,42 @@ size_t type_alignof(Type* type)
     return type->align;
 }
 
+// Set while function bodies are resolved in parallel. By then every aggregate is
+// complete, so the cached constructors below never recurse while holding the lock.
+bool type_cache_lock_enabled;
+Mutex type_cache_mutex = MUTEX_INIT;
+
+void type_cache_lock(void)
+{
+    if (type_cache_lock_enabled)
+    {
+        mutex_lock(&type_cache_mutex);
+    }
+}
+
+void type_cache_unlock(void)
+{
+    if (type_cache_lock_enabled)
+    {
+        mutex_unlock(&type_cache_mutex);
+    }
+}
+
 Map cached_ptr_types;
 
 Type* type_ptr(Type* base)
 {
+    type_cache_lock();
     Type* type = map_get(&cached_ptr_types, base);
     if (!type)
     {
-        type = type_alloc(TYPE_PTR);
+        type = type_alloc(TYPE_PTR, base->declared);
         type->size = PTR_SIZE;
         type->align = PTR_ALIGN;
         type->base = base;
         map_put(&cached_ptr_types, base, type);
     }
+    type_cache_unlock();
     return type;
 }
 
@@ -251,17 +290,19 @@ Type* type_const(Type* base)
     {
         return base;
     }
+    type_cache_lock();
     Type* type = map_get(&cached_const_types, base);
     if (!type)
     {
         complete_type(base);
-        type = type_alloc(TYPE_CONST);
+        type = type_alloc(TYPE_CONST, base->declared);
         type->nonmodifiable = true;
         type->size = base->size;
         type->align = base->align;
         type->base = base;
         map_put(&cached_const_types, base, type);
     }
+    type_cache_unlock();
     return type;
 }
 
@@ -281,27 +322,37 @@ typedef struct CachedArrayType {
     Type* elem;
     size_t num_elems;
     Type* array;
+    struct CachedArrayType* next;
 } CachedArrayType;
 
-CachedArrayType* cached_array_types;
+// Keyed on a hash of (elem, num_elems), with colliding entries chained like interns.
+Map cached_array_types;
 
 Type* type_array(Type* elem, size_t num_elems)
 {
-    for (CachedArrayType* it = cached_array_types; it != buf_end(cached_array_types); it++)
+    uint64_t hash = hash_mix(hash_ptr(elem), hash_uint64(num_elems));
+    void* key = (void*)(uintptr_t)(hash ? hash : 1);
+    type_cache_lock();
+    for (CachedArrayType* it = map_get(&cached_array_types, key); it; it = it->next)
     {
         if (it->elem == elem && it->num_elems == num_elems)
         {
+            type_cache_unlock();
             return it->array;
         }
     }
     complete_type(elem);
-    Type* type = type_alloc(TYPE_ARRAY);
+    Type* type = type_alloc(TYPE_ARRAY, elem->declared);
     type->nonmodifiable = elem->nonmodifiable;
     type->size = num_elems * type_sizeof(elem);
     type->align = type_alignof(elem);
     type->base = elem;
     type->num_elems = num_elems;
-    buf_push(cached_array_types, (CachedArrayType) { elem, num_elems, type });
+    CachedArrayType* new_cached = declared_type_alloc(type->declared, sizeof(CachedArrayType));
+    // complete_type may have cached other arrays under this key, so re-read the chain head.
+    *new_cached = (CachedArrayType) { elem, num_elems, type, map_get(&cached_array_types, key) };
+    map_put(&cached_array_types, key, new_cached);
+    type_cache_unlock();
     return type;
 }
 
@@ -311,42 +362,133 @@ typedef struct CachedFuncType {
     bool has_varargs;
     Type* ret;
     Type* func;
+    struct CachedFuncType* next;
 } CachedFuncType;
 
-CachedFuncType* cached_func_types;
+// Keyed on a hash of the signature, with colliding entries chained like interns.
+Map cached_func_types;
 
 Type* type_func(Type** params, size_t num_params, Type* ret, bool has_varargs)
 {
-    for (CachedFuncType* it = cached_func_types; it != buf_end(cached_func_types); it++)
+    uint64_t hash = hash_mix(hash_ptr(ret), hash_uint64(num_params * 2 + has_varargs));
+    for (size_t i = 0; i < num_params; i++)
+    {
+        hash = hash_mix(hash, hash_ptr(params[i]));
+    }
+    void* key = (void*)(uintptr_t)(hash ? hash : 1);
+    type_cache_lock();
+    CachedFuncType* cached = map_get(&cached_func_types, key);
+    for (CachedFuncType* it = cached; it; it = it->next)
     {
-        if (it->num_params == num_params && it->ret == ret && it->has_varargs == has_varargs)
+        if (it->num_params == num_params && it->ret == ret && it->has_varargs == has_varargs &&
+            (num_params == 0 || memcmp(it->params, params, num_params * sizeof(*params)) == 0))
         {
-            bool match = true;
-            for (size_t i = 0; i < num_params; i++)
-            {
-                if (it->params[i] != params[i])
-                {
-                    match = false;
-                    break;
-                }
-            }
-            if (match)
-            {
-                return it->func;
-            }
+            type_cache_unlock();
+            return it->func;
         }
     }
-    Type* type = type_alloc(TYPE_FUNC);
+    bool declared = ret->declared;
+    for (size_t i = 0; i < num_params; i++)
+    {
+        declared |= params[i]->declared;
+    }
+    Type* type = type_alloc(TYPE_FUNC, declared);
     type->size = PTR_SIZE;
     type->align = PTR_ALIGN;
-    type->func.params = memdup(params, num_params * sizeof(*params));
+    type->func.params = declared_type_alloc(declared, num_params * sizeof(*params));
+    memcpy(type->func.params, params, num_params * sizeof(*params));
     type->func.num_params = num_params;
     type->func.has_varargs = has_varargs;
     type->func.ret = ret;
-    buf_push(cached_func_types, (CachedFuncType) { params, num_params, has_varargs, ret, type });
+    CachedFuncType* new_cached = declared_type_alloc(declared, sizeof(CachedFuncType));
+    *new_cached = (CachedFuncType) { type->func.params, num_params, has_varargs, ret, type, cached };
+    map_put(&cached_func_types, key, new_cached);
+    type_cache_unlock();
     return type;
 }
 
+Map prune_type_map(Map* map)
+{
+    Map pruned = { 0 };
+    for (size_t i = 0; i < map->cap; i++)
+    {
+        if (map->keys[i] && !((Type*)map->vals[i])->declared)
+        {
+            map_put(&pruned, map->keys[i], map->vals[i]);
+        }
+    }
+    free(map->keys);
+    free(map->vals);
+    return pruned;
+}
+
+// Drops the cached types that involve declared types and frees them along with the
+// declared types themselves, before the syms of one compile are freed. Types built from
+// builtin types alone stay cached for the next compile.
+void prune_type_caches(void)
+{
+    cached_ptr_types = prune_type_map(&cached_ptr_types);
+    cached_const_types = prune_type_map(&cached_const_types);
+
+    // A chain can hold both kinds of entry, so the kept ones are linked up again.
+    Map array_types = { 0 };
+    for (size_t i = 0; i < cached_array_types.cap; i++)
+    {
+        if (!cached_array_types.keys[i])
+        {
+            continue;
+        }
+        CachedArrayType* kept = NULL;
+        CachedArrayType** tail = &kept;
+        for (CachedArrayType* it = cached_array_types.vals[i]; it; it = it->next)
+        {
+            if (!it->array->declared)
+            {
+                *tail = it;
+                tail = &it->next;
+            }
+        }
+        *tail = NULL;
+        if (kept)
+        {
+            map_put(&array_types, cached_array_types.keys[i], kept);
+        }
+    }
+    free(cached_array_types.keys);
+    free(cached_array_types.vals);
+    cached_array_types = array_types;
+
+    Map func_types = { 0 };
+    for (size_t i = 0; i < cached_func_types.cap; i++)
+    {
+        if (!cached_func_types.keys[i])
+        {
+            continue;
+        }
+        CachedFuncType* kept = NULL;
+        CachedFuncType** tail = &kept;
+        for (CachedFuncType* it = cached_func_types.vals[i]; it; it = it->next)
+        {
+            if (!it->func->declared)
+            {
+                *tail = it;
+                tail = &it->next;
+            }
+        }
+        *tail = NULL;
+        if (kept)
+        {
+            map_put(&func_types, cached_func_types.keys[i], kept);
+        }
+    }
+    free(cached_func_types.keys);
+    free(cached_func_types.vals);
+    cached_func_types = func_types;
+
+    arena_free(&declared_type_arena);
+    declared_type_arena = (Arena) { 0 };
+}
+
 bool has_duplicate_fields(TypeField* fields, size_t num_fields)
 {
     for (size_t i = 0; i < num_fields; i++)
@@ -377,7 +519,8 @@ void type_complete_struct(Type* type, TypeField* fields, size_t num_fields)
         type->align = MAX(type->align, type_alignof(it->type));
         nonmodifiable = it->type->nonmodifiable || nonmodifiable;
     }
-    type->aggregate.fields = memdup(fields, num_fields * sizeof(*fields));
+    type->aggregate.fields = declared_type_alloc(true, num_fields * sizeof(*fields));
+    memcpy(type->aggregate.fields, fields, num_fields * sizeof(*fields));
     type->aggregate.num_fields = num_fields;
     type->nonmodifiable = nonmodifiable;
 }
@@ -397,21 +540,22 @@ void type_complete_union(Type* type, TypeField* fields, size_t num_fields)
         type->align = MAX(type->align, type_alignof(it->type));
         nonmodifiable = it->type->nonmodifiable || nonmodifiable;
     }
-    type->aggregate.fields = memdup(fields, num_fields * sizeof(*fields));
+    type->aggregate.fields = declared_type_alloc(true, num_fields * sizeof(*fields));
+    memcpy(type->aggregate.fields, fields, num_fields * sizeof(*fields));
     type->aggregate.num_fields = num_fields;
     type->nonmodifiable = nonmodifiable;
 }
 
 Type* type_incomplete(Sym* sym)
 {
-    Type* type = type_alloc(TYPE_INCOMPLETE);
+    Type* type = type_alloc(TYPE_INCOMPLETE, true);
     type->sym = sym;
     return type;
 }
 
 Type* type_enum(Sym* sym)
 {
-    Type* type = type_alloc(TYPE_ENUM);
+    Type* type = type_alloc(TYPE_ENUM, true);
     type->sym = sym;
     type->size = type_int->size;
     type->align = type_int->align;
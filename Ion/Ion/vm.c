@@ -0,0 +1,2413 @@
+// Bytecode interpreter. Resolved functions are compiled on their first call into code
+// for a register machine and run in-process, so that a program can be run without a C
+// compiler. Each call has a window of 64-bit registers, which hold scalars and the
+// addresses of aggregates, and a block of frame memory for aggregates and for locals
+// whose address is taken. Memory uses the type checker's layout, and foreign functions
+// are provided by the natives table at the end of the file.
+//
+// Registers hold integers sign- or zero-extended from their type, so that they can be
+// compared and converted to wider types without extra instructions. Floats and doubles
+// are held in the f and d members, and pointers and function values in u.
+
+typedef union VmValue {
+    int64_t i;
+    uint64_t u;
+    float f;
+    double d;
+    void* p;
+} VmValue;
+
+#define VM_OPS(X) \
+    X(MOV) X(LOADK) X(ADDR_MEM) X(ADDK_I32) X(ADDK_U32) X(ADDK_64) X(INDEX) \
+    X(LOAD_I8) X(LOAD_U8) X(LOAD_I16) X(LOAD_U16) X(LOAD_I32) X(LOAD_U32) X(LOAD_64) X(LOAD_F32) X(LOAD_F64) \
+    X(STORE_8) X(STORE_16) X(STORE_32) X(STORE_64) X(STORE_F32) X(STORE_F64) X(COPY) X(ZERO) \
+    X(ADD_I32) X(ADD_U32) X(ADD_64) X(ADD_F32) X(ADD_F64) \
+    X(SUB_I32) X(SUB_U32) X(SUB_64) X(SUB_F32) X(SUB_F64) \
+    X(MUL_I32) X(MUL_U32) X(MUL_64) X(MUL_F32) X(MUL_F64) \
+    X(DIV_I) X(DIV_U) X(DIV_F32) X(DIV_F64) X(MOD_I) X(MOD_U) \
+    X(AND) X(OR) X(XOR) X(SHL_I32) X(SHL_U32) X(SHL_64) X(SHR_I) X(SHR_U) \
+    X(NEG_I32) X(NEG_U32) X(NEG_64) X(NEG_F32) X(NEG_F64) X(NOT_64) X(NOT_U32) \
+    X(EQ) X(NE) X(LT_I) X(LE_I) X(LT_U) X(LE_U) \
+    X(EQ_F32) X(NE_F32) X(LT_F32) X(LE_F32) X(EQ_F64) X(NE_F64) X(LT_F64) X(LE_F64) \
+    X(SEXT8) X(ZEXT8) X(SEXT16) X(ZEXT16) X(SEXT32) X(ZEXT32) X(TO_BOOL) X(F32_NZ) X(F64_NZ) \
+    X(I2F32) X(U2F32) X(I2F64) X(U2F64) X(F32_2I) X(F32_2U) X(F64_2I) X(F64_2U) X(F32_2F64) X(F64_2F32) \
+    X(JMP) X(JZ) X(JNZ) X(JEQ) X(JNE) X(JLT_I) X(JLE_I) X(JLT_U) X(JLE_U) \
+    X(CALL) X(CALL_REG) X(RET) X(RET_VOID) X(RET_AGG)
+
+typedef enum VmOp {
+#define VM_OP_ENUM(name) VM_##name,
+    VM_OPS(VM_OP_ENUM)
+#undef VM_OP_ENUM
+    NUM_VM_OPS,
+} VmOp;
+
+// Operands a, b and c are registers, except that c is the argument count of a call.
+// imm holds constants, memory offsets, element sizes and jump targets.
+typedef struct VmInstr {
+    uint16_t op;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+    int64_t imm;
+} VmInstr;
+
+typedef void (*VmNative)(VmValue* args, size_t num_args, VmValue* ret);
+
+typedef struct VmFunc {
+    Sym* sym;
+    VmNative native;
+    // Set for natives with no effect outside the memory they are passed, which are the
+    // only ones that can be called at compile time.
+    bool pure;
+    // NULL until the function is first called.
+    VmInstr* code;
+    // Source line of each instruction, for runtime errors.
+    int* lines;
+    size_t num_regs;
+    size_t mem_size;
+} VmFunc;
+
+VmNative vm_find_native(const char* name, bool* pure);
+
+Map vm_funcs;
+Map vm_globals;
+Sym** vm_pending_globals;
+
+VmFunc* vm_func(Sym* sym)
+{
+    VmFunc* func = map_get(&vm_funcs, sym);
+    if (!func)
+    {
+        func = xcalloc(1, sizeof(VmFunc));
+        func->sym = sym;
+        if (is_decl_foreign(sym->decl))
+        {
+            func->native = vm_find_native(sym->name, &func->pure);
+        }
+        map_put(&vm_funcs, sym, func);
+    }
+    return func;
+}
+
+Sym* vm_func_sym(void* func)
+{
+    return ((VmFunc*)func)->sym;
+}
+
+// Globals are allocated when first referenced, and their initializers are run before
+// the code that referenced them; see vm_init_globals. Those evaluated at compile time
+// start with their value.
+void* vm_global(Sym* sym)
+{
+    void* addr = map_get(&vm_globals, sym);
+    if (!addr)
+    {
+        addr = xcalloc(1, type_sizeof(sym->type));
+        map_put(&vm_globals, sym, addr);
+        if (sym->init_val)
+        {
+            memcpy(addr, sym->init_val, type_sizeof(sym->type));
+        }
+        else if (sym->decl && sym->decl->var.expr)
+        {
+            buf_push(vm_pending_globals, sym);
+        }
+    }
+    return addr;
+}
+
+typedef enum VmRep {
+    VM_REP_VOID,
+    VM_REP_I8,
+    VM_REP_U8,
+    VM_REP_I16,
+    VM_REP_U16,
+    VM_REP_I32,
+    VM_REP_U32,
+    VM_REP_I64,
+    VM_REP_U64,
+    VM_REP_F32,
+    VM_REP_F64,
+    VM_REP_AGG,
+} VmRep;
+
+VmRep vm_rep(Type* type)
+{
+    type = unqualify_type(type);
+    switch (type->kind)
+    {
+        case TYPE_VOID:
+            return VM_REP_VOID;
+        case TYPE_BOOL:
+        case TYPE_UCHAR:
+            return VM_REP_U8;
+        case TYPE_CHAR:
+            // Generated C uses the host's char, so the interpreter does too.
+            return CHAR_MIN < 0 ? VM_REP_I8 : VM_REP_U8;
+        case TYPE_SCHAR:
+            return VM_REP_I8;
+        case TYPE_SHORT:
+            return VM_REP_I16;
+        case TYPE_USHORT:
+            return VM_REP_U16;
+        case TYPE_INT:
+        case TYPE_ENUM:
+            return VM_REP_I32;
+        case TYPE_UINT:
+            return VM_REP_U32;
+        case TYPE_LONG:
+        case TYPE_LLONG:
+            return type->size == 4 ? VM_REP_I32 : VM_REP_I64;
+        case TYPE_ULONG:
+        case TYPE_ULLONG:
+            return type->size == 4 ? VM_REP_U32 : VM_REP_U64;
+        case TYPE_FLOAT:
+            return VM_REP_F32;
+        case TYPE_DOUBLE:
+            return VM_REP_F64;
+        case TYPE_PTR:
+        case TYPE_FUNC:
+            return VM_REP_U64;
+        default:
+            return VM_REP_AGG;
+    }
+}
+
+bool vm_is_signed_rep(VmRep rep)
+{
+    return rep == VM_REP_I8 || rep == VM_REP_I16 || rep == VM_REP_I32 || rep == VM_REP_I64;
+}
+
+size_t vm_rep_size(VmRep rep)
+{
+    switch (rep)
+    {
+        case VM_REP_I8:
+        case VM_REP_U8:
+            return 1;
+        case VM_REP_I16:
+        case VM_REP_U16:
+            return 2;
+        case VM_REP_I32:
+        case VM_REP_U32:
+        case VM_REP_F32:
+            return 4;
+        default:
+            return 8;
+    }
+}
+
+uint64_t vm_normalize(VmRep rep, uint64_t val)
+{
+    switch (rep)
+    {
+        case VM_REP_I8:
+            return (uint64_t)(int64_t)(int8_t)val;
+        case VM_REP_U8:
+            return (uint8_t)val;
+        case VM_REP_I16:
+            return (uint64_t)(int64_t)(int16_t)val;
+        case VM_REP_U16:
+            return (uint16_t)val;
+        case VM_REP_I32:
+            return (uint64_t)(int64_t)(int32_t)val;
+        case VM_REP_U32:
+            return (uint32_t)val;
+        default:
+            return val;
+    }
+}
+
+VmOp vm_load_ops[] = {
+    [VM_REP_I8] = VM_LOAD_I8,
+    [VM_REP_U8] = VM_LOAD_U8,
+    [VM_REP_I16] = VM_LOAD_I16,
+    [VM_REP_U16] = VM_LOAD_U16,
+    [VM_REP_I32] = VM_LOAD_I32,
+    [VM_REP_U32] = VM_LOAD_U32,
+    [VM_REP_I64] = VM_LOAD_64,
+    [VM_REP_U64] = VM_LOAD_64,
+    [VM_REP_F32] = VM_LOAD_F32,
+    [VM_REP_F64] = VM_LOAD_F64,
+};
+
+VmOp vm_store_ops[] = {
+    [VM_REP_I8] = VM_STORE_8,
+    [VM_REP_U8] = VM_STORE_8,
+    [VM_REP_I16] = VM_STORE_16,
+    [VM_REP_U16] = VM_STORE_16,
+    [VM_REP_I32] = VM_STORE_32,
+    [VM_REP_U32] = VM_STORE_32,
+    [VM_REP_I64] = VM_STORE_64,
+    [VM_REP_U64] = VM_STORE_64,
+    [VM_REP_F32] = VM_STORE_F32,
+    [VM_REP_F64] = VM_STORE_F64,
+};
+
+VmOp vm_ext_ops[] = {
+    [VM_REP_I8] = VM_SEXT8,
+    [VM_REP_U8] = VM_ZEXT8,
+    [VM_REP_I16] = VM_SEXT16,
+    [VM_REP_U16] = VM_ZEXT16,
+    [VM_REP_I32] = VM_SEXT32,
+    [VM_REP_U32] = VM_ZEXT32,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Compiler
+//
+
+typedef struct VmLocal {
+    const char* name;
+    Type* type;
+    bool in_reg;
+    uint16_t reg;
+    size_t offset;
+} VmLocal;
+
+// A place that is read or written: a register, or memory at the address held in a
+// register plus a constant offset.
+typedef struct VmLvalue {
+    Type* type;
+    bool in_reg;
+    uint16_t reg;
+    int64_t offset;
+} VmLvalue;
+
+typedef struct VmLoop {
+    size_t* breaks;
+    size_t* continues;
+    bool is_switch;
+} VmLoop;
+
+typedef struct VmScope {
+    size_t num_locals;
+    size_t num_regs;
+    size_t mem_size;
+} VmScope;
+
+VmInstr* vm_code;
+int* vm_lines;
+SrcPos vm_pos;
+VmLocal* vm_locals;
+// Locals below this are hidden while a global's expression is compiled inline.
+size_t vm_locals_base;
+const char** vm_addressed_names;
+size_t vm_num_regs;
+size_t vm_max_regs;
+// Registers from here up are temporaries of the current statement.
+size_t vm_stmt_regs;
+size_t vm_mem_size;
+size_t vm_max_mem;
+// Instructions before a jump target are not rewritten by vm_retarget.
+size_t vm_label_pc;
+VmLoop* vm_loops;
+Type* vm_ret_type;
+
+void vm_begin_code(SrcPos pos)
+{
+    vm_code = NULL;
+    vm_lines = NULL;
+    vm_pos = pos;
+    buf_clear(vm_locals);
+    vm_locals_base = 0;
+    buf_clear(vm_addressed_names);
+    buf_clear(vm_loops);
+    vm_num_regs = 0;
+    vm_max_regs = 0;
+    vm_stmt_regs = 0;
+    vm_mem_size = 0;
+    vm_max_mem = 0;
+    vm_label_pc = 0;
+}
+
+void vm_end_code(VmFunc* func)
+{
+    func->code = vm_code;
+    func->lines = vm_lines;
+    func->num_regs = vm_max_regs;
+    func->mem_size = ALIGN_UP(vm_max_mem, 16);
+    vm_code = NULL;
+    vm_lines = NULL;
+}
+
+size_t vm_emit(VmOp op, size_t a, size_t b, size_t c, int64_t imm)
+{
+    buf_push(vm_code, (VmInstr){ (uint16_t)op, (uint16_t)a, (uint16_t)b, (uint16_t)c, imm });
+    buf_push(vm_lines, vm_pos.line);
+    return buf_len(vm_code) - 1;
+}
+
+uint16_t vm_reg(void)
+{
+    if (vm_num_regs >= UINT16_MAX)
+    {
+        fatal_error(vm_pos, "Function needs too many registers for the interpreter");
+    }
+    vm_num_regs++;
+    vm_max_regs = MAX(vm_max_regs, vm_num_regs);
+    return (uint16_t)(vm_num_regs - 1);
+}
+
+void vm_free_regs(size_t num_regs)
+{
+    vm_num_regs = num_regs;
+}
+
+size_t vm_alloc_mem(Type* type)
+{
+    size_t offset = ALIGN_UP(vm_mem_size, type_alignof(type));
+    vm_mem_size = offset + type_sizeof(type);
+    vm_max_mem = MAX(vm_max_mem, vm_mem_size);
+    return offset;
+}
+
+size_t vm_here(void)
+{
+    vm_label_pc = buf_len(vm_code);
+    return vm_label_pc;
+}
+
+void vm_patch(size_t* jumps, size_t target)
+{
+    for (size_t i = 0; i < buf_len(jumps); i++)
+    {
+        vm_code[jumps[i]].imm = target;
+    }
+}
+
+void vm_label(size_t** jumps)
+{
+    vm_patch(*jumps, vm_here());
+    buf_free(*jumps);
+}
+
+// Redirects the result of the last instruction from the temporary reg to dst, which
+// saves a move when a value is computed for a local or an argument.
+bool vm_retarget(uint16_t reg, uint16_t dst)
+{
+    size_t pc = buf_len(vm_code);
+    if (reg < vm_stmt_regs || pc == vm_label_pc || vm_code[pc - 1].a != reg)
+    {
+        return false;
+    }
+    switch (vm_code[pc - 1].op)
+    {
+        case VM_STORE_8:
+        case VM_STORE_16:
+        case VM_STORE_32:
+        case VM_STORE_64:
+        case VM_STORE_F32:
+        case VM_STORE_F64:
+        case VM_COPY:
+        case VM_ZERO:
+        case VM_JMP:
+        case VM_JZ:
+        case VM_JNZ:
+        case VM_JEQ:
+        case VM_JNE:
+        case VM_JLT_I:
+        case VM_JLE_I:
+        case VM_JLT_U:
+        case VM_JLE_U:
+        case VM_RET:
+        case VM_RET_VOID:
+        case VM_RET_AGG:
+            return false;
+        default:
+            vm_code[pc - 1].a = dst;
+            return true;
+    }
+}
+
+void vm_move(uint16_t dst, uint16_t src)
+{
+    if (src != dst && !vm_retarget(src, dst))
+    {
+        vm_emit(VM_MOV, dst, src, 0, 0);
+    }
+}
+
+uint16_t vm_gen_const(uint64_t val)
+{
+    uint16_t dst = vm_reg();
+    vm_emit(VM_LOADK, dst, 0, 0, (int64_t)val);
+    return dst;
+}
+
+VmScope vm_enter(void)
+{
+    return (VmScope){ buf_len(vm_locals), vm_num_regs, vm_mem_size };
+}
+
+void vm_leave(VmScope scope)
+{
+    if (vm_locals)
+    {
+        buf__hdr(vm_locals)->len = scope.num_locals;
+    }
+    vm_num_regs = scope.num_regs;
+    vm_stmt_regs = scope.num_regs;
+    vm_mem_size = scope.mem_size;
+}
+
+VmLocal* vm_local(const char* name)
+{
+    for (size_t i = buf_len(vm_locals); i > vm_locals_base; i--)
+    {
+        if (vm_locals[i - 1].name == name)
+        {
+            return &vm_locals[i - 1];
+        }
+    }
+    return NULL;
+}
+
+Sym* vm_global_sym(const char* name)
+{
+    Sym* sym = map_get(&global_syms_map, (void*)name);
+    assert(sym);
+    return sym;
+}
+
+// Locals are kept in registers unless their address is taken.
+void vm_scan_expr(Expr* expr);
+
+void vm_scan_exprs(Expr** exprs, size_t num_exprs)
+{
+    for (size_t i = 0; i < num_exprs; i++)
+    {
+        vm_scan_expr(exprs[i]);
+    }
+}
+
+void vm_scan_expr(Expr* expr)
+{
+    if (!expr)
+    {
+        return;
+    }
+    switch (expr->kind)
+    {
+        case EXPR_CAST:
+            vm_scan_expr(expr->cast.expr);
+            break;
+        case EXPR_CALL:
+            vm_scan_expr(expr->call.expr);
+            vm_scan_exprs(expr->call.args, expr->call.num_args);
+            break;
+        case EXPR_INDEX:
+            vm_scan_expr(expr->index.expr);
+            vm_scan_expr(expr->index.index);
+            break;
+        case EXPR_FIELD:
+            vm_scan_expr(expr->field.expr);
+            break;
+        case EXPR_COMPOUND:
+            for (size_t i = 0; i < expr->compound.num_fields; i++)
+            {
+                vm_scan_expr(expr->compound.fields[i].init);
+            }
+            break;
+        case EXPR_UNARY:
+            if (expr->unary.op == TOKEN_AND && expr->unary.expr->kind == EXPR_NAME)
+            {
+                buf_push(vm_addressed_names, expr->unary.expr->name);
+            }
+            vm_scan_expr(expr->unary.expr);
+            break;
+        case EXPR_BINARY:
+            vm_scan_expr(expr->binary.left);
+            vm_scan_expr(expr->binary.right);
+            break;
+        case EXPR_TERNARY:
+            vm_scan_expr(expr->ternary.cond);
+            vm_scan_expr(expr->ternary.if_true);
+            vm_scan_expr(expr->ternary.if_false);
+            break;
+        default:
+            break;
+    }
+}
+
+void vm_scan_stmt(Stmt* stmt);
+
+void vm_scan_block(StmtList block)
+{
+    for (size_t i = 0; i < block.num_stmts; i++)
+    {
+        vm_scan_stmt(block.stmts[i]);
+    }
+}
+
+void vm_scan_stmt(Stmt* stmt)
+{
+    if (!stmt)
+    {
+        return;
+    }
+    switch (stmt->kind)
+    {
+        case STMT_RETURN:
+        case STMT_EXPR:
+            vm_scan_expr(stmt->expr);
+            break;
+        case STMT_BLOCK:
+            vm_scan_block(stmt->block);
+            break;
+        case STMT_IF:
+            vm_scan_expr(stmt->if_stmt.cond);
+            vm_scan_block(stmt->if_stmt.then_block);
+            for (size_t i = 0; i < stmt->if_stmt.num_elseifs; i++)
+            {
+                vm_scan_expr(stmt->if_stmt.elseifs[i].cond);
+                vm_scan_block(stmt->if_stmt.elseifs[i].block);
+            }
+            vm_scan_block(stmt->if_stmt.else_block);
+            break;
+        case STMT_WHILE:
+        case STMT_DO_WHILE:
+            vm_scan_expr(stmt->while_stmt.cond);
+            vm_scan_block(stmt->while_stmt.block);
+            break;
+        case STMT_FOR:
+            vm_scan_stmt(stmt->for_stmt.init);
+            vm_scan_expr(stmt->for_stmt.cond);
+            vm_scan_stmt(stmt->for_stmt.next);
+            vm_scan_block(stmt->for_stmt.block);
+            break;
+        case STMT_SWITCH:
+            vm_scan_expr(stmt->switch_stmt.expr);
+            for (size_t i = 0; i < stmt->switch_stmt.num_cases; i++)
+            {
+                vm_scan_block(stmt->switch_stmt.cases[i].block);
+            }
+            break;
+        case STMT_ASSIGN:
+            vm_scan_expr(stmt->assign.left);
+            vm_scan_expr(stmt->assign.right);
+            break;
+        case STMT_INIT:
+            vm_scan_expr(stmt->init.expr);
+            break;
+        default:
+            break;
+    }
+}
+
+bool vm_is_addressed(const char* name)
+{
+    for (size_t i = 0; i < buf_len(vm_addressed_names); i++)
+    {
+        if (vm_addressed_names[i] == name)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+Type* vm_decay(Type* type)
+{
+    type = unqualify_type(type);
+    if (is_array_type(type))
+    {
+        type = type_ptr(type->base);
+    }
+    return type;
+}
+
+Type* vm_promote_type(Type* type)
+{
+    Operand operand = operand_rvalue(type);
+    promote_operand(&operand);
+    return operand.type;
+}
+
+Type* vm_unify_types(Type* left, Type* right)
+{
+    Operand left_operand = operand_rvalue(left);
+    Operand right_operand = operand_rvalue(right);
+    unify_arithmetic_operands(&left_operand, &right_operand);
+    return left_operand.type;
+}
+
+Type* vm_vararg_type(Type* type)
+{
+    type = vm_decay(type);
+    if (type == type_float)
+    {
+        return type_double;
+    }
+    return is_integer_type(type) ? vm_promote_type(type) : type;
+}
+
+int64_t vm_elem_size(Type* ptr_type)
+{
+    Type* base = unqualify_type(ptr_type->base);
+    return base->size ? (int64_t)base->size : 1;
+}
+
+TypeField* vm_field(Type* type, const char* name)
+{
+    for (size_t i = 0; i < type->aggregate.num_fields; i++)
+    {
+        if (type->aggregate.fields[i].name == name)
+        {
+            return &type->aggregate.fields[i];
+        }
+    }
+    assert(0);
+    return NULL;
+}
+
+bool vm_rep_fits(VmRep src, VmRep dst)
+{
+    size_t src_size = vm_rep_size(src);
+    size_t dst_size = vm_rep_size(dst);
+    if (dst_size == 8)
+    {
+        return true;
+    }
+    else if (src_size < dst_size)
+    {
+        return vm_is_signed_rep(dst) || !vm_is_signed_rep(src);
+    }
+    else
+    {
+        return src_size == dst_size && vm_is_signed_rep(src) == vm_is_signed_rep(dst);
+    }
+}
+
+// Converts a value the way an implicit conversion or cast in C would, returning reg
+// itself when the conversion leaves the register unchanged.
+uint16_t vm_gen_convert(uint16_t reg, Type* from, Type* to)
+{
+    from = vm_decay(from);
+    to = unqualify_type(to);
+    VmRep src = vm_rep(from);
+    VmRep dst = vm_rep(to);
+    VmOp op;
+    if (to->kind == TYPE_BOOL && from->kind != TYPE_BOOL)
+    {
+        op = src == VM_REP_F32 ? VM_F32_NZ : src == VM_REP_F64 ? VM_F64_NZ : VM_TO_BOOL;
+    }
+    else if (src == dst || dst == VM_REP_VOID || dst == VM_REP_AGG || src == VM_REP_AGG)
+    {
+        return reg;
+    }
+    else if (dst == VM_REP_F32 || dst == VM_REP_F64)
+    {
+        if (src == VM_REP_F32)
+        {
+            op = VM_F32_2F64;
+        }
+        else if (src == VM_REP_F64)
+        {
+            op = VM_F64_2F32;
+        }
+        else if (src == VM_REP_U64)
+        {
+            op = dst == VM_REP_F32 ? VM_U2F32 : VM_U2F64;
+        }
+        else
+        {
+            op = dst == VM_REP_F32 ? VM_I2F32 : VM_I2F64;
+        }
+    }
+    else if (src == VM_REP_F32 || src == VM_REP_F64)
+    {
+        if (src == VM_REP_F32)
+        {
+            op = dst == VM_REP_U64 ? VM_F32_2U : VM_F32_2I;
+        }
+        else
+        {
+            op = dst == VM_REP_U64 ? VM_F64_2U : VM_F64_2I;
+        }
+        uint16_t result = vm_reg();
+        vm_emit(op, result, reg, 0, 0);
+        return vm_gen_convert(result, dst == VM_REP_U64 ? type_ullong : type_llong, to);
+    }
+    else if (vm_rep_fits(src, dst))
+    {
+        return reg;
+    }
+    else
+    {
+        op = vm_ext_ops[dst];
+    }
+    uint16_t result = vm_reg();
+    vm_emit(op, result, reg, 0, 0);
+    return result;
+}
+
+uint16_t vm_gen_rvalue(Expr* expr);
+VmLvalue vm_gen_lvalue(Expr* expr);
+void vm_gen_init(uint16_t base, int64_t offset, Type* type, Expr* expr);
+void vm_gen_stmt(Stmt* stmt);
+void vm_gen_block(StmtList block);
+
+uint16_t vm_gen_converted(Expr* expr, Type* type)
+{
+    return vm_gen_convert(vm_gen_rvalue(expr), expr->type, type);
+}
+
+uint16_t vm_gen_addr(VmLvalue lvalue)
+{
+    assert(!lvalue.in_reg);
+    if (lvalue.offset == 0)
+    {
+        return lvalue.reg;
+    }
+    uint16_t dst = vm_reg();
+    vm_emit(VM_ADDK_64, dst, lvalue.reg, 0, lvalue.offset);
+    return dst;
+}
+
+// Aggregates and arrays are loaded as their address.
+uint16_t vm_gen_load(VmLvalue lvalue)
+{
+    if (lvalue.in_reg)
+    {
+        return lvalue.reg;
+    }
+    VmRep rep = vm_rep(lvalue.type);
+    if (rep == VM_REP_AGG)
+    {
+        return vm_gen_addr(lvalue);
+    }
+    uint16_t dst = vm_reg();
+    vm_emit(vm_load_ops[rep], dst, lvalue.reg, 0, lvalue.offset);
+    return dst;
+}
+
+// The value must already have the lvalue's type.
+void vm_gen_store(VmLvalue lvalue, uint16_t src)
+{
+    if (lvalue.in_reg)
+    {
+        vm_move(lvalue.reg, src);
+        return;
+    }
+    VmRep rep = vm_rep(lvalue.type);
+    if (rep == VM_REP_AGG)
+    {
+        vm_emit(VM_COPY, vm_gen_addr(lvalue), src, 0, type_sizeof(lvalue.type));
+    }
+    else
+    {
+        vm_emit(vm_store_ops[rep], lvalue.reg, src, 0, lvalue.offset);
+    }
+}
+
+uint64_t vm_const_bits(Type* type, Val val)
+{
+    Operand operand = operand_const(type, val);
+    cast_operand(&operand, type_ullong);
+    return vm_normalize(vm_rep(type), operand.val.ull);
+}
+
+uint16_t vm_gen_const_sym(Sym* sym)
+{
+    if (sym->init_val)
+    {
+        return vm_gen_load((VmLvalue){ sym->type, false, vm_gen_const((uintptr_t)sym->init_val), 0 });
+    }
+    else if (sym->decl && is_floating_type(sym->type))
+    {
+        // Only integer constants are folded by the resolver, so float constants are
+        // computed from their expression, which only refers to globals.
+        size_t locals_base = vm_locals_base;
+        vm_locals_base = buf_len(vm_locals);
+        Expr* expr = sym->decl->const_decl.expr;
+        uint16_t reg = vm_gen_converted(expr, sym->type);
+        vm_locals_base = locals_base;
+        return reg;
+    }
+    return vm_gen_const(vm_const_bits(sym->type, sym->val));
+}
+
+uint16_t vm_gen_name(Expr* expr)
+{
+    if (!vm_local(expr->name))
+    {
+        Sym* sym = vm_global_sym(expr->name);
+        if (sym->kind == SYM_CONST)
+        {
+            return vm_gen_const_sym(sym);
+        }
+        else if (sym->kind == SYM_FUNC)
+        {
+            return vm_gen_const((uintptr_t)vm_func(sym));
+        }
+    }
+    return vm_gen_load(vm_gen_lvalue(expr));
+}
+
+VmLvalue vm_gen_lvalue(Expr* expr)
+{
+    Type* type = expr->type;
+    switch (expr->kind)
+    {
+        case EXPR_NAME: {
+            VmLocal* local = vm_local(expr->name);
+            if (local && local->in_reg)
+            {
+                return (VmLvalue){ type, true, local->reg, 0 };
+            }
+            else if (local)
+            {
+                uint16_t reg = vm_reg();
+                vm_emit(VM_ADDR_MEM, reg, 0, 0, local->offset);
+                return (VmLvalue){ type, false, reg, 0 };
+            }
+            Sym* sym = vm_global_sym(expr->name);
+            if (sym->kind == SYM_VAR)
+            {
+                return (VmLvalue){ type, false, vm_gen_const((uintptr_t)vm_global(sym)), 0 };
+            }
+            break;
+        }
+        case EXPR_FIELD: {
+            Type* base_type = unqualify_type(expr->field.expr->type);
+            VmLvalue base;
+            if (is_ptr_type(base_type))
+            {
+                base = (VmLvalue){ .reg = vm_gen_rvalue(expr->field.expr) };
+                base_type = unqualify_type(base_type->base);
+            }
+            else
+            {
+                base = vm_gen_lvalue(expr->field.expr);
+            }
+            assert(!base.in_reg);
+            base.type = type;
+            base.offset += vm_field(base_type, expr->field.name)->offset;
+            return base;
+        }
+        case EXPR_INDEX: {
+            Type* base_type = unqualify_type(expr->index.expr->type);
+            VmLvalue base;
+            if (is_array_type(base_type))
+            {
+                base = vm_gen_lvalue(expr->index.expr);
+            }
+            else
+            {
+                base = (VmLvalue){ .reg = vm_gen_rvalue(expr->index.expr) };
+            }
+            assert(!base.in_reg);
+            int64_t size = vm_elem_size(base_type);
+            Expr* index = expr->index.index;
+            if (index->kind == EXPR_INT)
+            {
+                base.offset += (int64_t)index->int_lit.val * size;
+            }
+            else
+            {
+                uint16_t index_reg = vm_gen_rvalue(index);
+                uint16_t dst = vm_reg();
+                vm_emit(VM_INDEX, dst, base.reg, index_reg, size);
+                base.reg = dst;
+            }
+            base.type = type;
+            return base;
+        }
+        case EXPR_UNARY:
+            if (expr->unary.op == TOKEN_MUL)
+            {
+                return (VmLvalue){ type, false, vm_gen_rvalue(expr->unary.expr), 0 };
+            }
+            break;
+        case EXPR_COMPOUND: {
+            uint16_t reg = vm_reg();
+            vm_emit(VM_ADDR_MEM, reg, 0, 0, vm_alloc_mem(type));
+            vm_gen_init(reg, 0, type, expr);
+            return (VmLvalue){ type, false, reg, 0 };
+        }
+        default:
+            break;
+    }
+    // Aggregates that are not lvalues, such as call results, are read through their
+    // address.
+    return (VmLvalue){ type, false, vm_gen_rvalue(expr), 0 };
+}
+
+void vm_gen_zero(uint16_t base, int64_t offset, Type* type)
+{
+    vm_emit(VM_ZERO, vm_gen_addr((VmLvalue){ type, false, base, offset }), 0, 0, type_sizeof(type));
+}
+
+// Initializes memory at base + offset from an initializer expression. Compound literals
+// are written in place, and the parts they leave out are zeroed.
+void vm_gen_init(uint16_t base, int64_t offset, Type* type, Expr* expr)
+{
+    type = unqualify_type(type);
+    VmRep rep = vm_rep(type);
+    if (expr->kind == EXPR_COMPOUND && (rep == VM_REP_AGG || unqualify_type(expr->type) == type))
+    {
+        size_t regs = vm_num_regs;
+        if (type->kind == TYPE_STRUCT || type->kind == TYPE_UNION)
+        {
+            vm_gen_zero(base, offset, type);
+            int index = 0;
+            for (size_t i = 0; i < expr->compound.num_fields; i++)
+            {
+                CompoundField field = expr->compound.fields[i];
+                if (field.kind == FIELD_NAME)
+                {
+                    index = aggregate_field_index(type, field.name);
+                }
+                TypeField* type_field = &type->aggregate.fields[index];
+                vm_gen_init(base, offset + type_field->offset, type_field->type, field.init);
+                vm_free_regs(regs);
+                index++;
+            }
+        }
+        else if (type->kind == TYPE_ARRAY)
+        {
+            vm_gen_zero(base, offset, type);
+            int64_t elem_size = type_sizeof(type->base);
+            int index = 0;
+            for (size_t i = 0; i < expr->compound.num_fields; i++)
+            {
+                CompoundField field = expr->compound.fields[i];
+                if (field.kind == FIELD_INDEX)
+                {
+                    Operand operand = resolve_const_expr(field.index);
+                    cast_operand(&operand, type_int);
+                    index = operand.val.i;
+                }
+                vm_gen_init(base, offset + index * elem_size, type->base, field.init);
+                vm_free_regs(regs);
+                index++;
+            }
+        }
+        else if (expr->compound.num_fields == 0)
+        {
+            vm_emit(vm_store_ops[rep], base, vm_gen_const(0), 0, offset);
+        }
+        else
+        {
+            vm_gen_init(base, offset, type, expr->compound.fields[0].init);
+        }
+        vm_free_regs(regs);
+    }
+    else if (rep == VM_REP_AGG)
+    {
+        uint16_t src = vm_gen_rvalue(expr);
+        vm_emit(VM_COPY, vm_gen_addr((VmLvalue){ type, false, base, offset }), src, 0, type_sizeof(type));
+    }
+    else
+    {
+        vm_emit(vm_store_ops[rep], base, vm_gen_converted(expr, type), 0, offset);
+    }
+}
+
+VmOp vm_op_for_rep(VmRep rep, VmOp i32, VmOp u32, VmOp i64, VmOp f32, VmOp f64)
+{
+    switch (rep)
+    {
+        case VM_REP_I32:
+            return i32;
+        case VM_REP_U32:
+            return u32;
+        case VM_REP_F32:
+            return f32;
+        case VM_REP_F64:
+            return f64;
+        default:
+            return i64;
+    }
+}
+
+VmOp vm_arith_op(TokenKind op, VmRep rep)
+{
+    bool is_signed = vm_is_signed_rep(rep);
+    switch (op)
+    {
+        case TOKEN_ADD:
+            return vm_op_for_rep(rep, VM_ADD_I32, VM_ADD_U32, VM_ADD_64, VM_ADD_F32, VM_ADD_F64);
+        case TOKEN_SUB:
+            return vm_op_for_rep(rep, VM_SUB_I32, VM_SUB_U32, VM_SUB_64, VM_SUB_F32, VM_SUB_F64);
+        case TOKEN_MUL:
+            return vm_op_for_rep(rep, VM_MUL_I32, VM_MUL_U32, VM_MUL_64, VM_MUL_F32, VM_MUL_F64);
+        case TOKEN_DIV:
+            return vm_op_for_rep(rep, VM_DIV_I, VM_DIV_U, is_signed ? VM_DIV_I : VM_DIV_U, VM_DIV_F32, VM_DIV_F64);
+        case TOKEN_MOD:
+            return is_signed ? VM_MOD_I : VM_MOD_U;
+        case TOKEN_AND:
+            return VM_AND;
+        case TOKEN_OR:
+            return VM_OR;
+        case TOKEN_XOR:
+            return VM_XOR;
+        case TOKEN_LSHIFT:
+            return vm_op_for_rep(rep, VM_SHL_I32, VM_SHL_U32, VM_SHL_64, VM_SHL_64, VM_SHL_64);
+        case TOKEN_RSHIFT:
+            return is_signed ? VM_SHR_I : VM_SHR_U;
+        default:
+            assert(0);
+            return VM_MOV;
+    }
+}
+
+bool vm_is_comparison(TokenKind op)
+{
+    switch (op)
+    {
+        case TOKEN_EQ:
+        case TOKEN_NOTEQ:
+        case TOKEN_LT:
+        case TOKEN_LTEQ:
+        case TOKEN_GT:
+        case TOKEN_GTEQ:
+            return true;
+        default:
+            return false;
+    }
+}
+
+TokenKind vm_negate_comparison(TokenKind op)
+{
+    switch (op)
+    {
+        case TOKEN_EQ:
+            return TOKEN_NOTEQ;
+        case TOKEN_NOTEQ:
+            return TOKEN_EQ;
+        case TOKEN_LT:
+            return TOKEN_GTEQ;
+        case TOKEN_LTEQ:
+            return TOKEN_GT;
+        case TOKEN_GT:
+            return TOKEN_LTEQ;
+        default:
+            assert(op == TOKEN_GTEQ);
+            return TOKEN_LT;
+    }
+}
+
+// Greater-than comparisons are done as less-than with the operands swapped.
+void vm_gen_compare(uint16_t dst, TokenKind op, uint16_t left, uint16_t right, VmRep rep)
+{
+    if (op == TOKEN_GT || op == TOKEN_GTEQ)
+    {
+        uint16_t temp = left;
+        left = right;
+        right = temp;
+        op = op == TOKEN_GT ? TOKEN_LT : TOKEN_LTEQ;
+    }
+    VmOp vm_op;
+    if (rep == VM_REP_F32)
+    {
+        vm_op = op == TOKEN_EQ ? VM_EQ_F32 : op == TOKEN_NOTEQ ? VM_NE_F32 : op == TOKEN_LT ? VM_LT_F32 : VM_LE_F32;
+    }
+    else if (rep == VM_REP_F64)
+    {
+        vm_op = op == TOKEN_EQ ? VM_EQ_F64 : op == TOKEN_NOTEQ ? VM_NE_F64 : op == TOKEN_LT ? VM_LT_F64 : VM_LE_F64;
+    }
+    else if (vm_is_signed_rep(rep))
+    {
+        vm_op = op == TOKEN_EQ ? VM_EQ : op == TOKEN_NOTEQ ? VM_NE : op == TOKEN_LT ? VM_LT_I : VM_LE_I;
+    }
+    else
+    {
+        vm_op = op == TOKEN_EQ ? VM_EQ : op == TOKEN_NOTEQ ? VM_NE : op == TOKEN_LT ? VM_LT_U : VM_LE_U;
+    }
+    vm_emit(vm_op, dst, left, right, 0);
+}
+
+size_t vm_gen_compare_jump(TokenKind op, uint16_t left, uint16_t right, VmRep rep)
+{
+    if (op == TOKEN_GT || op == TOKEN_GTEQ)
+    {
+        uint16_t temp = left;
+        left = right;
+        right = temp;
+        op = op == TOKEN_GT ? TOKEN_LT : TOKEN_LTEQ;
+    }
+    VmOp vm_op;
+    if (vm_is_signed_rep(rep))
+    {
+        vm_op = op == TOKEN_EQ ? VM_JEQ : op == TOKEN_NOTEQ ? VM_JNE : op == TOKEN_LT ? VM_JLT_I : VM_JLE_I;
+    }
+    else
+    {
+        vm_op = op == TOKEN_EQ ? VM_JEQ : op == TOKEN_NOTEQ ? VM_JNE : op == TOKEN_LT ? VM_JLT_U : VM_JLE_U;
+    }
+    return vm_emit(vm_op, left, right, 0, 0);
+}
+
+// Emits op on two values into dst, with the operand conversions from
+// resolve_expr_binary_op, and returns the type of the result.
+Type* vm_gen_binary_op(uint16_t dst, TokenKind op, uint16_t left, Type* left_type, uint16_t right, Type* right_type)
+{
+    left_type = vm_decay(left_type);
+    right_type = vm_decay(right_type);
+    if (op == TOKEN_ADD || op == TOKEN_SUB)
+    {
+        if (is_ptr_type(left_type) && is_integer_type(right_type))
+        {
+            int64_t size = vm_elem_size(left_type);
+            vm_emit(VM_INDEX, dst, left, right, op == TOKEN_ADD ? size : -size);
+            return left_type;
+        }
+        else if (op == TOKEN_ADD && is_integer_type(left_type) && is_ptr_type(right_type))
+        {
+            vm_emit(VM_INDEX, dst, right, left, vm_elem_size(right_type));
+            return right_type;
+        }
+        else if (op == TOKEN_SUB && is_ptr_type(left_type) && is_ptr_type(right_type))
+        {
+            vm_emit(VM_SUB_64, dst, left, right, 0);
+            int64_t size = vm_elem_size(left_type);
+            if (size > 1)
+            {
+                vm_emit(VM_DIV_I, dst, dst, vm_gen_const(size), 0);
+            }
+            return type_ssize;
+        }
+    }
+    if (vm_is_comparison(op))
+    {
+        VmRep rep = VM_REP_U64;
+        if (is_arithmetic_type(left_type) && is_arithmetic_type(right_type))
+        {
+            Type* type = vm_unify_types(left_type, right_type);
+            left = vm_gen_convert(left, left_type, type);
+            right = vm_gen_convert(right, right_type, type);
+            rep = vm_rep(type);
+        }
+        vm_gen_compare(dst, op, left, right, rep);
+        return type_int;
+    }
+    Type* type;
+    if (op == TOKEN_LSHIFT || op == TOKEN_RSHIFT)
+    {
+        type = vm_promote_type(left_type);
+        left = vm_gen_convert(left, left_type, type);
+        right = vm_gen_convert(right, right_type, vm_promote_type(right_type));
+    }
+    else
+    {
+        type = vm_unify_types(left_type, right_type);
+        left = vm_gen_convert(left, left_type, type);
+        right = vm_gen_convert(right, right_type, type);
+    }
+    vm_emit(vm_arith_op(op, vm_rep(type)), dst, left, right, 0);
+    return type;
+}
+
+// Emits jumps, added to jumps, that are taken when the truth of expr equals when. &&
+// and || short-circuit, and integer and pointer comparisons branch directly.
+void vm_gen_branch(Expr* expr, bool when, size_t** jumps)
+{
+    if (expr->kind == EXPR_BINARY)
+    {
+        TokenKind op = expr->binary.op;
+        Expr* left = expr->binary.left;
+        Expr* right = expr->binary.right;
+        if (op == TOKEN_AND_AND || op == TOKEN_OR_OR)
+        {
+            if ((op == TOKEN_AND_AND) != when)
+            {
+                vm_gen_branch(left, when, jumps);
+                vm_gen_branch(right, when, jumps);
+            }
+            else
+            {
+                size_t* skip = NULL;
+                vm_gen_branch(left, !when, &skip);
+                vm_gen_branch(right, when, jumps);
+                vm_label(&skip);
+            }
+            return;
+        }
+        Type* left_type = vm_decay(left->type);
+        Type* right_type = vm_decay(right->type);
+        if (vm_is_comparison(op) && !is_floating_type(left_type) && !is_floating_type(right_type))
+        {
+            size_t regs = vm_num_regs;
+            uint16_t left_reg = vm_gen_rvalue(left);
+            uint16_t right_reg = vm_gen_rvalue(right);
+            VmRep rep = VM_REP_U64;
+            if (is_arithmetic_type(left_type) && is_arithmetic_type(right_type))
+            {
+                Type* type = vm_unify_types(left_type, right_type);
+                left_reg = vm_gen_convert(left_reg, left_type, type);
+                right_reg = vm_gen_convert(right_reg, right_type, type);
+                rep = vm_rep(type);
+            }
+            buf_push(*jumps, vm_gen_compare_jump(when ? op : vm_negate_comparison(op), left_reg, right_reg, rep));
+            vm_free_regs(regs);
+            return;
+        }
+    }
+    size_t regs = vm_num_regs;
+    uint16_t cond = vm_gen_convert(vm_gen_rvalue(expr), expr->type, type_bool);
+    buf_push(*jumps, vm_emit(when ? VM_JNZ : VM_JZ, cond, 0, 0, 0));
+    vm_free_regs(regs);
+}
+
+uint16_t vm_gen_logical(Expr* expr)
+{
+    uint16_t dst = vm_gen_const(0);
+    size_t* jumps = NULL;
+    vm_gen_branch(expr, false, &jumps);
+    vm_emit(VM_LOADK, dst, 0, 0, 1);
+    vm_label(&jumps);
+    vm_free_regs(dst + 1);
+    return dst;
+}
+
+uint16_t vm_gen_ternary(Expr* expr)
+{
+    uint16_t dst = vm_reg();
+    size_t* else_jumps = NULL;
+    size_t* end_jumps = NULL;
+    vm_gen_branch(expr->ternary.cond, false, &else_jumps);
+    vm_move(dst, vm_gen_converted(expr->ternary.if_true, expr->type));
+    buf_push(end_jumps, vm_emit(VM_JMP, 0, 0, 0, 0));
+    vm_free_regs(dst + 1);
+    vm_label(&else_jumps);
+    vm_move(dst, vm_gen_converted(expr->ternary.if_false, expr->type));
+    vm_label(&end_jumps);
+    vm_free_regs(dst + 1);
+    return dst;
+}
+
+uint16_t vm_gen_unary(Expr* expr)
+{
+    TokenKind op = expr->unary.op;
+    if (op == TOKEN_AND)
+    {
+        return vm_gen_addr(vm_gen_lvalue(expr->unary.expr));
+    }
+    else if (op == TOKEN_MUL)
+    {
+        return vm_gen_load(vm_gen_lvalue(expr));
+    }
+    Type* type = expr->type;
+    VmRep rep = vm_rep(type);
+    uint16_t dst = vm_reg();
+    uint16_t src = vm_gen_converted(expr->unary.expr, type);
+    switch (op)
+    {
+        case TOKEN_ADD:
+            vm_move(dst, src);
+            break;
+        case TOKEN_SUB:
+            vm_emit(vm_op_for_rep(rep, VM_NEG_I32, VM_NEG_U32, VM_NEG_64, VM_NEG_F32, VM_NEG_F64), dst, src, 0, 0);
+            break;
+        case TOKEN_NEG:
+            vm_emit(rep == VM_REP_U32 ? VM_NOT_U32 : VM_NOT_64, dst, src, 0, 0);
+            break;
+        default:
+            assert(0);
+            break;
+    }
+    vm_free_regs(dst + 1);
+    return dst;
+}
+
+uint16_t vm_gen_binary(Expr* expr)
+{
+    TokenKind op = expr->binary.op;
+    if (op == TOKEN_AND_AND || op == TOKEN_OR_OR)
+    {
+        return vm_gen_logical(expr);
+    }
+    uint16_t dst = vm_reg();
+    uint16_t left = vm_gen_rvalue(expr->binary.left);
+    uint16_t right = vm_gen_rvalue(expr->binary.right);
+    vm_gen_binary_op(dst, op, left, expr->binary.left->type, right, expr->binary.right->type);
+    vm_free_regs(dst + 1);
+    return dst;
+}
+
+// Arguments are placed in consecutive registers, which become the first registers of
+// the callee's window. A function returning an aggregate is passed the address of a
+// temporary to copy it to in its destination register.
+uint16_t vm_gen_call(Expr* expr)
+{
+    Expr* callee = expr->call.expr;
+    Sym* sym = NULL;
+    if (callee->kind == EXPR_NAME && !vm_local(callee->name))
+    {
+        sym = vm_global_sym(callee->name);
+        if (sym->kind == SYM_TYPE)
+        {
+            return vm_gen_converted(expr->call.args[0], sym->type);
+        }
+        else if (sym->kind != SYM_FUNC)
+        {
+            sym = NULL;
+        }
+    }
+    Type* func_type = unqualify_type(callee->type);
+    Type* ret_type = func_type->func.ret;
+    bool returns_aggregate = vm_rep(ret_type) == VM_REP_AGG;
+    uint16_t dst = vm_reg();
+    if (returns_aggregate)
+    {
+        vm_emit(VM_ADDR_MEM, dst, 0, 0, vm_alloc_mem(ret_type));
+    }
+    uint16_t func_reg = sym ? 0 : vm_gen_rvalue(callee);
+    size_t num_args = expr->call.num_args;
+    size_t args = vm_num_regs;
+    for (size_t i = 0; i < num_args; i++)
+    {
+        vm_reg();
+    }
+    for (size_t i = 0; i < num_args; i++)
+    {
+        Expr* arg = expr->call.args[i];
+        Type* type = i < func_type->func.num_params ? vm_decay(func_type->func.params[i]) : vm_vararg_type(arg->type);
+        vm_move((uint16_t)(args + i), vm_gen_converted(arg, type));
+        vm_free_regs(args + num_args);
+    }
+    if (sym)
+    {
+        vm_emit(VM_CALL, dst, args, num_args, (int64_t)(uintptr_t)vm_func(sym));
+    }
+    else
+    {
+        vm_emit(VM_CALL_REG, dst, args, num_args, func_reg);
+    }
+    if (returns_aggregate)
+    {
+        // The destination holds the address that the result is copied to, so the call
+        // must not be retargeted.
+        vm_here();
+    }
+    vm_free_regs(dst + 1);
+    return dst;
+}
+
+uint16_t vm_gen_rvalue(Expr* expr)
+{
+    switch (expr->kind)
+    {
+        case EXPR_INT:
+            return vm_gen_const(vm_normalize(vm_rep(expr->type), expr->int_lit.val));
+        case EXPR_FLOAT: {
+            VmValue val = { 0 };
+            if (vm_rep(expr->type) == VM_REP_F32)
+            {
+                val.f = (float)expr->float_lit.val;
+            }
+            else
+            {
+                val.d = expr->float_lit.val;
+            }
+            return vm_gen_const(val.u);
+        }
+        case EXPR_STR:
+            return vm_gen_const((uintptr_t)expr->str_lit.val);
+        case EXPR_NAME:
+            return vm_gen_name(expr);
+        case EXPR_CAST:
+            return vm_gen_converted(expr->cast.expr, expr->type);
+        case EXPR_CALL:
+            return vm_gen_call(expr);
+        case EXPR_INDEX:
+        case EXPR_FIELD:
+        case EXPR_COMPOUND:
+            return vm_gen_load(vm_gen_lvalue(expr));
+        case EXPR_UNARY:
+            return vm_gen_unary(expr);
+        case EXPR_BINARY:
+            return vm_gen_binary(expr);
+        case EXPR_TERNARY:
+            return vm_gen_ternary(expr);
+        case EXPR_SIZEOF_EXPR:
+            return vm_gen_const(type_sizeof(expr->sizeof_expr->type));
+        case EXPR_SIZEOF_TYPE:
+            return vm_gen_const(type_sizeof(expr->sizeof_type->type));
+        default:
+            assert(0);
+            return 0;
+    }
+}
+
+void vm_gen_assign(Stmt* stmt)
+{
+    Expr* left = stmt->assign.left;
+    Expr* right = stmt->assign.right;
+    Type* type = unqualify_type(left->type);
+    VmRep rep = vm_rep(type);
+    VmLvalue lvalue = vm_gen_lvalue(left);
+    TokenKind op = stmt->assign.op;
+    if (op == TOKEN_ASSIGN)
+    {
+        vm_gen_store(lvalue, rep == VM_REP_AGG ? vm_gen_rvalue(right) : vm_gen_converted(right, type));
+        return;
+    }
+    uint16_t value = vm_gen_load(lvalue);
+    uint16_t result = vm_reg();
+    Type* result_type;
+    if (right)
+    {
+        result_type = vm_gen_binary_op(result, assign_token_to_binary_token[op], value, type, vm_gen_rvalue(right), right->type);
+    }
+    else if (rep == VM_REP_I32 || rep == VM_REP_U32 || rep == VM_REP_I64 || rep == VM_REP_U64)
+    {
+        int64_t delta = is_ptr_type(type) ? vm_elem_size(type) : 1;
+        VmOp add_op = rep == VM_REP_I32 ? VM_ADDK_I32 : rep == VM_REP_U32 ? VM_ADDK_U32 : VM_ADDK_64;
+        vm_emit(add_op, result, value, 0, op == TOKEN_INC ? delta : -delta);
+        result_type = type;
+    }
+    else
+    {
+        result_type = vm_gen_binary_op(result, op == TOKEN_INC ? TOKEN_ADD : TOKEN_SUB, value, type, vm_gen_const(1), type_int);
+    }
+    vm_gen_store(lvalue, vm_gen_convert(result, result_type, type));
+}
+
+Type* vm_init_type(Stmt* stmt)
+{
+    Expr* expr = stmt->init.expr;
+    if (!stmt->init.type)
+    {
+        return unqualify_type(expr->type);
+    }
+    Type* type = stmt->init.type->type;
+    if (expr && is_incomplete_array_type(type) && is_array_type(expr->type))
+    {
+        type = expr->type;
+    }
+    return unqualify_type(type);
+}
+
+void vm_gen_init_stmt(Stmt* stmt)
+{
+    Type* type = vm_init_type(stmt);
+    Expr* expr = stmt->init.expr;
+    VmLocal local = { stmt->init.name, type };
+    if (vm_rep(type) != VM_REP_AGG && !vm_is_addressed(local.name))
+    {
+        local.in_reg = true;
+        local.reg = vm_reg();
+        // Locals without an initializer are zeroed, so that runs are repeatable.
+        vm_move(local.reg, expr ? vm_gen_converted(expr, type) : vm_gen_const(0));
+        vm_free_regs(local.reg + 1);
+    }
+    else
+    {
+        size_t regs = vm_num_regs;
+        local.offset = vm_alloc_mem(type);
+        uint16_t addr = vm_reg();
+        vm_emit(VM_ADDR_MEM, addr, 0, 0, local.offset);
+        if (expr)
+        {
+            vm_gen_init(addr, 0, type, expr);
+        }
+        else
+        {
+            vm_gen_zero(addr, 0, type);
+        }
+        vm_free_regs(regs);
+    }
+    buf_push(vm_locals, local);
+}
+
+// Loops test their condition at the bottom, after a jump there on entry for the loops
+// that test first.
+void vm_gen_loop(Expr* cond, Stmt* next, StmtList block, bool test_first)
+{
+    size_t* check_jumps = NULL;
+    if (test_first)
+    {
+        buf_push(check_jumps, vm_emit(VM_JMP, 0, 0, 0, 0));
+    }
+    buf_push(vm_loops, (VmLoop){ 0 });
+    size_t body = vm_here();
+    vm_gen_block(block);
+    vm_label(&vm_loops[buf_len(vm_loops) - 1].continues);
+    if (next)
+    {
+        vm_gen_stmt(next);
+    }
+    vm_label(&check_jumps);
+    if (cond)
+    {
+        vm_pos = cond->pos;
+        size_t* body_jumps = NULL;
+        vm_gen_branch(cond, true, &body_jumps);
+        vm_patch(body_jumps, body);
+        buf_free(body_jumps);
+    }
+    else
+    {
+        vm_emit(VM_JMP, 0, 0, 0, body);
+    }
+    VmLoop loop = vm_loops[--buf__hdr(vm_loops)->len];
+    vm_label(&loop.breaks);
+}
+
+// Cases are found by a chain of comparisons, and each case's block ends with a break,
+// as in the generated C.
+void vm_gen_switch(Stmt* stmt)
+{
+    Expr* expr = stmt->switch_stmt.expr;
+    Type* type = vm_decay(expr->type);
+    uint16_t value = vm_gen_rvalue(expr);
+    size_t num_cases = stmt->switch_stmt.num_cases;
+    size_t** case_jumps = xcalloc(num_cases, sizeof(size_t*));
+    for (size_t i = 0; i < num_cases; i++)
+    {
+        SwitchCase switch_case = stmt->switch_stmt.cases[i];
+        for (size_t j = 0; j < switch_case.num_exprs; j++)
+        {
+            size_t regs = vm_num_regs;
+            uint16_t case_value = vm_gen_converted(switch_case.exprs[j], type);
+            buf_push(case_jumps[i], vm_emit(VM_JEQ, value, case_value, 0, 0));
+            vm_free_regs(regs);
+        }
+    }
+    size_t* default_jumps = NULL;
+    buf_push(default_jumps, vm_emit(VM_JMP, 0, 0, 0, 0));
+    buf_push(vm_loops, (VmLoop){ .is_switch = true });
+    for (size_t i = 0; i < num_cases; i++)
+    {
+        SwitchCase switch_case = stmt->switch_stmt.cases[i];
+        vm_label(&case_jumps[i]);
+        if (switch_case.is_default)
+        {
+            vm_label(&default_jumps);
+        }
+        vm_gen_block(switch_case.block);
+        buf_push(vm_loops[buf_len(vm_loops) - 1].breaks, vm_emit(VM_JMP, 0, 0, 0, 0));
+    }
+    free(case_jumps);
+    VmLoop loop = vm_loops[--buf__hdr(vm_loops)->len];
+    vm_label(&default_jumps);
+    vm_label(&loop.breaks);
+}
+
+VmLoop* vm_innermost_loop(bool for_continue)
+{
+    for (size_t i = buf_len(vm_loops); i > 0; i--)
+    {
+        if (!for_continue || !vm_loops[i - 1].is_switch)
+        {
+            return &vm_loops[i - 1];
+        }
+    }
+    fatal_error(vm_pos, "%s outside of a loop", for_continue ? "continue" : "break");
+    return NULL;
+}
+
+void vm_gen_stmt(Stmt* stmt)
+{
+    vm_pos = stmt->pos;
+    vm_stmt_regs = vm_num_regs;
+    size_t regs = vm_num_regs;
+    switch (stmt->kind)
+    {
+        case STMT_RETURN:
+            if (!stmt->expr)
+            {
+                vm_emit(VM_RET_VOID, 0, 0, 0, 0);
+            }
+            else if (vm_rep(vm_ret_type) == VM_REP_AGG)
+            {
+                vm_emit(VM_RET_AGG, vm_gen_rvalue(stmt->expr), 0, 0, type_sizeof(vm_ret_type));
+            }
+            else
+            {
+                vm_emit(VM_RET, vm_gen_converted(stmt->expr, vm_ret_type), 0, 0, 0);
+            }
+            break;
+        case STMT_BREAK:
+            buf_push(vm_innermost_loop(false)->breaks, vm_emit(VM_JMP, 0, 0, 0, 0));
+            break;
+        case STMT_CONTINUE:
+            buf_push(vm_innermost_loop(true)->continues, vm_emit(VM_JMP, 0, 0, 0, 0));
+            break;
+        case STMT_BLOCK:
+            vm_gen_block(stmt->block);
+            break;
+        case STMT_IF: {
+            size_t* next_jumps = NULL;
+            size_t* end_jumps = NULL;
+            vm_gen_branch(stmt->if_stmt.cond, false, &next_jumps);
+            vm_gen_block(stmt->if_stmt.then_block);
+            for (size_t i = 0; i < stmt->if_stmt.num_elseifs; i++)
+            {
+                ElseIf elseif = stmt->if_stmt.elseifs[i];
+                buf_push(end_jumps, vm_emit(VM_JMP, 0, 0, 0, 0));
+                vm_label(&next_jumps);
+                vm_pos = elseif.cond->pos;
+                vm_gen_branch(elseif.cond, false, &next_jumps);
+                vm_gen_block(elseif.block);
+            }
+            if (stmt->if_stmt.else_block.stmts)
+            {
+                buf_push(end_jumps, vm_emit(VM_JMP, 0, 0, 0, 0));
+                vm_label(&next_jumps);
+                vm_gen_block(stmt->if_stmt.else_block);
+            }
+            vm_label(&next_jumps);
+            vm_label(&end_jumps);
+            break;
+        }
+        case STMT_WHILE:
+            vm_gen_loop(stmt->while_stmt.cond, NULL, stmt->while_stmt.block, true);
+            break;
+        case STMT_DO_WHILE:
+            vm_gen_loop(stmt->while_stmt.cond, NULL, stmt->while_stmt.block, false);
+            break;
+        case STMT_FOR: {
+            VmScope scope = vm_enter();
+            if (stmt->for_stmt.init)
+            {
+                vm_gen_stmt(stmt->for_stmt.init);
+            }
+            vm_gen_loop(stmt->for_stmt.cond, stmt->for_stmt.next, stmt->for_stmt.block, true);
+            vm_leave(scope);
+            break;
+        }
+        case STMT_SWITCH:
+            vm_gen_switch(stmt);
+            break;
+        case STMT_ASSIGN:
+            vm_gen_assign(stmt);
+            break;
+        case STMT_INIT:
+            vm_gen_init_stmt(stmt);
+            regs = vm_num_regs;
+            break;
+        case STMT_EXPR:
+            vm_gen_rvalue(stmt->expr);
+            break;
+        default:
+            assert(0);
+            break;
+    }
+    vm_free_regs(regs);
+    vm_stmt_regs = regs;
+}
+
+void vm_gen_block(StmtList block)
+{
+    VmScope scope = vm_enter();
+    for (size_t i = 0; i < block.num_stmts; i++)
+    {
+        vm_gen_stmt(block.stmts[i]);
+    }
+    vm_leave(scope);
+}
+
+void vm_compile_func(VmFunc* func)
+{
+    Decl* decl = func->sym->decl;
+    Type* type = func->sym->type;
+    TRACE_BEGIN("vm_compile_func", func->sym->name);
+    vm_begin_code(decl->pos);
+    vm_scan_block(decl->func.block);
+    vm_ret_type = type->func.ret;
+    size_t num_params = decl->func.num_params;
+    vm_num_regs = vm_max_regs = num_params;
+    for (size_t i = 0; i < num_params; i++)
+    {
+        Type* param_type = vm_decay(type->func.params[i]);
+        VmLocal local = { decl->func.params[i].name, param_type };
+        if (vm_rep(param_type) != VM_REP_AGG && !vm_is_addressed(local.name))
+        {
+            local.in_reg = true;
+            local.reg = (uint16_t)i;
+        }
+        else
+        {
+            // Aggregates are passed by the address of the caller's value and copied,
+            // and scalars whose address is taken are stored to memory.
+            local.offset = vm_alloc_mem(param_type);
+            uint16_t addr = vm_reg();
+            vm_emit(VM_ADDR_MEM, addr, 0, 0, local.offset);
+            vm_gen_store((VmLvalue){ param_type, false, addr, 0 }, (uint16_t)i);
+            vm_free_regs(num_params);
+        }
+        buf_push(vm_locals, local);
+    }
+    vm_stmt_regs = vm_num_regs;
+    vm_gen_block(decl->func.block);
+    vm_emit(VM_RET_VOID, 0, 0, 0, 0);
+    vm_end_code(func);
+    TRACE_END();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Interpreter
+//
+
+#define VM_NUM_REGS (1 << 20)
+#define VM_MEM_SIZE (16 << 20)
+
+typedef struct VmFrame {
+    VmFunc* func;
+    VmInstr* ip;
+    VmValue* regs;
+    char* mem;
+    uint16_t dst;
+} VmFrame;
+
+VmValue* vm_regs;
+VmValue* vm_regs_end;
+char* vm_mem;
+char* vm_mem_end;
+// Where a nested run, such as a global's initializer, starts its stack.
+VmValue* vm_regs_top;
+char* vm_mem_top;
+VmFrame* vm_frames;
+
+void vm_init_globals(void);
+VmValue vm_run(VmFunc* func, VmValue* regs, char* mem);
+
+#define VM_EVAL_STEPS (100 * 1000 * 1000)
+
+// The const or global being evaluated at compile time, if any, and the steps it has
+// left; see vm_eval.
+Sym* vm_eval_sym;
+uint64_t vm_steps_left = UINT64_MAX;
+
+void vm_prepare_func(VmFunc* func)
+{
+    if (func->code || func->native)
+    {
+        return;
+    }
+    Decl* decl = func->sym->decl;
+    if (is_decl_foreign(decl))
+    {
+        fatal_error(decl->pos, "Foreign function '%s' is not available in the interpreter", func->sym->name);
+    }
+    if (!func->sym->body_resolved)
+    {
+        // Called at compile time before the bodies are resolved.
+        resolve_func_body(func->sym);
+    }
+    vm_compile_func(func);
+    vm_init_globals();
+}
+
+VmValue vm_call(VmFunc* func, VmValue* args, size_t num_args)
+{
+    if (!vm_regs)
+    {
+        vm_regs = xmalloc(VM_NUM_REGS * sizeof(VmValue));
+        vm_regs_end = vm_regs + VM_NUM_REGS;
+        vm_regs_top = vm_regs;
+        vm_mem = xmalloc(VM_MEM_SIZE);
+        vm_mem_end = vm_mem + VM_MEM_SIZE;
+        vm_mem_top = vm_mem;
+    }
+    vm_prepare_func(func);
+    if (func->native)
+    {
+        VmValue ret = { 0 };
+        func->native(args, num_args, &ret);
+        return ret;
+    }
+    VmValue* regs = vm_regs_top;
+    char* mem = vm_mem_top;
+    if (regs + MAX(func->num_regs, num_args) > vm_regs_end || mem + func->mem_size > vm_mem_end)
+    {
+        fatal_error(func->sym->decl->pos, "Stack overflow");
+    }
+    if (num_args)
+    {
+        memcpy(regs, args, num_args * sizeof(VmValue));
+    }
+    return vm_run(func, regs, mem);
+}
+
+// Runs the initializer of a global, or a const's expression, into data.
+void vm_run_init(Sym* sym, Expr* expr, void* data)
+{
+    VmFunc init = { .sym = sym };
+    vm_begin_code(sym->decl->pos);
+    uint16_t addr = vm_gen_const((uintptr_t)data);
+    vm_gen_init(addr, 0, sym->type, expr);
+    vm_emit(VM_RET_VOID, 0, 0, 0, 0);
+    vm_end_code(&init);
+    vm_call(&init, NULL, 0);
+    buf_free(init.code);
+    buf_free(init.lines);
+}
+
+void vm_init_globals(void)
+{
+    while (buf_len(vm_pending_globals))
+    {
+        Sym* sym = vm_pending_globals[--buf__hdr(vm_pending_globals)->len];
+        vm_run_init(sym, sym->decl->var.expr, map_get(&vm_globals, sym));
+    }
+}
+
+// A value computed at compile time is emitted as C, which can refer to functions but
+// not to the interpreter's memory.
+void vm_check_value(Sym* sym, Type* type, const char* data)
+{
+    type = unqualify_type(type);
+    switch (type->kind)
+    {
+        case TYPE_PTR: {
+            void* ptr;
+            memcpy(&ptr, data, sizeof(ptr));
+            if (ptr)
+            {
+                fatal_error(sym->decl->pos, "Compile-time value of %s contains a non-null pointer", sym->name);
+            }
+            break;
+        }
+        case TYPE_ARRAY:
+            for (size_t i = 0; i < type->num_elems; i++)
+            {
+                vm_check_value(sym, type->base, data + i * type->base->size);
+            }
+            break;
+        case TYPE_STRUCT:
+            for (size_t i = 0; i < type->aggregate.num_fields; i++)
+            {
+                vm_check_value(sym, type->aggregate.fields[i].type, data + type->aggregate.fields[i].offset);
+            }
+            break;
+        case TYPE_UNION: {
+            TypeField* field = gen_union_field(type);
+            vm_check_value(sym, field->type, data + field->offset);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// Compile-time evaluation of a const or global var whose initializer calls a function.
+// It must not affect anything outside the interpreter, so only pure natives can be
+// called, and it must finish: each taken jump and call uses up a step, and running
+// out of steps is an error rather than a hang. Straight-line code between them is
+// bounded by the size of the function.
+void vm_eval(Sym* sym, Expr* expr, void* data)
+{
+    Sym* outer_sym = vm_eval_sym;
+    uint64_t outer_steps = vm_steps_left;
+    vm_eval_sym = sym;
+    vm_steps_left = VM_EVAL_STEPS;
+    vm_run_init(sym, expr, data);
+    vm_eval_sym = outer_sym;
+    vm_steps_left = outer_steps;
+    vm_check_value(sym, sym->type, data);
+}
+
+// The interpreter's functions and globals belong to one compile's syms.
+void vm_reset(void)
+{
+    for (size_t i = 0; i < vm_funcs.cap; i++)
+    {
+        VmFunc* func = vm_funcs.vals[i];
+        if (vm_funcs.keys[i] && func)
+        {
+            buf_free(func->code);
+            buf_free(func->lines);
+            free(func);
+        }
+    }
+    for (size_t i = 0; i < vm_globals.cap; i++)
+    {
+        if (vm_globals.keys[i])
+        {
+            free(vm_globals.vals[i]);
+        }
+    }
+    free(vm_funcs.keys);
+    free(vm_funcs.vals);
+    free(vm_globals.keys);
+    free(vm_globals.vals);
+    vm_funcs = (Map){ 0 };
+    vm_globals = (Map){ 0 };
+    buf_clear(vm_pending_globals);
+    buf_clear(vm_frames);
+    vm_regs_top = vm_regs;
+    vm_mem_top = vm_mem;
+    vm_eval_sym = NULL;
+    vm_steps_left = UINT64_MAX;
+}
+
+#define vm_error(...) fatal_error(((SrcPos){ func->sym->decl->pos.name, func->lines[instr - func->code] }), __VA_ARGS__)
+
+VmValue vm_run(VmFunc* func, VmValue* regs, char* mem)
+{
+    size_t base_frame = buf_len(vm_frames);
+    VmInstr* code = func->code;
+    VmInstr* ip = code;
+    VmInstr* instr;
+    VmFunc* callee;
+    VmValue ret;
+
+#define R(x) regs[instr->x]
+#define VM_LOAD(type, field) { type val; memcpy(&val, (char*)R(b).p + instr->imm, sizeof(type)); R(a).field = val; }
+#define VM_STORE(type, field) { type val = (type)R(b).field; memcpy((char*)R(a).p + instr->imm, &val, sizeof(type)); }
+#define VM_JUMP() { ip = code + instr->imm; if (!--vm_steps_left) goto out_of_steps; }
+
+#if USE_COMPUTED_GOTO
+    static void* op_labels[NUM_VM_OPS] = {
+#define VM_OP_LABEL(name) &&vm_op_##name,
+        VM_OPS(VM_OP_LABEL)
+#undef VM_OP_LABEL
+    };
+#define VM_OP(name) vm_op_##name
+#define VM_NEXT() do { instr = ip++; goto *op_labels[instr->op]; } while (0)
+    VM_NEXT();
+#else
+#define VM_OP(name) case VM_##name
+#define VM_NEXT() continue
+    for (;;)
+    {
+        instr = ip++;
+        switch (instr->op)
+        {
+#endif
+    VM_OP(MOV): R(a) = R(b); VM_NEXT();
+    VM_OP(LOADK): R(a).i = instr->imm; VM_NEXT();
+    VM_OP(ADDR_MEM): R(a).p = mem + instr->imm; VM_NEXT();
+    VM_OP(ADDK_I32): R(a).i = (int32_t)(R(b).u + instr->imm); VM_NEXT();
+    VM_OP(ADDK_U32): R(a).u = (uint32_t)(R(b).u + instr->imm); VM_NEXT();
+    VM_OP(ADDK_64): R(a).u = R(b).u + instr->imm; VM_NEXT();
+    VM_OP(INDEX): R(a).u = R(b).u + R(c).u * (uint64_t)instr->imm; VM_NEXT();
+    VM_OP(LOAD_I8): VM_LOAD(int8_t, i) VM_NEXT();
+    VM_OP(LOAD_U8): VM_LOAD(uint8_t, u) VM_NEXT();
+    VM_OP(LOAD_I16): VM_LOAD(int16_t, i) VM_NEXT();
+    VM_OP(LOAD_U16): VM_LOAD(uint16_t, u) VM_NEXT();
+    VM_OP(LOAD_I32): VM_LOAD(int32_t, i) VM_NEXT();
+    VM_OP(LOAD_U32): VM_LOAD(uint32_t, u) VM_NEXT();
+    VM_OP(LOAD_64): VM_LOAD(uint64_t, u) VM_NEXT();
+    VM_OP(LOAD_F32): VM_LOAD(float, f) VM_NEXT();
+    VM_OP(LOAD_F64): VM_LOAD(double, d) VM_NEXT();
+    VM_OP(STORE_8): VM_STORE(uint8_t, u) VM_NEXT();
+    VM_OP(STORE_16): VM_STORE(uint16_t, u) VM_NEXT();
+    VM_OP(STORE_32): VM_STORE(uint32_t, u) VM_NEXT();
+    VM_OP(STORE_64): VM_STORE(uint64_t, u) VM_NEXT();
+    VM_OP(STORE_F32): VM_STORE(float, f) VM_NEXT();
+    VM_OP(STORE_F64): VM_STORE(double, d) VM_NEXT();
+    VM_OP(COPY): memmove(R(a).p, R(b).p, instr->imm); VM_NEXT();
+    VM_OP(ZERO): memset(R(a).p, 0, instr->imm); VM_NEXT();
+    VM_OP(ADD_I32): R(a).i = (int32_t)(R(b).u + R(c).u); VM_NEXT();
+    VM_OP(ADD_U32): R(a).u = (uint32_t)(R(b).u + R(c).u); VM_NEXT();
+    VM_OP(ADD_64): R(a).u = R(b).u + R(c).u; VM_NEXT();
+    VM_OP(ADD_F32): R(a).f = R(b).f + R(c).f; VM_NEXT();
+    VM_OP(ADD_F64): R(a).d = R(b).d + R(c).d; VM_NEXT();
+    VM_OP(SUB_I32): R(a).i = (int32_t)(R(b).u - R(c).u); VM_NEXT();
+    VM_OP(SUB_U32): R(a).u = (uint32_t)(R(b).u - R(c).u); VM_NEXT();
+    VM_OP(SUB_64): R(a).u = R(b).u - R(c).u; VM_NEXT();
+    VM_OP(SUB_F32): R(a).f = R(b).f - R(c).f; VM_NEXT();
+    VM_OP(SUB_F64): R(a).d = R(b).d - R(c).d; VM_NEXT();
+    VM_OP(MUL_I32): R(a).i = (int32_t)(R(b).u * R(c).u); VM_NEXT();
+    VM_OP(MUL_U32): R(a).u = (uint32_t)(R(b).u * R(c).u); VM_NEXT();
+    VM_OP(MUL_64): R(a).u = R(b).u * R(c).u; VM_NEXT();
+    VM_OP(MUL_F32): R(a).f = R(b).f * R(c).f; VM_NEXT();
+    VM_OP(MUL_F64): R(a).d = R(b).d * R(c).d; VM_NEXT();
+    VM_OP(DIV_I):
+        if (R(c).i == 0)
+        {
+            vm_error("Division by zero");
+        }
+        R(a).i = R(c).i == -1 ? (int64_t)(0 - R(b).u) : R(b).i / R(c).i;
+        VM_NEXT();
+    VM_OP(DIV_U):
+        if (R(c).u == 0)
+        {
+            vm_error("Division by zero");
+        }
+        R(a).u = R(b).u / R(c).u;
+        VM_NEXT();
+    VM_OP(DIV_F32): R(a).f = R(b).f / R(c).f; VM_NEXT();
+    VM_OP(DIV_F64): R(a).d = R(b).d / R(c).d; VM_NEXT();
+    VM_OP(MOD_I):
+        if (R(c).i == 0)
+        {
+            vm_error("Division by zero");
+        }
+        R(a).i = R(c).i == -1 ? 0 : R(b).i % R(c).i;
+        VM_NEXT();
+    VM_OP(MOD_U):
+        if (R(c).u == 0)
+        {
+            vm_error("Division by zero");
+        }
+        R(a).u = R(b).u % R(c).u;
+        VM_NEXT();
+    VM_OP(AND): R(a).u = R(b).u & R(c).u; VM_NEXT();
+    VM_OP(OR): R(a).u = R(b).u | R(c).u; VM_NEXT();
+    VM_OP(XOR): R(a).u = R(b).u ^ R(c).u; VM_NEXT();
+    VM_OP(SHL_I32): R(a).i = (int32_t)((uint32_t)R(b).u << (R(c).u & 31)); VM_NEXT();
+    VM_OP(SHL_U32): R(a).u = (uint32_t)((uint32_t)R(b).u << (R(c).u & 31)); VM_NEXT();
+    VM_OP(SHL_64): R(a).u = R(b).u << (R(c).u & 63); VM_NEXT();
+    VM_OP(SHR_I): R(a).i = R(b).i >> (R(c).u & 63); VM_NEXT();
+    VM_OP(SHR_U): R(a).u = R(b).u >> (R(c).u & 63); VM_NEXT();
+    VM_OP(NEG_I32): R(a).i = (int32_t)(0 - R(b).u); VM_NEXT();
+    VM_OP(NEG_U32): R(a).u = (uint32_t)(0 - R(b).u); VM_NEXT();
+    VM_OP(NEG_64): R(a).u = 0 - R(b).u; VM_NEXT();
+    VM_OP(NEG_F32): R(a).f = -R(b).f; VM_NEXT();
+    VM_OP(NEG_F64): R(a).d = -R(b).d; VM_NEXT();
+    VM_OP(NOT_64): R(a).u = ~R(b).u; VM_NEXT();
+    VM_OP(NOT_U32): R(a).u = (uint32_t)~R(b).u; VM_NEXT();
+    VM_OP(EQ): R(a).i = R(b).u == R(c).u; VM_NEXT();
+    VM_OP(NE): R(a).i = R(b).u != R(c).u; VM_NEXT();
+    VM_OP(LT_I): R(a).i = R(b).i < R(c).i; VM_NEXT();
+    VM_OP(LE_I): R(a).i = R(b).i <= R(c).i; VM_NEXT();
+    VM_OP(LT_U): R(a).i = R(b).u < R(c).u; VM_NEXT();
+    VM_OP(LE_U): R(a).i = R(b).u <= R(c).u; VM_NEXT();
+    VM_OP(EQ_F32): R(a).i = R(b).f == R(c).f; VM_NEXT();
+    VM_OP(NE_F32): R(a).i = R(b).f != R(c).f; VM_NEXT();
+    VM_OP(LT_F32): R(a).i = R(b).f < R(c).f; VM_NEXT();
+    VM_OP(LE_F32): R(a).i = R(b).f <= R(c).f; VM_NEXT();
+    VM_OP(EQ_F64): R(a).i = R(b).d == R(c).d; VM_NEXT();
+    VM_OP(NE_F64): R(a).i = R(b).d != R(c).d; VM_NEXT();
+    VM_OP(LT_F64): R(a).i = R(b).d < R(c).d; VM_NEXT();
+    VM_OP(LE_F64): R(a).i = R(b).d <= R(c).d; VM_NEXT();
+    VM_OP(SEXT8): R(a).i = (int8_t)R(b).u; VM_NEXT();
+    VM_OP(ZEXT8): R(a).u = (uint8_t)R(b).u; VM_NEXT();
+    VM_OP(SEXT16): R(a).i = (int16_t)R(b).u; VM_NEXT();
+    VM_OP(ZEXT16): R(a).u = (uint16_t)R(b).u; VM_NEXT();
+    VM_OP(SEXT32): R(a).i = (int32_t)R(b).u; VM_NEXT();
+    VM_OP(ZEXT32): R(a).u = (uint32_t)R(b).u; VM_NEXT();
+    VM_OP(TO_BOOL): R(a).u = R(b).u != 0; VM_NEXT();
+    VM_OP(F32_NZ): R(a).u = R(b).f != 0; VM_NEXT();
+    VM_OP(F64_NZ): R(a).u = R(b).d != 0; VM_NEXT();
+    VM_OP(I2F32): R(a).f = (float)R(b).i; VM_NEXT();
+    VM_OP(U2F32): R(a).f = (float)R(b).u; VM_NEXT();
+    VM_OP(I2F64): R(a).d = (double)R(b).i; VM_NEXT();
+    VM_OP(U2F64): R(a).d = (double)R(b).u; VM_NEXT();
+    VM_OP(F32_2I): R(a).i = (int64_t)R(b).f; VM_NEXT();
+    VM_OP(F32_2U): R(a).u = (uint64_t)R(b).f; VM_NEXT();
+    VM_OP(F64_2I): R(a).i = (int64_t)R(b).d; VM_NEXT();
+    VM_OP(F64_2U): R(a).u = (uint64_t)R(b).d; VM_NEXT();
+    VM_OP(F32_2F64): R(a).d = R(b).f; VM_NEXT();
+    VM_OP(F64_2F32): R(a).f = (float)R(b).d; VM_NEXT();
+    VM_OP(JMP): VM_JUMP(); VM_NEXT();
+    VM_OP(JZ): if (!R(a).u) VM_JUMP(); VM_NEXT();
+    VM_OP(JNZ): if (R(a).u) VM_JUMP(); VM_NEXT();
+    VM_OP(JEQ): if (R(a).u == R(b).u) VM_JUMP(); VM_NEXT();
+    VM_OP(JNE): if (R(a).u != R(b).u) VM_JUMP(); VM_NEXT();
+    VM_OP(JLT_I): if (R(a).i < R(b).i) VM_JUMP(); VM_NEXT();
+    VM_OP(JLE_I): if (R(a).i <= R(b).i) VM_JUMP(); VM_NEXT();
+    VM_OP(JLT_U): if (R(a).u < R(b).u) VM_JUMP(); VM_NEXT();
+    VM_OP(JLE_U): if (R(a).u <= R(b).u) VM_JUMP(); VM_NEXT();
+    VM_OP(CALL):
+        callee = (VmFunc*)(uintptr_t)instr->imm;
+        goto call;
+    VM_OP(CALL_REG):
+        callee = regs[instr->imm].p;
+        if (!callee)
+        {
+            vm_error("Call through null function pointer");
+        }
+        goto call;
+    VM_OP(RET):
+        ret = R(a);
+        goto ret;
+    VM_OP(RET_VOID):
+        ret.u = 0;
+        goto ret;
+    VM_OP(RET_AGG): {
+        assert(buf_len(vm_frames) > base_frame);
+        VmFrame* caller = &vm_frames[buf_len(vm_frames) - 1];
+        ret = caller->regs[caller->dst];
+        memcpy(ret.p, R(a).p, instr->imm);
+        goto ret;
+    }
+    call: {
+        if (!--vm_steps_left)
+        {
+            goto out_of_steps;
+        }
+        VmValue* callee_regs = regs + instr->b;
+        if (callee->native)
+        {
+            if (vm_eval_sym && !callee->pure)
+            {
+                vm_error("Foreign function '%s' cannot be called at compile time", callee->sym->name);
+            }
+            ret.u = 0;
+            callee->native(callee_regs, instr->c, &ret);
+            R(a) = ret;
+            VM_NEXT();
+        }
+        char* callee_mem = mem + func->mem_size;
+        if (!callee->code)
+        {
+            if (is_decl_foreign(callee->sym->decl))
+            {
+                vm_error("Foreign function '%s' is not available in the interpreter", callee->sym->name);
+            }
+            VmValue* regs_top = vm_regs_top;
+            char* mem_top = vm_mem_top;
+            vm_regs_top = callee_regs + instr->c;
+            vm_mem_top = callee_mem;
+            vm_prepare_func(callee);
+            vm_regs_top = regs_top;
+            vm_mem_top = mem_top;
+        }
+        if (callee_regs + MAX(callee->num_regs, instr->c) > vm_regs_end || callee_mem + callee->mem_size > vm_mem_end)
+        {
+            vm_error("Stack overflow");
+        }
+        buf_push(vm_frames, (VmFrame){ func, ip, regs, mem, instr->a });
+        func = callee;
+        code = func->code;
+        ip = code;
+        regs = callee_regs;
+        mem = callee_mem;
+        VM_NEXT();
+    }
+    ret: {
+        if (buf_len(vm_frames) == base_frame)
+        {
+            return ret;
+        }
+        VmFrame frame = vm_frames[--buf__hdr(vm_frames)->len];
+        func = frame.func;
+        code = func->code;
+        ip = frame.ip;
+        regs = frame.regs;
+        mem = frame.mem;
+        regs[frame.dst] = ret;
+        VM_NEXT();
+    }
+    out_of_steps:
+        vm_error("Compile-time evaluation of %s did not finish", vm_eval_sym->name);
+#if !USE_COMPUTED_GOTO
+            default:
+                assert(0);
+                break;
+        }
+    }
+#endif
+#undef R
+#undef VM_LOAD
+#undef VM_STORE
+#undef VM_JUMP
+#undef VM_OP
+#undef VM_NEXT
+}
+
+#undef vm_error
+
+// Runs the program's main, passing it the program's name and args as argc and argv if
+// it takes them. Returns false if there is no main to run.
+bool vm_run_main(const char** args, size_t num_args, int* exit_code)
+{
+    Sym* sym = map_get(&global_syms_map, (void*)str_intern("main"));
+    if (!sym || sym->kind != SYM_FUNC)
+    {
+        printf("No main function to run\n");
+        return false;
+    }
+    Type* type = sym->type;
+    VmValue main_args[2] = { 0 };
+    size_t num_main_args = 0;
+    if (type->func.num_params == 2)
+    {
+        char** argv = xcalloc(num_args + 2, sizeof(char*));
+        argv[0] = (char*)sym->decl->pos.name;
+        memcpy(argv + 1, args, num_args * sizeof(char*));
+        main_args[0].i = num_args + 1;
+        main_args[1].p = argv;
+        num_main_args = 2;
+    }
+    VmValue ret = vm_call(vm_func(sym), main_args, num_main_args);
+    fflush(stdout);
+    *exit_code = is_integer_type(type->func.ret) ? (int)ret.i : 0;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Natives
+//
+// Foreign functions are called natively when the interpreter knows them. Varargs are
+// passed promoted in 64-bit registers, so vm_format forwards each conversion of a
+// format string to the C library with a matching argument type.
+
+int vm_format(FILE* file, const char* fmt, VmValue* args, size_t num_args)
+{
+    int count = 0;
+    size_t arg = 0;
+    while (*fmt)
+    {
+        if (*fmt != '%' || fmt[1] == '%')
+        {
+            fputc(*fmt, file);
+            fmt += *fmt == '%' ? 2 : 1;
+            count++;
+            continue;
+        }
+        const char* start = fmt++;
+        char spec[64] = "%";
+        size_t len = 1;
+        while (*fmt && strchr("-+ #0", *fmt) && len < 16)
+        {
+            spec[len++] = *fmt++;
+        }
+        for (int part = 0; part < 2; part++)
+        {
+            if (part == 1)
+            {
+                if (*fmt != '.')
+                {
+                    break;
+                }
+                spec[len++] = *fmt++;
+            }
+            if (*fmt == '*')
+            {
+                fmt++;
+                len += snprintf(spec + len, 16, "%d", arg < num_args ? (int)args[arg++].i : 0);
+            }
+            while (isdigit(*fmt) && len < 48)
+            {
+                spec[len++] = *fmt++;
+            }
+        }
+        while (*fmt && strchr("hljztL", *fmt))
+        {
+            fmt++;
+        }
+        char conv = *fmt;
+        if (!conv)
+        {
+            fputs(start, file);
+            break;
+        }
+        fmt++;
+        VmValue val = arg < num_args ? args[arg++] : (VmValue){ 0 };
+        switch (conv)
+        {
+            case 'd':
+            case 'i':
+                strcpy(spec + len, "lld");
+                count += fprintf(file, spec, (long long)val.i);
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len] = conv;
+                count += fprintf(file, spec, (unsigned long long)val.u);
+                break;
+            case 'c':
+                spec[len] = 'c';
+                count += fprintf(file, spec, (int)val.i);
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                spec[len] = conv;
+                count += fprintf(file, spec, val.d);
+                break;
+            case 's':
+            case 'p':
+                spec[len] = conv;
+                count += fprintf(file, spec, val.p);
+                break;
+            default:
+                count += fprintf(file, "%.*s", (int)(fmt - start), start);
+                arg--;
+                break;
+        }
+    }
+    return count;
+}
+
+#define VM_NATIVE(name) void vm_native_##name(VmValue* args, size_t num_args, VmValue* ret)
+
+VM_NATIVE(printf) { ret->i = vm_format(stdout, args[0].p, args + 1, num_args - 1); }
+VM_NATIVE(puts) { ret->i = puts(args[0].p); }
+VM_NATIVE(putchar) { ret->i = putchar((int)args[0].i); }
+VM_NATIVE(getchar) { ret->i = getchar(); }
+VM_NATIVE(exit) { fflush(stdout); exit((int)args[0].i); }
+VM_NATIVE(abs) { ret->i = (int32_t)abs((int)args[0].i); }
+VM_NATIVE(malloc) { ret->p = malloc(args[0].u); }
+VM_NATIVE(calloc) { ret->p = calloc(args[0].u, args[1].u); }
+VM_NATIVE(realloc) { ret->p = realloc(args[0].p, args[1].u); }
+VM_NATIVE(free) { free(args[0].p); }
+VM_NATIVE(memcpy) { ret->p = memcpy(args[0].p, args[1].p, args[2].u); }
+VM_NATIVE(memmove) { ret->p = memmove(args[0].p, args[1].p, args[2].u); }
+VM_NATIVE(memset) { ret->p = memset(args[0].p, (int)args[1].i, args[2].u); }
+VM_NATIVE(memcmp) { ret->i = memcmp(args[0].p, args[1].p, args[2].u); }
+VM_NATIVE(strlen) { ret->u = strlen(args[0].p); }
+VM_NATIVE(strcmp) { ret->i = strcmp(args[0].p, args[1].p); }
+VM_NATIVE(strncmp) { ret->i = strncmp(args[0].p, args[1].p, args[2].u); }
+VM_NATIVE(strcpy) { ret->p = strcpy(args[0].p, args[1].p); }
+VM_NATIVE(strchr) { ret->p = strchr(args[0].p, (int)args[1].i); }
+VM_NATIVE(sqrt) { ret->d = sqrt(args[0].d); }
+VM_NATIVE(sin) { ret->d = sin(args[0].d); }
+VM_NATIVE(cos) { ret->d = cos(args[0].d); }
+VM_NATIVE(fabs) { ret->d = fabs(args[0].d); }
+VM_NATIVE(floor) { ret->d = floor(args[0].d); }
+VM_NATIVE(pow) { ret->d = pow(args[0].d, args[1].d); }
+VM_NATIVE(sqrtf) { ret->f = sqrtf(args[0].f); }
+VM_NATIVE(sinf) { ret->f = sinf(args[0].f); }
+VM_NATIVE(cosf) { ret->f = cosf(args[0].f); }
+
+#define VM_NATIVE_ENTRY(name, pure) { #name, vm_native_##name, pure }
+
+struct {
+    const char* name;
+    VmNative func;
+    bool pure;
+} vm_natives[] = {
+    VM_NATIVE_ENTRY(printf, false),
+    VM_NATIVE_ENTRY(puts, false),
+    VM_NATIVE_ENTRY(putchar, false),
+    VM_NATIVE_ENTRY(getchar, false),
+    VM_NATIVE_ENTRY(exit, false),
+    VM_NATIVE_ENTRY(abs, true),
+    VM_NATIVE_ENTRY(malloc, false),
+    VM_NATIVE_ENTRY(calloc, false),
+    VM_NATIVE_ENTRY(realloc, false),
+    VM_NATIVE_ENTRY(free, false),
+    VM_NATIVE_ENTRY(memcpy, true),
+    VM_NATIVE_ENTRY(memmove, true),
+    VM_NATIVE_ENTRY(memset, true),
+    VM_NATIVE_ENTRY(memcmp, true),
+    VM_NATIVE_ENTRY(strlen, true),
+    VM_NATIVE_ENTRY(strcmp, true),
+    VM_NATIVE_ENTRY(strncmp, true),
+    VM_NATIVE_ENTRY(strcpy, true),
+    VM_NATIVE_ENTRY(strchr, true),
+    VM_NATIVE_ENTRY(sqrt, true),
+    VM_NATIVE_ENTRY(sin, true),
+    VM_NATIVE_ENTRY(cos, true),
+    VM_NATIVE_ENTRY(fabs, true),
+    VM_NATIVE_ENTRY(floor, true),
+    VM_NATIVE_ENTRY(pow, true),
+    VM_NATIVE_ENTRY(sqrtf, true),
+    VM_NATIVE_ENTRY(sinf, true),
+    VM_NATIVE_ENTRY(cosf, true),
+};
+
+#undef VM_NATIVE_ENTRY
+#undef VM_NATIVE
+
+VmNative vm_find_native(const char* name, bool* pure)
+{
+    for (size_t i = 0; i < sizeof(vm_natives) / sizeof(*vm_natives); i++)
+    {
+        if (strcmp(vm_natives[i].name, name) == 0)
+        {
+            *pure = vm_natives[i].pure;
+            return vm_natives[i].func;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,520 @@
+// Watch mode: the compiler keeps running and rebuilds its output when an input file
+// changes (-watch) or when a client asks over a local socket (-serve). Interned
+// strings, keywords, builtin syms and the type caches built from builtin types live
+// for the whole session. Only files that changed are parsed again, and function
+// definitions are reused through the compilation cache kept in memory, so a rebuild
+// after a small edit mostly costs resolving the global declarations.
+//
+// A client sends one line, "build" or "quit". For "build" the server rebuilds if any
+// input has changed and sends back what the compiler printed, ending with
+// "Compilation succeeded." or "Compilation failed.", then closes the connection.
+
+#define WATCH_POLL_MS 100
+// Editors often save a file in several steps, so wait for them to settle.
+#define WATCH_SETTLE_MS 20
+
+typedef struct WatchFile {
+    const char* path;
+    FileStamp stamp;
+    // NULL until the file has been parsed successfully since it last changed.
+    DeclSet* declset;
+    Arena arena;
+    bool reparsed;
+} WatchFile;
+
+const char** watch_paths;
+size_t num_watch_paths;
+const char* watch_c_path;
+bool watch_show_stats;
+Map watch_files;
+// The inputs of the last build, in order, to tell whether anything changed since.
+WatchFile** watch_build_files;
+Decl** watch_decls;
+// Kept between builds like the buffers above, so that a failed build does not leak it.
+ParseJob* watch_jobs;
+bool watch_built;
+
+// Directories are listed again each time, so that added and removed files are noticed.
+const char** watch_list_inputs(void)
+{
+    const char** inputs = NULL;
+    for (size_t i = 0; i < num_watch_paths; i++)
+    {
+        if (is_dir(watch_paths[i]))
+        {
+            const char** dir_paths = dir_list_files(watch_paths[i], "ion");
+            for (size_t j = 0; j < buf_len(dir_paths); j++)
+            {
+                buf_push(inputs, dir_paths[j]);
+            }
+            buf_free(dir_paths);
+        }
+        else
+        {
+            buf_push(inputs, strf("%s", watch_paths[i]));
+        }
+    }
+    return inputs;
+}
+
+void watch_free_inputs(const char** inputs)
+{
+    for (size_t i = 0; i < buf_len(inputs); i++)
+    {
+        free((void*)inputs[i]);
+    }
+    buf_free(inputs);
+}
+
+bool watch_inputs_changed(void)
+{
+    const char** inputs = watch_list_inputs();
+    bool changed = buf_len(inputs) != buf_len(watch_build_files);
+    for (size_t i = 0; i < buf_len(inputs) && !changed; i++)
+    {
+        WatchFile* file = watch_build_files[i];
+        FileStamp stamp = { 0 };
+        get_file_stamp(inputs[i], &stamp);
+        changed = strcmp(file->path, inputs[i]) != 0 || memcmp(&stamp, &file->stamp, sizeof(stamp)) != 0;
+    }
+    watch_free_inputs(inputs);
+    return changed;
+}
+
+bool watch_build(void)
+{
+    double start_time = get_time();
+    stats = (Stats) { 0 };
+    memset(phase_results, 0, sizeof(phase_results));
+    reset_global_syms();
+
+    const char** inputs = watch_list_inputs();
+    buf_clear(watch_build_files);
+    buf_clear(watch_jobs);
+    for (size_t i = 0; i < buf_len(inputs); i++)
+    {
+        const char* path = str_intern(inputs[i]);
+        WatchFile* file = map_get(&watch_files, (void*)path);
+        if (!file)
+        {
+            file = xcalloc(1, sizeof(WatchFile));
+            file->path = path;
+            map_put(&watch_files, (void*)path, file);
+        }
+        FileStamp stamp = { 0 };
+        get_file_stamp(path, &stamp);
+        file->reparsed = !file->declset || memcmp(&stamp, &file->stamp, sizeof(stamp)) != 0;
+        if (file->reparsed)
+        {
+            arena_free(&file->arena);
+            file->arena = (Arena) { 0 };
+            file->declset = NULL;
+            file->stamp = stamp;
+            buf_push(watch_jobs, (ParseJob) { .path = path, .arena = &file->arena });
+        }
+        buf_push(watch_build_files, file);
+    }
+    watch_free_inputs(inputs);
+    if (buf_len(watch_build_files) == 0)
+    {
+        printf("No .ion files in %s\n", watch_paths[0]);
+        return false;
+    }
+
+    phase_begin(PHASE_PARSE);
+    if (buf_len(watch_jobs))
+    {
+        run_parse_jobs(watch_jobs, buf_len(watch_jobs));
+    }
+    phase_end(PHASE_PARSE);
+    bool read_failed = false;
+    for (size_t i = 0; i < buf_len(watch_jobs); i++)
+    {
+        ParseJob* job = &watch_jobs[i];
+        if (job->read_failed)
+        {
+            printf("Failed to read %s\n", job->path);
+            read_failed = true;
+        }
+        WatchFile* file = map_get(&watch_files, (void*)job->path);
+        file->declset = job->declset;
+    }
+    size_t num_parsed = buf_len(watch_jobs);
+    if (read_failed)
+    {
+        return false;
+    }
+
+    buf_clear(watch_decls);
+    for (size_t i = 0; i < buf_len(watch_build_files); i++)
+    {
+        WatchFile* file = watch_build_files[i];
+        for (size_t j = 0; j < file->declset->num_decls; j++)
+        {
+            Decl* decl = file->declset->decls[j];
+            if (!file->reparsed)
+            {
+                clear_decl_types(decl);
+            }
+            buf_push(watch_decls, decl);
+        }
+    }
+    DeclSet declset = { watch_decls, buf_len(watch_decls) };
+    if (!ion_compile_decls(&declset, watch_c_path))
+    {
+        printf("Failed to write %s\n", watch_c_path);
+        return false;
+    }
+    cache_keep_funcs();
+    printf("Built %s in %.1f ms: parsed %zu of %zu files, reused %zu of %zu functions\n",
+        watch_c_path, (get_time() - start_time) * 1000.0, num_parsed, buf_len(watch_build_files),
+        stats.num_cache_hits, stats.num_cache_hits + stats.num_cache_misses);
+    return true;
+}
+
+// Errors unwind to here rather than exiting, leaving the last output in place.
+bool watch_rebuild(void)
+{
+    jmp_buf jmp;
+    fatal_jmp = &jmp;
+    if (setjmp(jmp))
+    {
+        fatal_jmp = NULL;
+        intern_lock_end();
+        type_cache_lock_enabled = false;
+        watch_built = false;
+        return false;
+    }
+    watch_built = watch_build();
+    fatal_jmp = NULL;
+    return watch_built;
+}
+
+void watch_rebuild_and_report(void)
+{
+    if (watch_rebuild())
+    {
+        if (watch_show_stats)
+        {
+            print_stats();
+        }
+        printf("Compilation succeeded.\n");
+    }
+    else
+    {
+        printf("Compilation failed.\n");
+    }
+    fflush(stdout);
+}
+
+#ifdef _WIN32
+
+int ion_watch(const char** paths, size_t num_paths, bool watch, const char* socket_path, bool show_stats)
+{
+    if (socket_path)
+    {
+        printf("-serve is not supported on Windows\n");
+        return 1;
+    }
+    watch_paths = paths;
+    num_watch_paths = num_paths;
+    watch_c_path = ion_output_path(paths, num_paths);
+    watch_show_stats = show_stats;
+    if (!watch_c_path)
+    {
+        printf("Cannot name the output after %s\n", paths[0]);
+        return 1;
+    }
+    init_builtins();
+    cache_enabled = true;
+    cache_in_memory = true;
+    resolve_deps_enabled = true;
+    watch_rebuild_and_report();
+    for (;;)
+    {
+        Sleep(WATCH_POLL_MS);
+        if (watch_inputs_changed())
+        {
+            watch_rebuild_and_report();
+        }
+    }
+}
+
+int ion_connect(const char* socket_path)
+{
+    printf("-connect is not supported on Windows\n");
+    return 1;
+}
+
+#else
+
+// Wakes the server up when a .ion file is written, created, moved or deleted in any of
+// the directories holding the inputs. Returns -1 where inotify is unavailable, in
+// which case the inputs are polled instead.
+int watch_inotify_init(void)
+{
+#ifdef __linux__
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE;
+    for (size_t i = 0; i < num_watch_paths; i++)
+    {
+        const char* dir = watch_paths[i];
+        if (!is_dir(dir))
+        {
+            const char* slash = strrchr(dir, '/');
+            dir = slash ? strf("%.*s", (int)(slash - dir + 1), dir) : ".";
+        }
+        if (inotify_add_watch(fd, dir, mask) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+// Drains the pending events and returns whether any of them named a .ion file.
+bool watch_inotify_read(int fd)
+{
+    bool found = false;
+#ifdef __linux__
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;)
+    {
+        ssize_t len = read(fd, events, sizeof(events));
+        if (len <= 0)
+        {
+            break;
+        }
+        for (char* ptr = events; ptr < events + len;)
+        {
+            struct inotify_event* event = (struct inotify_event*)ptr;
+            const char* ext = event->len ? get_ext(event->name) : NULL;
+            found |= ext && strcmp(ext, "ion") == 0;
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+#endif
+    return found;
+}
+
+bool watch_socket_addr(const char* socket_path, struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr->sun_path))
+    {
+        printf("Socket path too long: %s\n", socket_path);
+        return false;
+    }
+    strcpy(addr->sun_path, socket_path);
+    return true;
+}
+
+int watch_listen(const char* socket_path)
+{
+    struct sockaddr_un addr;
+    if (!watch_socket_addr(socket_path, &addr))
+    {
+        return -1;
+    }
+    // A socket left behind by a server that did not shut down cleanly is replaced, but
+    // nothing else is.
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(socket_path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Returns false if the client asked the server to stop.
+bool watch_serve_client(int client)
+{
+    // A client that connects without sending anything must not stall the server.
+    struct timeval timeout = { 1, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[64];
+    size_t len = 0;
+    while (len < sizeof(request) - 1)
+    {
+        ssize_t n = read(client, request + len, 1);
+        if (n <= 0 || request[len] == '\n')
+        {
+            break;
+        }
+        len++;
+    }
+    request[len] = 0;
+    if (strcmp(request, "quit") == 0)
+    {
+        return false;
+    }
+    if (strcmp(request, "build") != 0)
+    {
+        const char* reply = "Unknown request\n";
+        write(client, reply, strlen(reply));
+        return true;
+    }
+    // Everything the compiler prints while building, errors included, goes to the client.
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    dup2(client, STDOUT_FILENO);
+    if (!watch_built || watch_inputs_changed())
+    {
+        watch_rebuild_and_report();
+    }
+    else
+    {
+        printf("Compilation succeeded.\n");
+        fflush(stdout);
+    }
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    printf("Served a build request: %s\n", watch_built ? "succeeded" : "failed");
+    fflush(stdout);
+    return true;
+}
+
+int ion_watch(const char** paths, size_t num_paths, bool watch, const char* socket_path, bool show_stats)
+{
+    watch_paths = paths;
+    num_watch_paths = num_paths;
+    watch_c_path = ion_output_path(paths, num_paths);
+    watch_show_stats = show_stats;
+    if (!watch_c_path)
+    {
+        printf("Cannot name the output after %s\n", paths[0]);
+        return 1;
+    }
+    int inotify_fd = watch ? watch_inotify_init() : -1;
+    int listen_fd = -1;
+    if (socket_path)
+    {
+        listen_fd = watch_listen(socket_path);
+        if (listen_fd < 0)
+        {
+            printf("Failed to listen on %s\n", socket_path);
+            return 1;
+        }
+        // A client that disconnects early must not take the server down with it.
+        signal(SIGPIPE, SIG_IGN);
+    }
+    init_builtins();
+    cache_enabled = true;
+    cache_in_memory = true;
+    resolve_deps_enabled = true;
+    watch_rebuild_and_report();
+
+    bool running = true;
+    while (running)
+    {
+        struct pollfd fds[2];
+        nfds_t num_fds = 0;
+        if (inotify_fd >= 0)
+        {
+            fds[num_fds++] = (struct pollfd) { inotify_fd, POLLIN, 0 };
+        }
+        if (listen_fd >= 0)
+        {
+            fds[num_fds++] = (struct pollfd) { listen_fd, POLLIN, 0 };
+        }
+        bool polling = watch && inotify_fd < 0;
+        if (poll(fds, num_fds, polling ? WATCH_POLL_MS : -1) < 0 && errno != EINTR)
+        {
+            break;
+        }
+        bool check = polling;
+        for (nfds_t i = 0; i < num_fds; i++)
+        {
+            if (!(fds[i].revents & POLLIN))
+            {
+                continue;
+            }
+            if (fds[i].fd == inotify_fd && watch_inotify_read(inotify_fd))
+            {
+                poll(NULL, 0, WATCH_SETTLE_MS);
+                watch_inotify_read(inotify_fd);
+                check = true;
+            }
+            else if (fds[i].fd == listen_fd)
+            {
+                int client = accept(listen_fd, NULL, NULL);
+                if (client >= 0)
+                {
+                    running = watch_serve_client(client);
+                    close(client);
+                }
+            }
+        }
+        if (running && check && watch_inputs_changed())
+        {
+            watch_rebuild_and_report();
+        }
+    }
+    if (listen_fd >= 0)
+    {
+        close(listen_fd);
+        unlink(socket_path);
+    }
+    if (inotify_fd >= 0)
+    {
+        close(inotify_fd);
+    }
+    return 0;
+}
+
+// Asks a server started with -serve for a build and prints its reply.
+int ion_connect(const char* socket_path)
+{
+    struct sockaddr_un addr;
+    if (!watch_socket_addr(socket_path, &addr))
+    {
+        return 1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        printf("Failed to connect to %s\n", socket_path);
+        return 1;
+    }
+    const char* request = "build\n";
+    write(fd, request, strlen(request));
+    char* reply = NULL;
+    char chunk[4096];
+    for (;;)
+    {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0)
+        {
+            break;
+        }
+        buf_append(reply, chunk, n);
+    }
+    close(fd);
+    const char* success = "Compilation succeeded.\n";
+    size_t success_len = strlen(success);
+    bool succeeded = buf_len(reply) >= success_len && memcmp(reply + buf_len(reply) - success_len, success, success_len) == 0;
+    fwrite(reply, 1, buf_len(reply), stdout);
+    buf_free(reply);
+    return succeeded ? 0 : 1;
+}
+
+#endif